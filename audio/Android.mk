@@ -24,9 +24,65 @@ include $(CLEAR_VARS)
 
 LOCAL_MODULE := audio.primary.tcc892x
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
-LOCAL_SRC_FILES := audio_hw.c
+LOCAL_SRC_FILES := audio_hw.c iec61937.c mmap_out.c polyphase.c remix.c
 LOCAL_C_INCLUDES += external/tinyalsa/include
 LOCAL_SHARED_LIBRARIES := liblog libcutils libtinyalsa
 LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_SHARED_LIBRARY)
+
+# Host build of the same module against a simulated sound card, see
+# host/tinyalsa_sim.c, to run the HAL end to end off-device
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := libtinyalsa_sim
+LOCAL_SRC_FILES := host/tinyalsa_sim.c
+LOCAL_C_INCLUDES += external/tinyalsa/include
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio.primary.tcc892x
+LOCAL_SRC_FILES := audio_hw.c iec61937.c mmap_out.c polyphase.c remix.c
+LOCAL_C_INCLUDES += external/tinyalsa/include
+LOCAL_STATIC_LIBRARIES := libtinyalsa_sim libcutils liblog
+LOCAL_LDLIBS := -lpthread -lrt -lm
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_SHARED_LIBRARY)
+
+# The Jelly Bean port on the same simulated card, against stand-ins for the
+# HAL API it is written for, see host/jb
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio.primary.tcc892x_port
+LOCAL_SRC_FILES := __portaudio_hw.c mmap_out.c polyphase.c remix.c
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/host/jb external/tinyalsa/include
+LOCAL_STATIC_LIBRARIES := libtinyalsa_sim libcutils liblog
+LOCAL_LDLIBS := -lpthread -lrt -lm
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_SHARED_LIBRARY)
+
+# Benchmark of the module above, for the device and for the host build
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_hw_bench
+LOCAL_SRC_FILES := bench/audio_hw_bench.c
+LOCAL_SHARED_LIBRARIES := libdl libm
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_hw_bench
+LOCAL_SRC_FILES := bench/audio_hw_bench.c
+LOCAL_LDLIBS := -ldl -lm -lpthread -lrt
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(LOCAL_PATH)/tests/Android.mk
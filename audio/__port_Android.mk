@@ -18,8 +18,8 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 LOCAL_MODULE := audio.primary.tcc892x
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
-LOCAL_SRC_FILES := audio_hw.c
+LOCAL_SRC_FILES := audio_hw.c mmap_out.c polyphase.c remix.c
 LOCAL_C_INCLUDES += external/tinyalsa/include system/media/audio_utils/include
-LOCAL_SHARED_LIBRARIES := liblog libcutils libtinyalsa libaudioutils
+LOCAL_SHARED_LIBRARIES := liblog libcutils libtinyalsa
 LOCAL_MODULE_TAGS := optional
 include $(BUILD_SHARED_LIBRARY)
@@ -27,6 +27,12 @@
 #define OUT_PERIOD_SIZE 1024
 #define OUT_PERIOD_COUNT 2
 
+// Opt-in zero-copy output through the PCM DMA buffer
+#define OUT_PROPERTY_MMAP "audio.out.mmap"
+
+// low, medium or high, see polyphase.h
+#define RESAMPLER_PROPERTY_QUALITY "audio.resampler.quality"
+
 #define IN_SAMPLE_RATE 48000
 #define IN_CHANNELS 2
 #define IN_PERIOD_SIZE 64
@@ -35,9 +41,13 @@
 #include <errno.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
 
 #include <hardware/hardware.h>
 #include <system/audio.h>
@@ -46,7 +56,10 @@
 #include <tinyalsa/asoundlib.h>
 
 //~ #include <audio_utils/primitives.h>
-#include <audio_utils/resampler.h>
+
+#include "mmap_out.h"
+#include "polyphase.h"
+#include "remix.h"
 
 /* Forward declarations */ //// FIX THIS!! -- BEFORE RELEASE -- STYLE!!!
 static int adev_close(hw_device_t *device);
@@ -131,13 +144,14 @@ struct audio_device {
     unsigned int in_channels;
     unsigned int in_period_size;
     unsigned int in_period_count;
+
+    enum polyphase_quality resampler_quality;
 };
 
 static int adev_open(const hw_module_t* module, const char* name,
                      hw_device_t** device)
 {
     struct audio_device *adev;
-    int ret;
 
     if (strcmp(name, AUDIO_HARDWARE_INTERFACE) != 0)
         return -EINVAL;
@@ -183,6 +197,12 @@ static int adev_open(const hw_module_t* module, const char* name,
     adev->in_period_size = IN_PERIOD_SIZE;
     adev->in_period_count = IN_PERIOD_COUNT;
     
+    char value[PROPERTY_VALUE_MAX];
+    property_get(RESAMPLER_PROPERTY_QUALITY, value, "medium");
+    adev->resampler_quality = polyphase_quality_from_name(value, POLYPHASE_QUALITY_MEDIUM);
+    // Design the filters of the usual rates now rather than on the first write
+    polyphase_preload(adev->resampler_quality);
+
     ALOGV("Opening device: out_rate = %i, out_channels = %i, out_period = %i, out_count = %i, in_rate = %i, in_channels = %i, in_period = %i, in_count = %i",
             adev->out_sample_rate, adev->out_channels, adev->out_period_size, adev->out_period_count,
             adev->in_sample_rate, adev->in_channels, adev->in_period_size, adev->in_period_count);
@@ -263,6 +283,202 @@ static int adev_get_mic_mute(const struct audio_hw_device *dev, bool *state)
     return -ENOSYS;
 }
 
+/* Conversion pipeline */
+
+/*
+ * The output and capture conversions are chains of buffer providers, each
+ * pulling frames from the one before it. A stage keeps whatever its consumer
+ * did not take for the next call, and every buffer is allocated when the
+ * stream is opened, so nothing is dropped or allocated while streaming.
+ */
+struct buffer_provider {
+    // Points *buffer at up to *frames frames; 0 frames when the source is dry
+    int (*get_next_buffer)(struct buffer_provider *provider, const int16_t **buffer, size_t *frames);
+    // The consumer used this many of the frames it was given
+    void (*release_buffer)(struct buffer_provider *provider, size_t frames);
+};
+
+#define PROVIDER_ALL_FRAMES ((size_t)-1)
+
+// The frames passed to out_write()
+struct source_provider {
+    struct buffer_provider provider;
+    const int16_t *data;
+    size_t frames;
+    unsigned int channels;
+};
+
+struct pipeline_stage;
+typedef int (*stage_fill_t)(struct pipeline_stage *stage);
+
+// A stage serves frames from its buffer and calls fill() once it is empty
+struct pipeline_stage {
+    struct buffer_provider provider;
+    struct buffer_provider *upstream;
+    stage_fill_t fill;
+    int16_t *buffer;
+    size_t capacity;
+    unsigned int channels;
+    size_t offset;
+    size_t frames;
+
+    // Resampler stage; created on the first standby exit
+    struct polyphase **resampler;
+    // Remix stage
+    unsigned int in_channels;
+    // Capture stage; the PCM is reopened on every standby exit
+    struct pcm **pcm;
+};
+
+static int source_get_next_buffer(struct buffer_provider *provider, const int16_t **buffer, size_t *frames)
+{
+    struct source_provider *source = (struct source_provider *)provider;
+    if (*frames > source->frames)
+        *frames = source->frames;
+    *buffer = source->data;
+    return 0;
+}
+
+static void source_release_buffer(struct buffer_provider *provider, size_t frames)
+{
+    struct source_provider *source = (struct source_provider *)provider;
+    source->data += frames * source->channels;
+    source->frames -= frames;
+}
+
+static void source_set(struct source_provider *source, const void *data, size_t frames)
+{
+    source->data = (const int16_t *)data;
+    source->frames = frames;
+}
+
+static void source_init(struct source_provider *source, unsigned int channels)
+{
+    source->provider.get_next_buffer = source_get_next_buffer;
+    source->provider.release_buffer = source_release_buffer;
+    source->data = NULL;
+    source->frames = 0;
+    source->channels = channels;
+}
+
+static int stage_get_next_buffer(struct buffer_provider *provider, const int16_t **buffer, size_t *frames)
+{
+    struct pipeline_stage *stage = (struct pipeline_stage *)provider;
+    if (!stage->frames) {
+        int ret;
+        stage->offset = 0;
+        ret = stage->fill(stage);
+        if (ret) {
+            *frames = 0;
+            return ret;
+        }
+    }
+    if (*frames > stage->frames)
+        *frames = stage->frames;
+    *buffer = stage->buffer + stage->offset * stage->channels;
+    return 0;
+}
+
+static void stage_release_buffer(struct buffer_provider *provider, size_t frames)
+{
+    struct pipeline_stage *stage = (struct pipeline_stage *)provider;
+    stage->offset += frames;
+    stage->frames -= frames;
+}
+
+static void stage_init(struct pipeline_stage *stage, stage_fill_t fill, struct buffer_provider *upstream,
+                       void *buffer, size_t capacity, unsigned int channels)
+{
+    memset(stage, 0, sizeof(struct pipeline_stage));
+    stage->provider.get_next_buffer = stage_get_next_buffer;
+    stage->provider.release_buffer = stage_release_buffer;
+    stage->upstream = upstream;
+    stage->fill = fill;
+    stage->buffer = (int16_t *)buffer;
+    stage->capacity = capacity;
+    stage->channels = channels;
+}
+
+// Drops the frames a stage still holds, e.g. stale capture after standby
+static void stage_reset(struct pipeline_stage *stage)
+{
+    stage->offset = 0;
+    stage->frames = 0;
+}
+
+static int stage_fill_resample(struct pipeline_stage *stage)
+{
+    // The filter history can take input without giving output yet, so keep pulling
+    while (!stage->frames) {
+        const int16_t *in;
+        size_t in_frames = PROVIDER_ALL_FRAMES;
+        size_t out_frames = stage->capacity;
+        int ret = stage->upstream->get_next_buffer(stage->upstream, &in, &in_frames);
+        if (ret || !in_frames)
+            return ret;
+        polyphase_process(*stage->resampler, in, &in_frames, stage->buffer, &out_frames);
+        stage->upstream->release_buffer(stage->upstream, in_frames);
+        stage->frames = out_frames;
+    }
+    return 0;
+}
+
+static int stage_fill_remix(struct pipeline_stage *stage)
+{
+    const int16_t *in;
+    size_t frames = stage->capacity;
+    int ret = stage->upstream->get_next_buffer(stage->upstream, &in, &frames);
+    if (ret || !frames)
+        return ret;
+    // The only supported conversions for now are: mono -> stereo, stereo -> mono
+    if (stage->in_channels > stage->channels)
+        remix_stereo_to_mono_i16(stage->buffer, in, frames);
+    else
+        remix_mono_to_stereo_i16(stage->buffer, in, frames);
+    stage->upstream->release_buffer(stage->upstream, frames);
+    stage->frames = frames;
+    return 0;
+}
+
+static int stage_fill_pcm_read(struct pipeline_stage *stage)
+{
+    if (pcm_read(*stage->pcm, stage->buffer, stage->capacity * stage->channels * sizeof(int16_t))) {
+        ALOGE("Read failed: %s", pcm_get_error(*stage->pcm));
+        return -EIO;
+    }
+    stage->frames = stage->capacity;
+    return 0;
+}
+
+/* Stream buffers */
+
+/*
+ * All scratch buffers of a stream, and its resampler, are carved from one
+ * arena, sized and allocated when the stream is opened and freed with it.
+ * Nothing on the write or read path allocates; only leaving standby does,
+ * in pcm_open().
+ */
+#define ARENA_ALIGN 32 // Cortex-A5 cache line
+
+#define ARENA_ROUND(size) (((size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static void *arena_alloc(size_t size)
+{
+    void *arena;
+    if (posix_memalign(&arena, ARENA_ALIGN, size ? size : ARENA_ALIGN))
+        return NULL;
+    memset(arena, 0, size);
+    return arena;
+}
+
+// Hands out the next buffer of the arena, NULL for an empty one
+static void *arena_take(uint8_t **cursor, size_t size)
+{
+    void *buffer = size ? *cursor : NULL;
+    *cursor += ARENA_ROUND(size);
+    return buffer;
+}
+
 /* Output stream */
 
 struct stream_out {
@@ -281,16 +497,62 @@ struct stream_out {
     size_t remix_buffer_size;
     void *remix_buffer;
 
-    struct resampler_itfe *resampler;
+    // Holds the buffers above and the resampler
+    void *arena;
+
+    struct polyphase *resampler;
+
+    // Caller buffer -> resampler -> remix -> PCM, see struct buffer_provider
+    struct source_provider source;
+    struct pipeline_stage resample_stage;
+    struct pipeline_stage remix_stage;
+    // Feeds out_mmap_remix() in PCM_MMAP mode, which remixes on its own
+    struct buffer_provider *pre_remix;
+    struct buffer_provider *tail;
 
     bool standby;
 
+    // PCM_MMAP mode: the last conversion stage writes into the DMA buffer
+    bool use_mmap;
+    struct mmap_out mmap;
+
     struct pcm_config config;
     struct pcm *pcm;
     
     struct audio_device *dev;
 };
 
+// Links the stages the stream needs; called again when its buffers change
+static void out_setup_pipeline(struct stream_out *out)
+{
+    struct buffer_provider *last = &out->source.provider;
+
+    source_init(&out->source, out->channels);
+    if (out->sample_rate != out->config.rate) {
+        // Resampling runs before the remix stage, on frames of the stream
+        stage_init(&out->resample_stage, stage_fill_resample, last, out->resampler_buffer,
+                   out->resampler_buffer_size / (out->channels * sizeof(int16_t)), out->channels);
+        out->resample_stage.resampler = &out->resampler;
+        last = &out->resample_stage.provider;
+    }
+    out->pre_remix = last;
+    if (out->remix_buffer) {
+        stage_init(&out->remix_stage, stage_fill_remix, last, out->remix_buffer,
+                   out->remix_buffer_size / (out->config.channels * sizeof(int16_t)), out->config.channels);
+        out->remix_stage.in_channels = out->channels;
+        last = &out->remix_stage.provider;
+    }
+    out->tail = last;
+}
+
+// Throws away what is left of the current write after a PCM error
+static void out_reset_pipeline(struct stream_out *out)
+{
+    out->source.frames = 0;
+    stage_reset(&out->resample_stage);
+    stage_reset(&out->remix_stage);
+}
+
 static int adev_open_output_stream(struct audio_hw_device *dev,
                                    audio_io_handle_t handle,
                                    audio_devices_t devices,
@@ -376,7 +638,12 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->resampler_buffer = NULL;
     
     out->standby = true;
+
+    char value[PROPERTY_VALUE_MAX];
+    property_get(OUT_PROPERTY_MMAP, value, "off");
+    out->use_mmap = !strcmp(value, "on");
     
+    // Also sized in PCM_MMAP mode, for the fallback to pcm_write
     if (out->channels != out->config.channels) {
         // The only supported conversions for now are: mono -> stereo, stereo -> mono
         if (out->channels > out->config.channels) {
@@ -388,30 +655,38 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
         }
     }
     
+    size_t resampler_size = 0;
     if (out->sample_rate != out->config.rate) {
         out->resampler_buffer_size = out->buffer_size;
-    }
-    
-    if (out->remix_buffer_size) {
-        out->remix_buffer = (void *)calloc(1, out->remix_buffer_size);
-        if (!out->remix_buffer) {
-            ALOGE("Failed to open output stream: remix buffer allocation failed!");
-            ret = -ENOMEM;
-            goto err_open;
-        }
-    }
-
-    if (out->resampler_buffer_size) {
-        out->resampler_buffer = (void *)calloc(1, out->resampler_buffer_size);
-        if (!out->resampler_buffer) {
-            ALOGE("Failed to open output stream: resampler buffer allocation failed!");
-            // Do not forget about other buffers!
-            if (out->remix_buffer) free(out->remix_buffer);
-            ret = -ENOMEM;
+        // Resampling runs before the remix stage, on frames of the stream
+        ret = polyphase_get_size(out->sample_rate, out->config.rate, out->channels,
+                                 ladev->resampler_quality, &resampler_size);
+        if (ret) {
+            ALOGE("Failed to open output stream: no resampler for %i -> %i", out->sample_rate, out->config.rate);
             goto err_open;
         }
     }
     
+    out->arena = arena_alloc(ARENA_ROUND(out->remix_buffer_size) + ARENA_ROUND(out->resampler_buffer_size) +
+                             ARENA_ROUND(resampler_size));
+    if (!out->arena) {
+        ALOGE("Failed to open output stream: buffer allocation failed!");
+        ret = -ENOMEM;
+        goto err_open;
+    }
+    uint8_t *cursor = (uint8_t *)out->arena;
+    out->remix_buffer = arena_take(&cursor, out->remix_buffer_size);
+    out->resampler_buffer = arena_take(&cursor, out->resampler_buffer_size);
+    void *resampler_memory = arena_take(&cursor, resampler_size);
+
+    if (resampler_memory) {
+        ALOGV("Resampler: %i -> %i", out->sample_rate, out->config.rate);
+        polyphase_init(resampler_memory, out->sample_rate, out->config.rate, out->channels,
+                       ladev->resampler_quality, &out->resampler);
+    }
+
+    out_setup_pipeline(out);
+
     ALOGV("Opening output stream: rate = %i, channels = %i, buffer = %i, m = %i, s = %i",
             out->sample_rate, out->channels, out->buffer_size, out->remix_buffer_size, out->resampler_buffer_size);
     
@@ -431,9 +706,7 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
 	if (!lostream->standby) {
         out_standby((struct audio_stream *)stream);
     }
-    if (lostream->resampler_buffer) {
-        free(lostream->resampler_buffer);
-    }
+    free(lostream->arena);
     free(stream);
 }
 
@@ -476,21 +749,29 @@ static int out_leave_standby(struct audio_stream *stream)
     struct stream_out *lostream = (struct stream_out *)stream;
     if (lostream->standby)
     {
-        lostream->pcm = pcm_open(CARD, DEVICE, PCM_OUT, &lostream->config);
+        if (lostream->use_mmap) {
+            lostream->pcm = pcm_open(CARD, DEVICE, PCM_OUT | PCM_MMAP, &lostream->config);
+            if (!lostream->pcm || !pcm_is_ready(lostream->pcm)) {
+                ALOGW("No mmap support, falling back to pcm_write: %s", pcm_get_error(lostream->pcm));
+                if (lostream->pcm)
+                    pcm_close(lostream->pcm);
+                lostream->pcm = NULL;
+                // The remix stage has had its buffer since the stream was opened
+                lostream->use_mmap = false;
+            } else {
+                mmap_out_init(&lostream->mmap, lostream->pcm, &lostream->config);
+            }
+        }
+        if (!lostream->use_mmap)
+            lostream->pcm = pcm_open(CARD, DEVICE, PCM_OUT, &lostream->config);
         if (!lostream->pcm || !pcm_is_ready(lostream->pcm))
         {
             ALOGE("Failed to open PCM: %s", pcm_get_error(lostream->pcm));
             return -1; // Maybe this should be changed to other value
         }
-        if (lostream->config.rate != lostream->sample_rate)
-        {
-            ALOGV("Resampler: %i -> %i", lostream->sample_rate, lostream->config.rate);
-            if (create_resampler(lostream->sample_rate, lostream->config.rate, lostream->config.channels, RESAMPLER_QUALITY_DEFAULT, NULL, &lostream->resampler))
-            {
-                ALOGE("Failed to create resampler");
-                return -1; // Maybe this should be changed to other value
-            }
-        }
+        // The resampler survives standby: only its history is cleared
+        if (lostream->resampler)
+            polyphase_reset(lostream->resampler);
         lostream->standby = false;
     }
     return 0;
@@ -503,11 +784,6 @@ static int out_standby(struct audio_stream *stream)
     {
         pcm_close(lostream->pcm);
         lostream->pcm = NULL;
-        if (lostream->resampler) {
-            ALOGV("Release resampler!");
-            release_resampler(lostream->resampler);
-            lostream->resampler = NULL;
-        }
         lostream->standby = true;
     }
     return 0;
@@ -539,64 +815,82 @@ static int out_set_volume(struct audio_stream_out *stream, float left,
     return 0;
 }
 
+/*
+ * Final stage of the output chain in PCM_MMAP mode: the channel remix (or a
+ * plain copy when none is needed) writes straight into the DMA buffer, so no
+ * remix buffer and no pcm_write copy are involved.
+ */
+static int out_mmap_remix(struct stream_out *lostream, const void *buffer, size_t in_frames)
+{
+    const int16_t *src = (const int16_t *)buffer;
+
+    while (in_frames) {
+        void *area;
+        unsigned int offset;
+        unsigned int frames = in_frames;
+        int ret = mmap_out_begin(&lostream->mmap, &area, &offset, &frames);
+        if (ret < 0) {
+            ALOGE("No room in the DMA buffer: %s", pcm_get_error(lostream->pcm));
+            return ret;
+        }
+        int16_t *dst = (int16_t *)area + offset * lostream->config.channels;
+        if (lostream->channels > lostream->config.channels) {
+            remix_stereo_to_mono_i16(dst, src, frames);
+        } else if (lostream->channels < lostream->config.channels) {
+            remix_mono_to_stereo_i16(dst, src, frames);
+        } else {
+            memcpy(dst, src, frames * lostream->channels * sizeof(int16_t));
+        }
+        ret = mmap_out_commit(&lostream->mmap, offset, frames);
+        if (ret < 0) {
+            ALOGE("Commit failed: %s", pcm_get_error(lostream->pcm));
+            return ret;
+        }
+        src += frames * lostream->channels;
+        in_frames -= frames;
+    }
+    return 0;
+}
+
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
                          size_t bytes)
 {
 	struct stream_out *lostream = (struct stream_out *)stream;
-	
-    //ALOGD("Bytes: %i", bytes);
-    
+	size_t frame_size = audio_stream_frame_size(&stream->common);
+	int ret = 0;
+
     if (lostream->standby && out_leave_standby((struct audio_stream *)stream))
     {
         ALOGE("Write failed! No out standby!");
-        usleep(bytes * 1000000 / audio_stream_frame_size(&stream->common) /
-           out_get_sample_rate(&stream->common));
+        usleep(bytes * 1000000 / frame_size / out_get_sample_rate(&stream->common));
         return bytes;
     }
-    
-    const void *current_buffer = buffer;
-    size_t current_bytes = bytes;
-    size_t current_frame_size = audio_stream_frame_size(&stream->common);
-    
-    size_t current_buffer_frames = current_bytes / current_frame_size;
-    size_t resampler_buffer_frames = lostream->resampler_buffer_size / current_frame_size;
-    
-    size_t processed_bytes = bytes;
-    
-    if (lostream->sample_rate != lostream->config.rate) {
-        lostream->resampler->resample_from_input(lostream->resampler,
-                                  (int16_t *)current_buffer,
-                                  &current_buffer_frames,
-                                  lostream->resampler_buffer,
-                                  &resampler_buffer_frames);
-        current_buffer = lostream->resampler_buffer;
-        current_bytes = resampler_buffer_frames * current_frame_size;
-        processed_bytes = current_buffer_frames * current_frame_size;
-    }
-    
-    if (lostream->channels != lostream->config.channels) {
-        // The only supported conversions for now are: mono -> stereo, stereo -> mono
-        if (lostream->channels > lostream->config.channels) {
-            // stereo -> mono
-            downmix_to_mono_i16_from_stereo_i16(lostream->remix_buffer, current_buffer, current_bytes / current_frame_size);
-            current_bytes /= 2;
-            current_frame_size /= 2;
-        } else {
-            // mono -> stereo
-            upmix_to_stereo_i16_from_mono_i16(lostream->remix_buffer, current_buffer, current_bytes / current_frame_size);
-            current_bytes *= 2;
-            current_frame_size *= 2;
-        }
-        current_buffer = lostream->remix_buffer;
+
+    // The PCM pulls the whole buffer through the chain, only the filter history stays behind
+    struct buffer_provider *tail = lostream->use_mmap ? lostream->pre_remix : lostream->tail;
+    source_set(&lostream->source, buffer, bytes / frame_size);
+    for (;;) {
+        const int16_t *frames;
+        size_t count = PROVIDER_ALL_FRAMES;
+        ret = tail->get_next_buffer(tail, &frames, &count);
+        if (ret || !count)
+            break;
+        if (lostream->use_mmap)
+            ret = out_mmap_remix(lostream, frames, count);
+        else
+            ret = pcm_write(lostream->pcm, frames, pcm_frames_to_bytes(lostream->pcm, count));
+        tail->release_buffer(tail, count);
+        if (ret)
+            break;
     }
-    
-    if (pcm_write(lostream->pcm, current_buffer, current_bytes)) {
+
+    if (ret) {
         ALOGE("Write failed");
-        usleep(bytes * 1000000 / audio_stream_frame_size(&stream->common) /
-           out_get_sample_rate(&stream->common));
-        }
-    
-    return processed_bytes; // Still not sure if it is right!
+        out_reset_pipeline(lostream);
+        usleep(bytes * 1000000 / frame_size / out_get_sample_rate(&stream->common));
+    }
+
+    return bytes;
 }
 
 static int out_get_render_position(const struct audio_stream_out *stream,
@@ -642,7 +936,16 @@ struct stream_in {
     size_t remix_buffer_size;
     void *remix_buffer;
 
-    struct resampler_itfe *resampler;
+    // Holds the buffers above and the resampler
+    void *arena;
+
+    struct polyphase *resampler;
+
+    // PCM -> resampler -> remix -> caller buffer, see struct buffer_provider
+    struct pipeline_stage pcm_stage;
+    struct pipeline_stage resample_stage;
+    struct pipeline_stage remix_stage;
+    struct buffer_provider *tail;
 
     bool standby;
 
@@ -691,21 +994,18 @@ static int in_leave_standby(struct audio_stream *stream)
     struct stream_in *listream = (struct stream_in *)stream;
     if (listream->standby)
     {
+        // Whatever the stages kept from before standby is stale now
+        stage_reset(&listream->pcm_stage);
+        stage_reset(&listream->resample_stage);
+        stage_reset(&listream->remix_stage);
         listream->pcm = pcm_open(CARD, DEVICE, PCM_IN, &listream->config);
         if (!listream->pcm || !pcm_is_ready(listream->pcm))
         {
             ALOGE("Failed to open PCM: %s", pcm_get_error(listream->pcm));
             return -1; // Maybe this should be changed to other value
         }
-        if (listream->config.rate != listream->sample_rate)
-        {
-            ALOGV("Resampler: %i -> %i", listream->config.rate, listream->sample_rate);
-            if (create_resampler(listream->config.rate, listream->sample_rate, listream->config.channels, RESAMPLER_QUALITY_DEFAULT, NULL, &listream->resampler))
-            {
-                ALOGE("Failed to create resampler");
-                return -1; // Maybe this should be changed to other value
-            }
-        }
+        if (listream->resampler)
+            polyphase_reset(listream->resampler);
         listream->standby = false;
     }
     return 0;
@@ -718,11 +1018,6 @@ static int in_standby(struct audio_stream *stream)
     {
         pcm_close(listream->pcm);
         listream->pcm = NULL;
-        if (listream->resampler) {
-            ALOGV("Release resampler!");
-            release_resampler(listream->resampler);
-            listream->resampler = NULL;
-        }
         listream->standby = true;
     }
     return 0;
@@ -753,67 +1048,39 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
                        size_t bytes)
 {
     struct stream_in *listream = (struct stream_in *)stream;
-	
-    //ALOGD("Bytes: %i", bytes);
-    
+    size_t frame_size = audio_stream_frame_size(&stream->common);
+    size_t wanted = bytes / frame_size;
+    uint8_t *dst = (uint8_t *)buffer;
+    int ret = 0;
+
     if (listream->standby && in_leave_standby((struct audio_stream *)stream))
     {
         ALOGE("Read failed! No out standby!");
-        usleep(bytes * 1000000 / audio_stream_frame_size(&stream->common) /
-           in_get_sample_rate(&stream->common));
+        memset(buffer, 0, bytes);
+        usleep(bytes * 1000000 / frame_size / in_get_sample_rate(&stream->common));
         return bytes;
     }
-    
-    ALOGV("read_buffer_size = %i", listream->read_buffer_size);
-    
-    if (pcm_read(listream->pcm, listream->read_buffer, listream->read_buffer_size)) {
-        ALOGE("Read failed");
-        usleep(bytes * 1000000 / audio_stream_frame_size(&stream->common) /
-           in_get_sample_rate(&stream->common));
-        }
-    
-    const void *current_buffer = listream->read_buffer;
-    size_t current_bytes = listream->read_buffer_size;
-    size_t current_frame_size = 2 * listream->dev->in_channels;
-    
-    size_t current_buffer_frames = current_bytes / current_frame_size;
-    size_t resampler_buffer_frames = listream->resampler_buffer_size / current_frame_size;
-    
-    size_t processed_bytes = current_bytes;
-    
-    if (listream->sample_rate != listream->config.rate) {
-        listream->resampler->resample_from_input(listream->resampler,
-                                  (int16_t *)current_buffer,
-                                  &current_buffer_frames,
-                                  listream->resampler_buffer,
-                                  &resampler_buffer_frames);
-        current_buffer = listream->resampler_buffer;
-        current_bytes = resampler_buffer_frames * current_frame_size;
-        processed_bytes = current_buffer_frames * current_frame_size;
-        ALOGV("current_bytes = %i, processed_bytes = %i", current_bytes, processed_bytes);
+
+    // Frames the caller does not take stay in the stages for the next read
+    while (wanted) {
+        const int16_t *frames;
+        size_t count = wanted;
+        ret = listream->tail->get_next_buffer(listream->tail, &frames, &count);
+        if (ret || !count)
+            break;
+        memcpy(dst, frames, count * frame_size);
+        listream->tail->release_buffer(listream->tail, count);
+        dst += count * frame_size;
+        wanted -= count;
     }
-    
-    if (listream->channels != listream->config.channels) {
-        // The only supported conversions for now are: mono -> stereo, stereo -> mono
-        if (listream->channels < listream->config.channels) {
-            // stereo -> mono
-            downmix_to_mono_i16_from_stereo_i16(listream->remix_buffer, current_buffer, current_bytes / current_frame_size);
-            current_bytes /= 2;
-            current_frame_size /= 2;
-        } else {
-            // mono -> stereo
-            upmix_to_stereo_i16_from_mono_i16(listream->remix_buffer, current_buffer, current_bytes / current_frame_size);
-            current_bytes *= 2;
-            current_frame_size *= 2;
-        }
-        current_buffer = listream->remix_buffer;
+
+    if (wanted) {
+        ALOGE("Read failed");
+        memset(dst, 0, wanted * frame_size);
+        usleep(bytes * 1000000 / frame_size / in_get_sample_rate(&stream->common));
     }
-    
-    ALOGV("bytes = %i, current_bytes = %i", bytes, current_bytes);
-    ALOGW_IF(current_bytes > bytes, "current_bytes > bytes! %i > %i", current_bytes, bytes);
-    memcpy(buffer, current_buffer, current_bytes);
-    
-    return current_bytes; // Still not sure if it is right!
+
+    return bytes;
 }
 
 static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
@@ -838,6 +1105,30 @@ static size_t adev_get_input_buffer_size(const struct audio_hw_device *dev,
     return ladev->in_period_size * 2 * ladev->in_channels;
 }
 
+static void in_setup_pipeline(struct stream_in *in)
+{
+    struct buffer_provider *last;
+
+    stage_init(&in->pcm_stage, stage_fill_pcm_read, NULL, in->read_buffer,
+               in->read_buffer_size / (in->config.channels * sizeof(int16_t)), in->config.channels);
+    in->pcm_stage.pcm = &in->pcm;
+    last = &in->pcm_stage.provider;
+    if (in->sample_rate != in->config.rate) {
+        // Capture resamples on frames of the PCM, before the remix stage
+        stage_init(&in->resample_stage, stage_fill_resample, last, in->resampler_buffer,
+                   in->resampler_buffer_size / (in->config.channels * sizeof(int16_t)), in->config.channels);
+        in->resample_stage.resampler = &in->resampler;
+        last = &in->resample_stage.provider;
+    }
+    if (in->remix_buffer) {
+        stage_init(&in->remix_stage, stage_fill_remix, last, in->remix_buffer,
+                   in->remix_buffer_size / (in->channels * sizeof(int16_t)), in->channels);
+        in->remix_stage.in_channels = in->config.channels;
+        last = &in->remix_stage.provider;
+    }
+    in->tail = last;
+}
+
 static int adev_open_input_stream(struct audio_hw_device *dev,
                                   audio_io_handle_t handle,
                                   audio_devices_t devices,
@@ -933,40 +1224,38 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
         }
     }
     
+    size_t resampler_size = 0;
     if (in->sample_rate != in->config.rate) {
         in->resampler_buffer_size = in->read_buffer_size;
+        ret = polyphase_get_size(in->config.rate, in->sample_rate, in->config.channels,
+                                 ladev->resampler_quality, &resampler_size);
+        if (ret) {
+            ALOGE("Failed to open input stream: no resampler for %i -> %i", in->config.rate, in->sample_rate);
+            goto err_open;
+        }
     }
     
-    in->read_buffer = (void *)calloc(1, in->read_buffer_size);
-    if (!in->read_buffer) {
-        ALOGE("Failed to open input stream: read buffer allocation failed!");
+    in->arena = arena_alloc(ARENA_ROUND(in->read_buffer_size) + ARENA_ROUND(in->remix_buffer_size) +
+                            ARENA_ROUND(in->resampler_buffer_size) + ARENA_ROUND(resampler_size));
+    if (!in->arena) {
+        ALOGE("Failed to open input stream: buffer allocation failed!");
         ret = -ENOMEM;
         goto err_open;
     }
-    
-    if (in->remix_buffer_size) {
-        in->remix_buffer = (void *)calloc(1, in->remix_buffer_size);
-        if (!in->remix_buffer) {
-            ALOGE("Failed to open input stream: remix buffer allocation failed!");
-            // Do not forget about other buffers!
-            if (in->read_buffer) free(in->read_buffer);
-            ret = -ENOMEM;
-            goto err_open;
-        }
-    }
-
-    if (in->resampler_buffer_size) {
-        in->resampler_buffer = (void *)calloc(1, in->resampler_buffer_size);
-        if (!in->resampler_buffer) {
-            ALOGE("Failed to open input stream: resampler buffer allocation failed!");
-            // Do not forget about other buffers!
-            if (in->read_buffer) free(in->read_buffer);
-            if (in->remix_buffer) free(in->remix_buffer);
-            ret = -ENOMEM;
-            goto err_open;
-        }
+    uint8_t *cursor = (uint8_t *)in->arena;
+    in->read_buffer = arena_take(&cursor, in->read_buffer_size);
+    in->remix_buffer = arena_take(&cursor, in->remix_buffer_size);
+    in->resampler_buffer = arena_take(&cursor, in->resampler_buffer_size);
+    void *resampler_memory = arena_take(&cursor, resampler_size);
+
+    if (resampler_memory) {
+        ALOGV("Resampler: %i -> %i", in->config.rate, in->sample_rate);
+        polyphase_init(resampler_memory, in->config.rate, in->sample_rate, in->config.channels,
+                       ladev->resampler_quality, &in->resampler);
     }
     
+    in_setup_pipeline(in);
+
     ALOGV("Opening input stream: rate = %i, channels = %i, buffer = %i, m = %i, s = %i",
             in->sample_rate, in->channels, in->buffer_size, in->remix_buffer_size, in->resampler_buffer_size);
 
@@ -982,7 +1271,10 @@ err_open:
 static void adev_close_input_stream(struct audio_hw_device *dev,
                                    struct audio_stream_in *in)
 {
-    return;
+    struct stream_in *listream = (struct stream_in *)in;
+    in_standby(&in->common);
+    free(listream->arena);
+    free(in);
 }
 
 static struct hw_module_methods_t hal_module_methods = {
@@ -26,12 +26,93 @@
 #define OUT_PERIOD_SIZE 1024
 #define OUT_PERIOD_COUNT 2
 
+// AudioFlinger's key for moving an output to another rate (not in the ICS headers)
+#define OUT_PARAMETER_SAMPLING_RATE "sampling_rate"
+
+// Small periods for UI sounds and games, see out_profiles
+#define OUT_LOW_LATENCY_PERIOD_SIZE 256
+#define OUT_LOW_LATENCY_PERIOD_COUNT 4
+// Large periods for long playback on battery, about 170 ms each at 48 kHz
+#define OUT_DEEP_BUFFER_PERIOD_SIZE 8192
+#define OUT_DEEP_BUFFER_PERIOD_COUNT 4
+#define OUT_PARAMETER_PROFILE "output_profile"
+#define OUT_PROPERTY_PROFILE "audio.out.profile"
+
+// Grace period during which a stream in standby keeps its PCM, 0 disables it
+#define OUT_STANDBY_DELAY_MS 2000
+#define OUT_PROPERTY_STANDBY_DELAY "audio.out.standby_delay_ms"
+
+// Writer thread mode: size of the ring between out_write() and the PCM
+#define OUT_RING_PERIODS 4
+#define OUT_PARAMETER_WRITER_THREAD "writer_thread"
+#define OUT_PROPERTY_WRITER_THREAD "audio.out.writer_thread"
+
+// Opt-in zero-copy output through the PCM DMA buffer
+#define OUT_PROPERTY_MMAP "audio.out.mmap"
+
+// HDMI output PCM and what the sink takes, see adev_probe_hdmi()
+#define HDMI_PROPERTY_ACTIVE "ro.system.hdmi_active"
+#define HDMI_PROPERTY_CARD "audio.hdmi.card"
+#define HDMI_PROPERTY_DEVICE "audio.hdmi.device"
+#define HDMI_PROPERTY_MAX_CHANNELS "audio.hdmi.max_channels"
+#define HDMI_PCM_LIST "/proc/asound/pcm"
+#define HDMI_MAX_CHANNELS 8
+// Formats passed through as IEC61937. ICS has no AUDIO_FORMAT_AC3 or
+// AUDIO_FORMAT_DTS, these are the values later releases give them.
+#define HDMI_FORMAT_AC3 0x09000000
+#define HDMI_FORMAT_DTS 0x0B000000
+// Consumer channel status sent with the HDMI audio, see hdmi_set_channel_status()
+#define HDMI_MIXER_IEC958 "IEC958 Playback Default"
+#define IEC958_AES0_NONAUDIO (1 << 1)
+#define IEC958_AES0_CON_NOT_COPYRIGHT (1 << 2)
+#define IEC958_AES1_CON_PCM_CODER 0x02
+#define IEC958_AES1_CON_ORIGINAL (1 << 7)
+#define IEC958_AES3_CON_FS_NOTID 0x01
+
+// Capture runs at the codec rate and is converted per stream
+#define IN_SAMPLE_RATE 48000
+#define IN_CHANNELS 2
+#define IN_PERIOD_SIZE 960
+#define IN_PERIOD_COUNT 4
+#define IN_PROPERTY_PERIOD_SIZE "audio.in.period_size"
+// Periods of capture kept for the slowest reader before it loses frames
+#define IN_RING_PERIODS 8
+// Duration of the buffer AudioRecord reads in
+#define IN_BUFFER_MS 20
+// Preprocessing effects (AEC, NS, AGC) attached to one input stream
+#define IN_MAX_EFFECTS 8
+
+// Playback kept for the echo canceller, must cover the output latency
+#define ECHO_REF_MS 1000
+// Drift between capture and reference tolerated before a reader resyncs
+#define ECHO_REF_RESYNC_MS 10
+
+// low, medium or high, see polyphase.h
+#define RESAMPLER_PROPERTY_QUALITY "audio.resampler.quality"
+
+// Jack monitor event source: off, uevent or fifo:<path>, see jack_monitor_start()
+#define JACK_PROPERTY_SOURCE "audio.jack.source"
+#define JACK_SWITCH_NAME "h2w"
+#define JACK_SWITCH_STATE "/sys/class/switch/h2w/state"
+// Output devices of the jack, reported by adev_get_parameters()
+#define JACK_PARAMETER_DEVICES "jack_devices"
+
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 
+#include <cutils/atomic.h>
 #include <cutils/log.h>
 #include <cutils/str_parms.h>
 #include <cutils/properties.h>
@@ -40,15 +121,499 @@
 #include <system/audio.h>
 #include <hardware/audio.h>
 
+#include <linux/netlink.h>
+#include <sound/asound.h>
+
 #include <tinyalsa/asoundlib.h>
 
+#include "iec61937.h"
+#include "mmap_out.h"
+#include "polyphase.h"
+#include "remix.h"
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#define ADEV_MAX_OUTPUTS 4
+
+// Volume: Q15 gains, ramped over VOLUME_RAMP_FRAMES on every change
+#define VOLUME_UNITY 32768
+#define VOLUME_RAMP_FRAMES 256
+/*
+ * Where the master volume goes, read once at adev_open. "software" (the
+ * default) scales every output with it. "hardware" moves it to the codec
+ * SPK/HP Playback Volume control instead, which saves the per sample
+ * multiply whenever the stream volumes are unity, at the cost of
+ * VOLUME_HW_STEP_DB steps and of HDMI outputs playing at full scale.
+ */
+#define VOLUME_PROPERTY_MODE "audio.volume.mode"
+// dB per step of the codec SPK/HP Playback Volume controls
+#define VOLUME_HW_STEP_DB 1.5f
+
+// Longest an output is kept faded out for a route switch, see route_switch()
+#define ROUTE_MUTE_MAX_MS 200
+
+// Mixer controls used by the HAL, resolved once in adev_open()
+enum mixer_ctl_id {
+    CTL_JACK_FUNCTION,
+    CTL_SPK_FUNCTION,
+    CTL_SPK_SWITCH,
+    CTL_SPK_VOLUME,
+    CTL_SPK_DAC_L_SWITCH,
+    CTL_SPK_DAC_R_SWITCH,
+    CTL_HP_L_SWITCH,
+    CTL_HP_R_SWITCH,
+    CTL_HP_VOLUME,
+    CTL_HP_DAC_L_SWITCH,
+    CTL_HP_DAC_R_SWITCH,
+    CTL_COUNT
+};
+
+static const char * const mixer_ctl_names[CTL_COUNT] = {
+    [CTL_JACK_FUNCTION] = "Jack Function",
+    [CTL_SPK_FUNCTION] = "Speaker Function",
+    [CTL_SPK_SWITCH] = "SPK Playback Switch",
+    [CTL_SPK_VOLUME] = "SPK Playback Volume",
+    [CTL_SPK_DAC_L_SWITCH] = "SPXMIX Mixer DACL Playback Switch",
+    [CTL_SPK_DAC_R_SWITCH] = "SPXMIX Mixer DACR Playback Switch",
+    [CTL_HP_L_SWITCH] = "HPL Playback Switch",
+    [CTL_HP_R_SWITCH] = "HPR Playback Switch",
+    [CTL_HP_VOLUME] = "HP Playback Volume",
+    [CTL_HP_DAC_L_SWITCH] = "HPMIXL Mixer DAC Playback Switch",
+    [CTL_HP_DAC_R_SWITCH] = "HPMIXR Mixer DAC Playback Switch",
+};
+
+/*
+ * Output routes. Each route lists the (control, value) pairs it needs; enum
+ * controls take "str", the others take "value" on every channel. Only the
+ * controls that differ from the last applied state are written on a switch.
+ */
+struct route_setting {
+    enum mixer_ctl_id ctl;
+    int value;
+    const char *str;
+};
+
+struct route {
+    const char *name;
+    uint32_t devices;
+    const struct route_setting *settings;
+    unsigned int num_settings;
+};
+
+static const struct route_setting route_speaker[] = {
+    { CTL_JACK_FUNCTION, 0, "Speaker" },
+    { CTL_SPK_FUNCTION, 0, "On" },
+    { CTL_SPK_SWITCH, 1, NULL },
+    { CTL_SPK_VOLUME, 31, NULL },
+    { CTL_SPK_DAC_L_SWITCH, 1, NULL },
+    { CTL_SPK_DAC_R_SWITCH, 1, NULL },
+    { CTL_HP_L_SWITCH, 0, NULL },
+    { CTL_HP_R_SWITCH, 0, NULL },
+    { CTL_HP_VOLUME, 0, NULL },
+    { CTL_HP_DAC_L_SWITCH, 0, NULL },
+    { CTL_HP_DAC_R_SWITCH, 0, NULL },
+};
+
+static const struct route_setting route_headphone[] = {
+    { CTL_JACK_FUNCTION, 0, "HeadPhone" },
+    { CTL_SPK_FUNCTION, 0, "Off" },
+    { CTL_SPK_SWITCH, 0, NULL },
+    { CTL_SPK_VOLUME, 0, NULL },
+    { CTL_SPK_DAC_L_SWITCH, 0, NULL },
+    { CTL_SPK_DAC_R_SWITCH, 0, NULL },
+    { CTL_HP_L_SWITCH, 1, NULL },
+    { CTL_HP_R_SWITCH, 1, NULL },
+    { CTL_HP_VOLUME, 31, NULL },
+    { CTL_HP_DAC_L_SWITCH, 1, NULL },
+    { CTL_HP_DAC_R_SWITCH, 1, NULL },
+};
+
+#define ROUTE(name, devices, settings) \
+    { name, devices, settings, sizeof(settings) / sizeof(settings[0]) }
+
+// The first route sharing a device bit with the requested routing wins
+static const struct route routes[] = {
+    ROUTE("speaker", AUDIO_DEVICE_OUT_SPEAKER, route_speaker),
+    ROUTE("headphone", AUDIO_DEVICE_OUT_WIRED_HEADPHONE | AUDIO_DEVICE_OUT_WIRED_HEADSET, route_headphone),
+};
+
+/*
+ * Capture engine: a single thread reads the codec into a ring shared by
+ * every input stream. Positions count frames since the engine started; each
+ * stream reads from its own cursor and converts on its own, and a stream
+ * that falls more than a ring behind skips ahead and counts the loss.
+ */
+struct capture_engine {
+    // Serializes start and stop and protects clients; taken before lock
+    pthread_mutex_t ctl_lock;
+    // Protects the ring, the positions and running
+    pthread_mutex_t lock;
+    pthread_cond_t data_cond;
+    pthread_t thread;
+    bool running;
+    bool exit;
+    unsigned int clients;
+
+    struct pcm_config config;
+    struct pcm *pcm;
+    int16_t *period_buffer;
+    int16_t *ring;
+    size_t ring_frames;
+    int64_t write_pos;
+
+    // Overruns, from a failed pcm_read or a gap in the timestamps, and the
+    // frames of silence put in the ring in their place
+    uint32_t overruns;
+    int64_t frames_dropped;
+    // Ring position anchor_pos was captured at anchor_ns (CLOCK_MONOTONIC)
+    int64_t anchor_pos;
+    int64_t anchor_ns;
+};
+
+/*
+ * Echo reference: what the outputs handed to the PCM, kept while an input
+ * stream has an echo canceller attached. Each reader finds the frames that
+ * were reaching the speaker when its own frames were captured.
+ */
+struct echo_reference {
+    pthread_mutex_t lock;
+    volatile int32_t readers;
+
+    unsigned int channels;
+    uint32_t rate; // of the output that wrote last, 0 until then
+    int16_t *ring;
+    size_t ring_frames;
+    int64_t write_pos;
+    // Ring position anchor_pos reaches the speaker at anchor_ns (CLOCK_MONOTONIC)
+    int64_t anchor_pos;
+    int64_t anchor_ns;
+};
+
+/*
+ * Route worker: route switches are queued here so that the caller returns
+ * at once, and run one at a time. Requests coalesce, only the last counts.
+ */
+struct route_worker {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool running;
+    bool exit;
+    const struct route *pending;
+    int64_t request_us;
+    // Last route asked for, applied or not yet
+    const struct route *requested;
+
+    // Q15 gain on every codec output, faded to 0 during a switch
+    volatile int32_t gain;
+
+    // Request to route applied
+    volatile int32_t switches;
+    volatile int32_t switch_last_us;
+    volatile int32_t switch_max_us;
+};
+
+/*
+ * Where jack events come from. open() sets fd and the current state, read()
+ * is called when fd is readable and returns 1 with the new state in
+ * *devices, 0 if the event was not about the jack.
+ */
+struct jack_source {
+    const char *name;
+    int fd;
+    const char *path;
+    int (*open)(struct jack_source *source, uint32_t *devices);
+    int (*read)(struct jack_source *source, uint32_t *devices);
+};
+
+/*
+ * Jack monitor: routes the codec as soon as a headset or headphone goes in
+ * or out, ahead of the framework's own routing.
+ */
+struct jack_monitor {
+    struct jack_source source;
+    bool running;
+    pthread_t thread;
+    int exit_pipe[2];
+    uint32_t devices; // protected by the device lock
+
+    volatile int32_t events;
+};
+
+// HDMI PCM found at adev_open, absent when the board has none
+struct hdmi_output {
+    bool present;
+    unsigned int card;
+    unsigned int device;
+    unsigned int max_channels;
+    uint32_t rate_min;
+    uint32_t rate_max;
+    // IEC958 channel status control, NULL when the card has none
+    struct mixer *mixer;
+    struct mixer_ctl *iec958;
+};
+
 struct audio_device {
     struct audio_hw_device device;
+
+    pthread_mutex_t lock; // protects the mixer state
+
+    struct mixer *mixer;
+    struct mixer_ctl *ctls[CTL_COUNT];
+
+    // Last value written to each control, valid only if ctl_applied is set
+    bool ctl_applied[CTL_COUNT];
+    int ctl_values[CTL_COUNT];
+    const char *ctl_strs[CTL_COUNT];
+    const struct route *route;
+
+    // Master volume: applied in software (Q15) or on the codec volume controls
+    bool hw_master_volume;
+    float master_volume;
+    volatile int32_t master_gain;
     
     uint32_t out_sample_rate;
     unsigned int out_channels;
-    unsigned int out_period_size;
-    unsigned int out_period_count;
+    // Rate range of the output PCM, probed at adev_open
+    uint32_t out_rate_min;
+    uint32_t out_rate_max;
+    struct hdmi_output hdmi;
+    struct route_worker router;
+    struct jack_monitor jack;
+
+    struct capture_engine capture;
+    struct echo_reference echo_ref;
+    enum polyphase_quality resampler_quality;
+
+    // Open output streams, for adev_dump()
+    struct stream_out *outputs[ADEV_MAX_OUTPUTS];
+};
+
+/*
+ * Output profiles: PCM buffering used by a stream. ICS does not pass output
+ * flags to the HAL, so the profile of a new stream comes from
+ * audio.out.profile and the output_profile stream parameter switches it.
+ */
+enum out_profile_id {
+    OUT_PROFILE_PRIMARY,
+    OUT_PROFILE_LOW_LATENCY,
+    OUT_PROFILE_DEEP_BUFFER,
+    OUT_PROFILE_COUNT
+};
+
+/*
+ * A zero start_threshold or avail_min keeps the tinyalsa default. The deep
+ * buffer profile only wakes the writer once a whole period is free, so the
+ * CPU can idle for a period between writes.
+ */
+struct out_profile {
+    const char *name;
+    unsigned int period_size;
+    unsigned int period_count;
+    unsigned int start_threshold;
+    unsigned int avail_min;
+};
+
+static const struct out_profile out_profiles[OUT_PROFILE_COUNT] = {
+    [OUT_PROFILE_PRIMARY] = { "primary", OUT_PERIOD_SIZE, OUT_PERIOD_COUNT, 0, 0 },
+    [OUT_PROFILE_LOW_LATENCY] = { "low_latency", OUT_LOW_LATENCY_PERIOD_SIZE, OUT_LOW_LATENCY_PERIOD_COUNT, 0, 0 },
+    [OUT_PROFILE_DEEP_BUFFER] = { "deep_buffer", OUT_DEEP_BUFFER_PERIOD_SIZE, OUT_DEEP_BUFFER_PERIOD_COUNT,
+                                  OUT_DEEP_BUFFER_PERIOD_SIZE, OUT_DEEP_BUFFER_PERIOD_SIZE },
+};
+
+static const struct out_profile *find_out_profile(const char *name)
+{
+    unsigned int i;
+    for (i = 0; i < OUT_PROFILE_COUNT; i++) {
+        if (!strcmp(out_profiles[i].name, name))
+            return &out_profiles[i];
+    }
+    return NULL;
+}
+
+/*
+ * Playback statistics printed by out_dump(). The writer side only does atomic
+ * increments; the write duration histogram buckets end at the bounds below.
+ */
+static const int32_t out_write_hist_bounds_us[] = {
+    1000, 2000, 5000, 10000, 20000, 50000, 100000
+};
+
+#define OUT_WRITE_HIST_BUCKETS (sizeof(out_write_hist_bounds_us) / sizeof(out_write_hist_bounds_us[0]) + 1)
+
+struct out_stats {
+    volatile int32_t write_hist[OUT_WRITE_HIST_BUCKETS];
+    volatile int32_t write_max_us;
+    volatile int32_t write_errors;
+    volatile int32_t underruns;
+    volatile int32_t standby_enter;
+    volatile int32_t standby_exit;
+    volatile int32_t pcm_open_last_us;
+    volatile int32_t pcm_open_max_us;
+    volatile int32_t warm_resumes;
+    volatile int32_t first_write_warm_us; // first write after a warm resume
+    volatile int32_t first_write_cold_us; // first write after pcm_open()
+};
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Only ever called by the thread feeding the stream, so the max needs no CAS
+static void out_stats_update_max(volatile int32_t *max, int32_t value)
+{
+    if (value > android_atomic_acquire_load(max))
+        android_atomic_release_store(value, max);
+}
+
+static void out_stats_add_write(struct out_stats *stats, int32_t duration_us)
+{
+    unsigned int i;
+    for (i = 0; i < OUT_WRITE_HIST_BUCKETS - 1; i++) {
+        if (duration_us < out_write_hist_bounds_us[i])
+            break;
+    }
+    android_atomic_inc(&stats->write_hist[i]);
+    out_stats_update_max(&stats->write_max_us, duration_us);
+}
+
+/*
+ * Software volume. The stream and master gains are set from any thread; the
+ * thread that copies the frames folds them into a target, ramps linearly to
+ * it after each change and then runs the steady state kernel. Gains never
+ * exceed unity, so the Q15 products cannot overflow.
+ */
+struct out_volume {
+    volatile int32_t gain[2];  // stream volume, left and right
+    int32_t ramp_gain[2];      // during a ramp, in 1/256 of a Q15 step
+    int32_t ramp_step[2];      // added to ramp_gain per frame
+    int32_t ramp_target[2];
+    unsigned int ramp_pos;     // VOLUME_RAMP_FRAMES when not ramping
+};
+
+static int32_t volume_to_gain(float volume)
+{
+    if (volume <= 0.0f)
+        return 0;
+    if (volume >= 1.0f)
+        return VOLUME_UNITY;
+    return (int32_t)(volume * VOLUME_UNITY + 0.5f);
+}
+
+static void volume_init(struct out_volume *vol)
+{
+    unsigned int c;
+    for (c = 0; c < 2; c++) {
+        vol->gain[c] = VOLUME_UNITY;
+        vol->ramp_gain[c] = VOLUME_UNITY << 8;
+        vol->ramp_step[c] = 0;
+        vol->ramp_target[c] = VOLUME_UNITY;
+    }
+    vol->ramp_pos = VOLUME_RAMP_FRAMES;
+}
+
+static int32_t volume_ramp_gain(const struct out_volume *vol, unsigned int c)
+{
+    if (vol->ramp_pos >= VOLUME_RAMP_FRAMES)
+        return vol->ramp_target[c];
+    return vol->ramp_gain[c] >> 8;
+}
+
+// Steady state stereo kernel, gains below VOLUME_UNITY
+static void volume_scale_stereo_c(int16_t *dst, const int16_t *src, size_t frames,
+                                  int32_t gain_l, int32_t gain_r)
+{
+    while (frames--) {
+        *dst++ = (*src++ * gain_l + 0x4000) >> 15;
+        *dst++ = (*src++ * gain_r + 0x4000) >> 15;
+    }
+}
+
+#ifdef __ARM_NEON__
+// Bit exact with volume_scale_stereo_c: vqrdmulh is (2 * a * b + 0x8000) >> 16
+static void volume_scale_stereo_neon(int16_t *dst, const int16_t *src, size_t frames,
+                                     int32_t gain_l, int32_t gain_r)
+{
+    const int16_t gains[8] = { gain_l, gain_r, gain_l, gain_r, gain_l, gain_r, gain_l, gain_r };
+    int16x8_t gain = vld1q_s16(gains);
+
+    for (; frames >= 8; frames -= 8) {
+        int16x8_t a = vld1q_s16(src);
+        int16x8_t b = vld1q_s16(src + 8);
+        vst1q_s16(dst, vqrdmulhq_s16(a, gain));
+        vst1q_s16(dst + 8, vqrdmulhq_s16(b, gain));
+        src += 16;
+        dst += 16;
+    }
+    volume_scale_stereo_c(dst, src, frames, gain_l, gain_r);
+}
+#define volume_scale_stereo volume_scale_stereo_neon
+#else
+#define volume_scale_stereo volume_scale_stereo_c
+#endif
+
+/*
+ * Copies "frames" interleaved frames from src to dst (which may be the same
+ * buffer) with the stream and master gain applied.
+ */
+static void volume_apply(struct out_volume *vol, int32_t master_gain, int16_t *dst,
+                         const int16_t *src, size_t frames, unsigned int channels)
+{
+    int32_t target[2];
+    unsigned int c;
+
+    for (c = 0; c < 2; c++) {
+        target[c] = (android_atomic_acquire_load(&vol->gain[c]) * master_gain + 0x4000) >> 15;
+    }
+    if (target[0] != vol->ramp_target[0] || target[1] != vol->ramp_target[1]) {
+        // The ramp starts wherever the last one got to
+        for (c = 0; c < 2; c++) {
+            vol->ramp_gain[c] = volume_ramp_gain(vol, c) << 8;
+            vol->ramp_step[c] = ((target[c] << 8) - vol->ramp_gain[c]) / VOLUME_RAMP_FRAMES;
+            vol->ramp_target[c] = target[c];
+        }
+        vol->ramp_pos = 0;
+    }
+
+    for (; vol->ramp_pos < VOLUME_RAMP_FRAMES && frames; vol->ramp_pos++, frames--) {
+        int32_t gain_l = vol->ramp_gain[0] >> 8;
+        int32_t gain_r = vol->ramp_gain[1] >> 8;
+        for (c = 0; c < channels; c++) {
+            *dst++ = (*src++ * ((c & 1) ? gain_r : gain_l) + 0x4000) >> 15;
+        }
+        vol->ramp_gain[0] += vol->ramp_step[0];
+        vol->ramp_gain[1] += vol->ramp_step[1];
+    }
+    if (!frames)
+        return;
+
+    if (target[0] == VOLUME_UNITY && target[1] == VOLUME_UNITY) {
+        if (dst != src)
+            memcpy(dst, src, frames * channels * sizeof(int16_t));
+    } else if (channels == 2) {
+        volume_scale_stereo(dst, src, frames, target[0], target[1]);
+    } else {
+        size_t i;
+        for (i = 0; i < frames * channels; i++)
+            dst[i] = (src[i] * target[0] + 0x4000) >> 15;
+    }
+}
+
+/*
+ * Single producer / single consumer byte ring. Positions run over [0, 2 * size)
+ * so that a full ring can be told apart from an empty one for any size.
+ * Only out_write() moves "head" and only the writer thread moves "tail".
+ */
+struct out_ring {
+    uint8_t *data;
+    int32_t size;
+    volatile int32_t head;
+    volatile int32_t tail;
 };
 
 struct stream_out {
@@ -64,16 +629,609 @@ struct stream_out {
 
     bool standby;
 
+    const struct out_profile *profile;
     struct pcm_config config;
     struct pcm *pcm;
+    // Codec or HDMI PCM
+    bool hdmi;
+    unsigned int card;
+    unsigned int device;
+    // Packs AC3/DTS for passthrough, NULL for PCM streams
+    struct iec61937 *iec61937;
+
+    pthread_mutex_t lock;
+
+    // PCM_MMAP mode (see out_mmap_write), cleared if the driver cannot mmap
+    bool use_mmap;
+    struct mmap_out mmap;
+
+    // Writer thread mode (see out_writer_thread)
+    bool use_writer;
+    bool writer_exit;
+    pthread_t writer_thread;
+    pthread_mutex_t writer_lock;
+    pthread_cond_t writer_cond; // data available for the writer thread
+    pthread_cond_t space_cond;  // space available for out_write()
+    struct out_ring ring;
+
+    /*
+     * Position reporting. frames_written has a single writer at a time, the
+     * writer thread or out_write(), and is read through frames_seq, odd while
+     * it changes (see out_frames_written()). standby_exit_frames only changes
+     * under lock, with no writer thread running.
+     */
+    volatile int32_t frames_seq;
+    uint64_t frames_written;      // frames handed to the PCM, minus frames dropped on standby
+    uint64_t standby_exit_frames; // frames_written when the stream last left standby
+
+    struct out_stats stats;
+
+    // Software volume, applied by the first copy of the frames
+    struct out_volume volume;
+    void *volume_buffer; // buffer_size bytes, for the plain pcm_write() path
+
+    // Delayed standby, protected by lock (see out_standby_thread)
+    unsigned int standby_delay_ms;
+    bool standby_pending;
+    bool standby_thread_exit;
+    int64_t standby_deadline_us;
+    pthread_t standby_thread;
+    pthread_cond_t standby_cond;
+    volatile int32_t *first_write_stat; // set until the first write after standby
+
+    // Read by other threads without the stream lock, see out_set_active()
+    volatile int32_t active;
+    volatile int32_t fade_delay_us; // how long a gain change takes to be heard
 
     struct audio_device *dev;
 };
 
 struct stream_in {
     struct audio_stream_in stream;
+    pthread_mutex_t lock;
+
+    // What the client asked for
+    uint32_t sample_rate;
+    uint32_t channel_mask;
+    unsigned int channels;
+    size_t buffer_size;
+
+    bool standby;
+
+    // Next frame to take from the capture ring, and frames skipped since
+    // in_get_input_frames_lost() was last called
+    int64_t read_pos;
+    int64_t frames_lost;
+    // Value of the engine's frames_dropped already counted in frames_lost
+    int64_t dropped_seen;
+    // Frames handed to the client and the last time reported for them,
+    // for in_get_capture_position()
+    int64_t frames_read;
+    int64_t capture_ns;
+
+    // Up to a period of the ring, remixed to the client channels
+    int16_t *remix_buffer;
+    // Remixed frames not handed to the client yet, from remix_offset on
+    size_t remix_frames;
+    size_t remix_offset;
+    struct polyphase *resampler;
+
+    // Run in place on every read, in the order they were added
+    effect_handle_t effects[IN_MAX_EFFECTS];
+    unsigned int num_effects;
+    // The echo canceller among them, fed the echo reference through
+    // process_reverse(). The reference is read at ref_pos, remixed a chunk
+    // at a time into ref_remix and converted to the stream rate in ref_buffer.
+    effect_handle_t aec;
+    bool ref_synced;
+    int64_t ref_pos;
+    uint32_t ref_rate;
+    struct polyphase *ref_resampler;
+    int16_t *ref_remix;
+    size_t ref_remix_frames;
+    size_t ref_remix_offset;
+    int16_t *ref_buffer; // buffer_size bytes
+
+    struct audio_device *dev;
 };
 
+static int mixer_set_ctl(struct audio_device *adev, enum mixer_ctl_id id, int value)
+{
+    struct mixer_ctl *ctl = adev->ctls[id];
+    unsigned int i;
+    int ret = 0;
+    if (!ctl)
+        return -ENODEV;
+    for (i = 0; i < mixer_ctl_get_num_values(ctl); i++) {
+        if (mixer_ctl_set_value(ctl, i, value)) {
+            LOGE("%s: failed to set: %s", __func__, mixer_ctl_names[id]);
+            ret = -EIO;
+        }
+    }
+    return ret;
+}
+
+static int mixer_set_ctl_enum(struct audio_device *adev, enum mixer_ctl_id id, const char *value)
+{
+    struct mixer_ctl *ctl = adev->ctls[id];
+    if (!ctl)
+        return -ENODEV;
+    if (mixer_ctl_set_enum_by_string(ctl, value)) {
+        LOGE("%s: failed to set: %s", __func__, mixer_ctl_names[id]);
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * In hardware master volume mode the route volume is the full scale step and
+ * the master volume takes VOLUME_HW_STEP_DB off it per step.
+ */
+static int route_setting_value(struct audio_device *adev, const struct route_setting *setting)
+{
+    if (!adev->hw_master_volume || !setting->value ||
+            (setting->ctl != CTL_SPK_VOLUME && setting->ctl != CTL_HP_VOLUME))
+        return setting->value;
+    if (adev->master_volume <= 0.0f)
+        return 0;
+    int steps = (int)(-20.0f * log10f(adev->master_volume) / VOLUME_HW_STEP_DB + 0.5f);
+    return (steps < setting->value) ? setting->value - steps : 0;
+}
+
+// Must be called with adev->lock held
+static void apply_route_setting(struct audio_device *adev, const struct route_setting *setting)
+{
+    enum mixer_ctl_id id = setting->ctl;
+    int value = route_setting_value(adev, setting);
+    int ret;
+
+    if (adev->ctl_applied[id]) {
+        if (setting->str ? !strcmp(setting->str, adev->ctl_strs[id])
+                         : value == adev->ctl_values[id])
+            return;
+    }
+
+    ret = setting->str ? mixer_set_ctl_enum(adev, id, setting->str)
+                       : mixer_set_ctl(adev, id, value);
+    // A failed write leaves the control in an unknown state: retry it next time
+    adev->ctl_applied[id] = !ret;
+    adev->ctl_values[id] = value;
+    adev->ctl_strs[id] = setting->str;
+}
+
+// Whether a setting turns a path off rather than on
+static bool route_setting_disables(const struct route_setting *setting)
+{
+    return setting->str ? !strcmp(setting->str, "Off") : !setting->value;
+}
+
+/*
+ * Must be called with adev->lock held. The settings that turn paths off go
+ * first, so the old output is off before the new one comes on.
+ */
+static void apply_route(struct audio_device *adev, const struct route *route)
+{
+    unsigned int i;
+    for (i = 0; i < route->num_settings; i++) {
+        if (route_setting_disables(&route->settings[i]))
+            apply_route_setting(adev, &route->settings[i]);
+    }
+    for (i = 0; i < route->num_settings; i++) {
+        if (!route_setting_disables(&route->settings[i]))
+            apply_route_setting(adev, &route->settings[i]);
+    }
+    adev->route = route;
+}
+
+static const struct route *find_route(uint32_t devices)
+{
+    unsigned int i;
+    for (i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+        if (routes[i].devices & devices)
+            return &routes[i];
+    }
+    return NULL;
+}
+
+// Queues a switch to route for the route worker, see route_switch()
+static void route_request(struct audio_device *adev, const struct route *route, int64_t request_us)
+{
+    struct route_worker *router = &adev->router;
+
+    pthread_mutex_lock(&router->lock);
+    router->pending = route;
+    router->requested = route;
+    router->request_us = request_us;
+    pthread_cond_signal(&router->cond);
+    pthread_mutex_unlock(&router->lock);
+}
+
+// The route last asked for, which the route worker may not have applied yet
+static const struct route *route_current(struct audio_device *adev)
+{
+    const struct route *route;
+
+    pthread_mutex_lock(&adev->router.lock);
+    route = adev->router.requested;
+    pthread_mutex_unlock(&adev->router.lock);
+    if (!route) {
+        pthread_mutex_lock(&adev->lock);
+        route = adev->route;
+        pthread_mutex_unlock(&adev->lock);
+    }
+    return route;
+}
+
+// h2w switch state: 1 is a headset with a microphone, 2 headphones
+static uint32_t jack_state_to_devices(int state)
+{
+    uint32_t devices = 0;
+    if (state & 1)
+        devices |= AUDIO_DEVICE_OUT_WIRED_HEADSET;
+    if (state & 2)
+        devices |= AUDIO_DEVICE_OUT_WIRED_HEADPHONE;
+    return devices;
+}
+
+/*
+ * Scans NUL or newline separated KEY=value pairs, as in a uevent, for the
+ * h2w switch state. Returns 1 with *devices set if there is one.
+ */
+static int jack_parse_event(const char *msg, size_t len, uint32_t *devices)
+{
+    const char *end = msg + len;
+    bool h2w = false;
+    int state = -1;
+
+    while (msg < end) {
+        size_t n = strnlen(msg, end - msg);
+        const char *eol = memchr(msg, '\n', n);
+        if (eol)
+            n = eol - msg;
+        if (n > 12 && !strncmp(msg, "SWITCH_NAME=", 12))
+            h2w = (n - 12 == strlen(JACK_SWITCH_NAME) && !strncmp(msg + 12, JACK_SWITCH_NAME, n - 12));
+        else if (n > 13 && !strncmp(msg, "SWITCH_STATE=", 13))
+            state = atoi(msg + 13);
+        msg += n + 1;
+    }
+    if (!h2w || state < 0)
+        return 0;
+    *devices = jack_state_to_devices(state);
+    return 1;
+}
+
+// Kernel uevents of the h2w switch, on a netlink socket
+static int jack_uevent_open(struct jack_source *source, uint32_t *devices)
+{
+    struct sockaddr_nl addr;
+    char value[16];
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; // kernel uevents
+    source->fd = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+    if (source->fd < 0)
+        return -errno;
+    if (bind(source->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        int ret = -errno;
+        close(source->fd);
+        source->fd = -1;
+        return ret;
+    }
+
+    *devices = 0;
+    fd = open(JACK_SWITCH_STATE, O_RDONLY);
+    if (fd >= 0) {
+        ssize_t n = read(fd, value, sizeof(value) - 1);
+        if (n > 0) {
+            value[n] = '\0';
+            *devices = jack_state_to_devices(atoi(value));
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+static int jack_uevent_read(struct jack_source *source, uint32_t *devices)
+{
+    char msg[1024];
+    ssize_t n = recv(source->fd, msg, sizeof(msg), 0);
+    if (n <= 0)
+        return 0;
+    return jack_parse_event(msg, n, devices);
+}
+
+/*
+ * Events written to a FIFO as SWITCH_NAME=h2w and SWITCH_STATE=<n> lines,
+ * to drive the monitor by hand and time it. Opened read-write so that it
+ * never sees end of file between writers.
+ */
+static int jack_fifo_open(struct jack_source *source, uint32_t *devices)
+{
+    source->fd = open(source->path, O_RDWR | O_NONBLOCK);
+    if (source->fd < 0)
+        return -errno;
+    *devices = 0;
+    return 0;
+}
+
+static int jack_fifo_read(struct jack_source *source, uint32_t *devices)
+{
+    char msg[256];
+    ssize_t n = read(source->fd, msg, sizeof(msg));
+    if (n <= 0)
+        return 0;
+    return jack_parse_event(msg, n, devices);
+}
+
+/*
+ * Follows the jack between the speaker and headphone routes: a plug moves
+ * the speaker route to the headphones and an unplug moves it back. Any
+ * other route the framework picked stays as it is.
+ */
+static void jack_route(struct audio_device *adev, uint32_t devices, int64_t event_us)
+{
+    struct jack_monitor *jack = &adev->jack;
+    const struct route *route, *other, *current;
+
+    pthread_mutex_lock(&adev->lock);
+    if (devices == jack->devices) {
+        pthread_mutex_unlock(&adev->lock);
+        return;
+    }
+    jack->devices = devices;
+    pthread_mutex_unlock(&adev->lock);
+
+    android_atomic_inc(&jack->events);
+    route = find_route(devices ? devices : AUDIO_DEVICE_OUT_SPEAKER);
+    other = find_route(devices ? AUDIO_DEVICE_OUT_SPEAKER : AUDIO_DEVICE_OUT_WIRED_HEADSET);
+    current = route_current(adev);
+    // No route yet at start up, otherwise only the other one of the pair is replaced
+    if (!route || (current && current != other)) {
+        LOGI("%s: jack devices %#x, keeping %s route", __func__, devices,
+             current ? current->name : "no");
+        return;
+    }
+    LOGI("%s: jack devices %#x, %s route", __func__, devices, route->name);
+    route_request(adev, route, event_us);
+}
+
+static void *jack_monitor_thread(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    struct jack_monitor *jack = &adev->jack;
+    struct pollfd fds[2];
+
+    fds[0].fd = jack->source.fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = jack->exit_pipe[0];
+    fds[1].events = POLLIN;
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            LOGE("%s: poll failed: %s", __func__, strerror(errno));
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        if (fds[0].revents & POLLIN) {
+            uint32_t devices;
+            int64_t event_us = now_us();
+            if (jack->source.read(&jack->source, &devices) > 0)
+                jack_route(adev, devices, event_us);
+        } else if (fds[0].revents) {
+            LOGE("%s: %s source failed", __func__, jack->source.name);
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Starts the jack monitor if audio.jack.source names a source: "uevent" for
+ * the kernel h2w switch, or "fifo:<path>" for events written to a FIFO.
+ * The route for the jack state at start is applied right away.
+ */
+static void jack_monitor_start(struct audio_device *adev)
+{
+    struct jack_monitor *jack = &adev->jack;
+    char value[PROPERTY_VALUE_MAX];
+    uint32_t devices;
+    int ret;
+
+    property_get(JACK_PROPERTY_SOURCE, value, "off");
+    if (!strcmp(value, "uevent")) {
+        jack->source.name = "uevent";
+        jack->source.open = jack_uevent_open;
+        jack->source.read = jack_uevent_read;
+    } else if (!strncmp(value, "fifo:", 5)) {
+        jack->source.name = "fifo";
+        jack->source.path = strdup(value + 5);
+        jack->source.open = jack_fifo_open;
+        jack->source.read = jack_fifo_read;
+    } else {
+        return;
+    }
+
+    ret = jack->source.open(&jack->source, &devices);
+    if (ret) {
+        LOGE("%s: cannot open the %s source: %s", __func__, jack->source.name, strerror(-ret));
+        goto err_open;
+    }
+    if (pipe(jack->exit_pipe)) {
+        LOGE("%s: no exit pipe", __func__);
+        goto err_pipe;
+    }
+    // An impossible state, so the first route always goes out
+    jack->devices = ~0u;
+    jack_route(adev, devices, now_us());
+    if (pthread_create(&jack->thread, NULL, jack_monitor_thread, adev)) {
+        LOGE("%s: cannot start the monitor thread", __func__);
+        goto err_thread;
+    }
+    jack->running = true;
+    LOGI("%s: watching %s", __func__, jack->source.name);
+    return;
+
+err_thread:
+    close(jack->exit_pipe[0]);
+    close(jack->exit_pipe[1]);
+err_pipe:
+    close(jack->source.fd);
+err_open:
+    free((char *)jack->source.path);
+    jack->source.path = NULL;
+}
+
+static void jack_monitor_stop(struct audio_device *adev)
+{
+    struct jack_monitor *jack = &adev->jack;
+
+    if (!jack->running)
+        return;
+    write(jack->exit_pipe[1], "", 1);
+    pthread_join(jack->thread, NULL);
+    close(jack->exit_pipe[0]);
+    close(jack->exit_pipe[1]);
+    close(jack->source.fd);
+    free((char *)jack->source.path);
+    jack->source.path = NULL;
+    jack->running = false;
+}
+
+static void adev_open_mixer(struct audio_device *adev)
+{
+    unsigned int i;
+    adev->mixer = mixer_open(CARD);
+    if (!adev->mixer) {
+        LOGE("%s: failed to open mixer!", __func__);
+        return;
+    }
+    for (i = 0; i < CTL_COUNT; i++) {
+        adev->ctls[i] = mixer_get_ctl_by_name(adev->mixer, mixer_ctl_names[i]);
+        if (!adev->ctls[i]) {
+            LOGW("%s: missing control: %s", __func__, mixer_ctl_names[i]);
+        }
+    }
+}
+
+// Stream rates the PCM can be opened at when the codec allows, instead of resampling
+static const uint32_t out_native_rates[] = { 8000, 11025, 16000, 22050, 32000, 44100, 48000 };
+
+static void adev_probe_out_rates(struct audio_device *adev)
+{
+    struct pcm_params *params = pcm_params_get(CARD, DEVICE, PCM_OUT);
+    if (!params) {
+        LOGW("%s: cannot read PCM parameters, output stays at %u Hz", __func__, adev->out_sample_rate);
+        adev->out_rate_min = adev->out_rate_max = adev->out_sample_rate;
+        return;
+    }
+    adev->out_rate_min = pcm_params_get_min(params, PCM_PARAM_RATE);
+    adev->out_rate_max = pcm_params_get_max(params, PCM_PARAM_RATE);
+    pcm_params_free(params);
+    LOGI("%s: output PCM rates %u..%u Hz", __func__, adev->out_rate_min, adev->out_rate_max);
+}
+
+// Whether the PCM of the stream can be opened at rate
+static bool out_rate_supported(const struct stream_out *lostream, uint32_t rate)
+{
+    const struct audio_device *adev = lostream->dev;
+    uint32_t rate_min = lostream->hdmi ? adev->hdmi.rate_min : adev->out_rate_min;
+    uint32_t rate_max = lostream->hdmi ? adev->hdmi.rate_max : adev->out_rate_max;
+    unsigned int i;
+    if (rate < rate_min || rate > rate_max)
+        return false;
+    for (i = 0; i < sizeof(out_native_rates) / sizeof(out_native_rates[0]); i++) {
+        if (out_native_rates[i] == rate)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Finds the first playback PCM named like HDMI in the ALSA PCM list, where
+ * lines read "CC-DD: id : name : playback 1 : capture 1".
+ */
+static int hdmi_find_pcm(const char *path, unsigned int *card, unsigned int *device)
+{
+    FILE *list = fopen(path, "r");
+    char line[256];
+    int ret = -ENODEV;
+
+    if (!list)
+        return ret;
+    while (fgets(line, sizeof(line), list)) {
+        unsigned int c, d;
+        char *p;
+        if (sscanf(line, "%u-%u:", &c, &d) != 2 || !strstr(line, "playback"))
+            continue;
+        for (p = line; *p; p++)
+            *p = tolower(*p);
+        if (strstr(line, "hdmi")) {
+            *card = c;
+            *device = d;
+            ret = 0;
+            break;
+        }
+    }
+    fclose(list);
+    return ret;
+}
+
+/*
+ * Looks for the HDMI PCM when ro.system.hdmi_active is set: at
+ * audio.hdmi.card/audio.hdmi.device if given, else in the ALSA PCM list.
+ * Channels and rates come from its hw params, audio.hdmi.max_channels
+ * caps the channels for sinks that take less than the PCM.
+ */
+static void adev_probe_hdmi(struct audio_device *adev)
+{
+    struct hdmi_output *hdmi = &adev->hdmi;
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get(HDMI_PROPERTY_ACTIVE, value, "false");
+    if (strcmp(value, "true"))
+        return;
+
+    property_get(HDMI_PROPERTY_CARD, value, "");
+    if (value[0]) {
+        hdmi->card = atoi(value);
+        property_get(HDMI_PROPERTY_DEVICE, value, "0");
+        hdmi->device = atoi(value);
+    } else if (hdmi_find_pcm(HDMI_PCM_LIST, &hdmi->card, &hdmi->device)) {
+        LOGW("%s: no HDMI PCM in %s", __func__, HDMI_PCM_LIST);
+        return;
+    }
+
+    struct pcm_params *params = pcm_params_get(hdmi->card, hdmi->device, PCM_OUT);
+    if (params) {
+        hdmi->max_channels = pcm_params_get_max(params, PCM_PARAM_CHANNELS);
+        hdmi->rate_min = pcm_params_get_min(params, PCM_PARAM_RATE);
+        hdmi->rate_max = pcm_params_get_max(params, PCM_PARAM_RATE);
+        pcm_params_free(params);
+    } else {
+        LOGW("%s: cannot read HDMI PCM parameters, assuming stereo at %u Hz", __func__, OUT_SAMPLE_RATE);
+        hdmi->max_channels = 2;
+        hdmi->rate_min = hdmi->rate_max = OUT_SAMPLE_RATE;
+    }
+    property_get(HDMI_PROPERTY_MAX_CHANNELS, value, "");
+    if (value[0] && (unsigned int)atoi(value) < hdmi->max_channels)
+        hdmi->max_channels = atoi(value);
+    if (hdmi->max_channels > HDMI_MAX_CHANNELS)
+        hdmi->max_channels = HDMI_MAX_CHANNELS;
+    hdmi->present = hdmi->max_channels >= 2;
+    hdmi->mixer = mixer_open(hdmi->card);
+    if (hdmi->mixer)
+        hdmi->iec958 = mixer_get_ctl_by_name(hdmi->mixer, HDMI_MIXER_IEC958);
+    if (!hdmi->iec958)
+        LOGW("%s: no %s control, the sink gets the driver's channel status", __func__,
+                HDMI_MIXER_IEC958);
+    LOGI("%s: HDMI on card %u device %u, %u channels, %u..%u Hz", __func__, hdmi->card,
+            hdmi->device, hdmi->max_channels, hdmi->rate_min, hdmi->rate_max);
+}
+
 static uint32_t out_get_sample_rate(const struct audio_stream *stream)
 {
 	struct stream_out *lostream = (struct stream_out *)stream;
@@ -110,185 +1268,991 @@ static int out_set_format(struct audio_stream *stream, int format)
     return 0;
 }
 
-static int out_standby(struct audio_stream *stream)
+static int32_t out_ring_used(const struct out_ring *ring)
+{
+    int32_t head = android_atomic_acquire_load(&ring->head);
+    int32_t tail = android_atomic_acquire_load(&ring->tail);
+    int32_t used = head - tail;
+    return (used < 0) ? used + 2 * ring->size : used;
+}
+
+static int32_t out_ring_advance(const struct out_ring *ring, int32_t pos, int32_t bytes)
+{
+    pos += bytes;
+    return (pos >= 2 * ring->size) ? pos - 2 * ring->size : pos;
+}
+
+static uint8_t *out_ring_ptr(const struct out_ring *ring, int32_t pos)
+{
+    return ring->data + ((pos >= ring->size) ? pos - ring->size : pos);
+}
+
+static void out_ring_reset(struct out_ring *ring)
+{
+    android_atomic_release_store(0, &ring->head);
+    android_atomic_release_store(0, &ring->tail);
+}
+
+// Registers a reader, allocating the ring for the first one
+static int echo_ref_start(struct echo_reference *ref)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&ref->lock);
+    if (!ref->readers) {
+        // No output runs faster than OUT_SAMPLE_RATE (see out_native_rates)
+        ref->ring_frames = OUT_SAMPLE_RATE * ECHO_REF_MS / 1000;
+        ref->ring = calloc(ref->ring_frames * ref->channels, sizeof(int16_t));
+        ref->rate = 0;
+        ref->write_pos = 0;
+        ref->anchor_pos = 0;
+        ref->anchor_ns = 0;
+    }
+    if (ref->ring)
+        android_atomic_inc(&ref->readers);
+    else
+        ret = -ENOMEM;
+    pthread_mutex_unlock(&ref->lock);
+    return ret;
+}
+
+static void echo_ref_stop(struct echo_reference *ref)
+{
+    pthread_mutex_lock(&ref->lock);
+    if (ref->readers && android_atomic_dec(&ref->readers) == 1) {
+        free(ref->ring);
+        ref->ring = NULL;
+    }
+    pthread_mutex_unlock(&ref->lock);
+}
+
+/*
+ * Appends frames an output just wrote; the one after the last of them will
+ * reach the speaker at presented_ns. A rate change starts the timeline over,
+ * readers resync on the new anchor.
+ */
+static void echo_ref_write(struct echo_reference *ref, const int16_t *data, size_t frames,
+                           uint32_t rate, int64_t presented_ns)
+{
+    pthread_mutex_lock(&ref->lock);
+    if (ref->ring) {
+        if (ref->rate != rate) {
+            ref->rate = rate;
+            ref->write_pos = 0;
+        }
+        // Only the newest ring_frames matter
+        if (frames > ref->ring_frames) {
+            data += (frames - ref->ring_frames) * ref->channels;
+            ref->write_pos += frames - ref->ring_frames;
+            frames = ref->ring_frames;
+        }
+        size_t offset = ref->write_pos % ref->ring_frames;
+        size_t first = ref->ring_frames - offset;
+        if (first > frames)
+            first = frames;
+        memcpy(ref->ring + offset * ref->channels, data, first * ref->channels * sizeof(int16_t));
+        memcpy(ref->ring, data + first * ref->channels,
+                (frames - first) * ref->channels * sizeof(int16_t));
+        ref->write_pos += frames;
+        ref->anchor_pos = ref->write_pos;
+        ref->anchor_ns = presented_ns;
+    }
+    pthread_mutex_unlock(&ref->lock);
+}
+
+// Frames queued in the kernel buffer, or 0 when the PCM is not running
+static unsigned int out_pcm_queued(struct stream_out *lostream, struct timespec *timestamp)
+{
+    unsigned int avail;
+    unsigned int size = pcm_get_buffer_size(lostream->pcm);
+    if (pcm_get_htimestamp(lostream->pcm, &avail, timestamp))
+        return 0;
+    return (avail < size) ? size - avail : 0;
+}
+
+/*
+ * Hands frames just written to the PCM to the echo reference while a
+ * canceller is attached: the frames as the DAC gets them, after the volume.
+ */
+static void out_feed_echo_ref(struct stream_out *lostream, const void *data, size_t frames)
+{
+    struct echo_reference *ref = &lostream->dev->echo_ref;
+    struct timespec timestamp;
+    unsigned int queued;
+
+    if (!android_atomic_acquire_load(&ref->readers))
+        return;
+    // HDMI plays on the sink, away from the tablet microphones
+    if (lostream->hdmi)
+        return;
+    queued = out_pcm_queued(lostream, &timestamp);
+    if (!queued) {
+        // Not running yet: it starts once about a buffer is queued
+        clock_gettime(CLOCK_MONOTONIC, &timestamp);
+        queued = pcm_get_buffer_size(lostream->pcm);
+    }
+    echo_ref_write(ref, (const int16_t *)data, frames, lostream->config.rate,
+            timestamp.tv_sec * 1000000000LL + timestamp.tv_nsec +
+            (int64_t)queued * 1000000000LL / lostream->config.rate);
+}
+
+// Master volume with the route switch fade on top, for the codec outputs only
+static int32_t out_master_gain(struct stream_out *lostream)
+{
+    struct audio_device *adev = lostream->dev;
+    int32_t master_gain = android_atomic_acquire_load(&adev->master_gain);
+    if (lostream->hdmi)
+        return master_gain;
+    return (master_gain * android_atomic_acquire_load(&adev->router.gain) + 0x4000) >> 15;
+}
+
+static bool out_volume_is_unity(struct stream_out *lostream)
+{
+    struct out_volume *vol = &lostream->volume;
+    int32_t master_gain = out_master_gain(lostream);
+    return master_gain == VOLUME_UNITY &&
+            android_atomic_acquire_load(&vol->gain[0]) == VOLUME_UNITY &&
+            android_atomic_acquire_load(&vol->gain[1]) == VOLUME_UNITY &&
+            vol->ramp_target[0] == VOLUME_UNITY && vol->ramp_target[1] == VOLUME_UNITY &&
+            vol->ramp_pos >= VOLUME_RAMP_FRAMES;
+}
+
+// memcpy() of whole frames with the software volume applied on the way
+static void out_copy_frames(struct stream_out *lostream, void *dst, const void *src, size_t bytes)
+{
+    size_t frame_size = audio_stream_frame_size(&lostream->stream.common);
+    volume_apply(&lostream->volume, out_master_gain(lostream),
+            (int16_t *)dst, (const int16_t *)src, bytes / frame_size, lostream->channels);
+}
+
+/*
+ * PCM_MMAP mode: the volume stage writes the frames straight into the DMA
+ * buffer, where pcm_write() would need them scaled into a buffer first.
+ * apply_volume is false when the frames already went through out_copy_frames().
+ */
+static int out_mmap_write(struct stream_out *lostream, const void *data, size_t bytes,
+                          bool apply_volume)
+{
+    const uint8_t *src = (const uint8_t *)data;
+    unsigned int remaining = pcm_bytes_to_frames(lostream->pcm, bytes);
+
+    while (remaining) {
+        void *area;
+        unsigned int offset;
+        unsigned int frames = remaining;
+        int ret = mmap_out_begin(&lostream->mmap, &area, &offset, &frames);
+        if (ret < 0) {
+            LOGE("%s: no room in the DMA buffer: %s", __func__, pcm_get_error(lostream->pcm));
+            return ret;
+        }
+        size_t count = pcm_frames_to_bytes(lostream->pcm, frames);
+        void *dst = (uint8_t *)area + pcm_frames_to_bytes(lostream->pcm, offset);
+        if (apply_volume)
+            out_copy_frames(lostream, dst, src, count);
+        else
+            memcpy(dst, src, count);
+        ret = mmap_out_commit(&lostream->mmap, offset, frames);
+        if (ret < 0) {
+            LOGE("%s: commit failed: %s", __func__, pcm_get_error(lostream->pcm));
+            return ret;
+        }
+        // The reference is what the DAC gets, after the volume
+        out_feed_echo_ref(lostream, dst, frames);
+        src += count;
+        remaining -= frames;
+    }
+    return 0;
+}
+
+/*
+ * Writes to the PCM from whichever thread currently feeds it and keeps the
+ * position counters in step. A PCM that stopped running after being filled
+ * once has run dry, which is counted as an underrun.
+ */
+// Only from the one thread writing the PCM
+static void out_add_frames_written(struct stream_out *lostream, int64_t frames)
+{
+    int32_t seq = lostream->frames_seq;
+    android_atomic_acquire_store(seq + 1, &lostream->frames_seq);
+    lostream->frames_written += frames;
+    android_atomic_release_store(seq + 2, &lostream->frames_seq);
+}
+
+// From any thread, without waiting on the writer
+static uint64_t out_frames_written(struct stream_out *lostream)
+{
+    int32_t seq;
+    uint64_t frames;
+    do {
+        seq = android_atomic_acquire_load(&lostream->frames_seq);
+        frames = lostream->frames_written;
+    } while ((seq & 1) || android_atomic_release_load(&lostream->frames_seq) != seq);
+    return frames;
+}
+
+static int out_pcm_write(struct stream_out *lostream, const void *data, size_t bytes,
+                         bool apply_volume)
+{
+    unsigned int avail;
+    struct timespec timestamp;
+    // PCM frames: passthrough bursts do not have the frame size of the stream
+    size_t frames = pcm_bytes_to_frames(lostream->pcm, bytes);
+    int ret;
+
+    if (lostream->frames_written - lostream->standby_exit_frames >= pcm_get_buffer_size(lostream->pcm) &&
+            pcm_get_htimestamp(lostream->pcm, &avail, &timestamp)) {
+        android_atomic_inc(&lostream->stats.underruns);
+    }
+
+    ret = lostream->use_mmap ? out_mmap_write(lostream, data, bytes, apply_volume) :
+                               pcm_write(lostream->pcm, data, bytes);
+    if (!ret) {
+        out_add_frames_written(lostream, frames);
+        // Elsewhere pcm_write() gets the frames as the volume stage left them
+        if (!lostream->use_mmap)
+            out_feed_echo_ref(lostream, data, frames);
+    } else {
+        android_atomic_inc(&lostream->stats.write_errors);
+    }
+    return ret;
+}
+
+/*
+ * Drains the ring into the PCM one period at a time, so a stalled pcm_write()
+ * only blocks this thread and not the AudioFlinger mixer thread. The ring size
+ * is a whole number of periods and reads are period aligned, so a period is
+ * always contiguous in the ring. On exit it writes out what is left, a
+ * partial period last, before the PCM is stopped or closed.
+ */
+static void *out_writer_thread(void *context)
+{
+    struct stream_out *lostream = (struct stream_out *)context;
+    struct out_ring *ring = &lostream->ring;
+    int32_t chunk = lostream->config.period_size * audio_stream_frame_size(&lostream->stream.common);
+
+    for (;;) {
+        pthread_mutex_lock(&lostream->writer_lock);
+        while (!lostream->writer_exit && out_ring_used(ring) < chunk) {
+            pthread_cond_wait(&lostream->writer_cond, &lostream->writer_lock);
+        }
+        int32_t count = out_ring_used(ring);
+        pthread_mutex_unlock(&lostream->writer_lock);
+        if (!count)
+            break;
+        if (count > chunk)
+            count = chunk;
+
+        int32_t tail = android_atomic_acquire_load(&ring->tail);
+        if (out_pcm_write(lostream, out_ring_ptr(ring, tail), count, lostream->use_mmap)) {
+            LOGE("%s: write failed: %s", __func__, pcm_get_error(lostream->pcm));
+            usleep(lostream->config.period_size * 1000000 / lostream->config.rate);
+        }
+        android_atomic_release_store(out_ring_advance(ring, tail, count), &ring->tail);
+
+        pthread_mutex_lock(&lostream->writer_lock);
+        pthread_cond_signal(&lostream->space_cond);
+        pthread_mutex_unlock(&lostream->writer_lock);
+    }
+    return NULL;
+}
+
+static int out_start_writer(struct stream_out *lostream)
+{
+    if (!lostream->ring.data) {
+        lostream->ring.size = OUT_RING_PERIODS * lostream->config.period_size *
+                audio_stream_frame_size(&lostream->stream.common);
+        lostream->ring.data = (uint8_t *)malloc(lostream->ring.size);
+        if (!lostream->ring.data) {
+            LOGE("%s: ring allocation failed", __func__);
+            return -ENOMEM;
+        }
+    }
+    out_ring_reset(&lostream->ring);
+    lostream->writer_exit = false;
+    if (pthread_create(&lostream->writer_thread, NULL, out_writer_thread, lostream)) {
+        LOGE("%s: failed to create writer thread", __func__);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void out_stop_writer(struct stream_out *lostream)
+{
+    pthread_mutex_lock(&lostream->writer_lock);
+    lostream->writer_exit = true;
+    pthread_cond_signal(&lostream->writer_cond);
+    pthread_cond_signal(&lostream->space_cond);
+    pthread_mutex_unlock(&lostream->writer_lock);
+    // Returns once the frames out_write() accepted are all in the PCM
+    pthread_join(lostream->writer_thread, NULL);
+}
+
+// Stops feeding the PCM; frames still queued in the kernel are never played
+static void out_stop_feeding(struct stream_out *lostream)
+{
+    if (lostream->use_writer) {
+        out_stop_writer(lostream);
+    }
+    struct timespec timestamp;
+    unsigned int queued = out_pcm_queued(lostream, &timestamp);
+    out_add_frames_written(lostream, -(int64_t)queued);
+}
+
+/*
+ * Must be called with lostream->lock held, whenever the stream leaves or
+ * enters standby, warm or not. Publishes whether it plays, for the rate
+ * checks of out_set_native_rate(), and for route_switch() how long a gain
+ * change made now takes to reach the DAC: the kernel buffer, a full writer
+ * ring, the write in progress and the ramp. Both read these without taking
+ * the stream lock, which is held across pcm_write().
+ */
+static void out_set_active(struct stream_out *lostream, bool active)
+{
+    int32_t delay_us = 0;
+    if (active) {
+        size_t frames = lostream->config.period_size * lostream->config.period_count +
+                lostream->buffer_size / audio_stream_frame_size(&lostream->stream.common) +
+                VOLUME_RAMP_FRAMES;
+        if (lostream->use_writer)
+            frames += OUT_RING_PERIODS * lostream->config.period_size;
+        delay_us = frames * 1000000LL / lostream->config.rate;
+    }
+    android_atomic_release_store(delay_us, &lostream->fade_delay_us);
+    android_atomic_release_store(active, &lostream->active);
+}
+
+// Must be called with lostream->lock held
+static void do_out_standby(struct stream_out *lostream)
 {
-    struct stream_out *lostream = (struct stream_out *)stream;
     if (!lostream->standby)
     {
+        if (!lostream->standby_pending) {
+            out_stop_feeding(lostream);
+            out_set_active(lostream, false);
+        }
+        lostream->standby_pending = false;
         pcm_close(lostream->pcm);
         lostream->pcm = NULL;
         lostream->standby = true;
+        lostream->first_write_stat = &lostream->stats.first_write_cold_us;
+        android_atomic_inc(&lostream->stats.standby_enter);
     }
+}
+
+/*
+ * Closes the PCM of a stream whose delayed standby expired. Until then the
+ * PCM is only stopped, so a write inside the window resumes it with a plain
+ * prepare instead of a pcm_open().
+ */
+static void *out_standby_thread(void *context)
+{
+    struct stream_out *lostream = (struct stream_out *)context;
+
+    pthread_mutex_lock(&lostream->lock);
+    while (!lostream->standby_thread_exit) {
+        if (!lostream->standby_pending) {
+            pthread_cond_wait(&lostream->standby_cond, &lostream->lock);
+            continue;
+        }
+        int64_t left_us = lostream->standby_deadline_us - now_us();
+        if (left_us <= 0) {
+            LOGV("%s: standby delay expired", __func__);
+            do_out_standby(lostream);
+            continue;
+        }
+        struct timeval now;
+        struct timespec deadline;
+        gettimeofday(&now, NULL);
+        int64_t deadline_us = (int64_t)now.tv_sec * 1000000 + now.tv_usec + left_us;
+        deadline.tv_sec = deadline_us / 1000000;
+        deadline.tv_nsec = (deadline_us % 1000000) * 1000;
+        pthread_cond_timedwait(&lostream->standby_cond, &lostream->lock, &deadline);
+    }
+    pthread_mutex_unlock(&lostream->lock);
+    return NULL;
+}
+
+static int out_standby(struct audio_stream *stream)
+{
+    struct stream_out *lostream = (struct stream_out *)stream;
+    pthread_mutex_lock(&lostream->lock);
+    if (!lostream->standby && !lostream->standby_pending) {
+        // Restarting a stopped mmap PCM would replay stale frames: no warm reuse there
+        if (!lostream->standby_delay_ms || lostream->use_mmap) {
+            do_out_standby(lostream);
+        } else {
+            out_stop_feeding(lostream);
+            pcm_stop(lostream->pcm);
+            out_set_active(lostream, false);
+            lostream->standby_pending = true;
+            lostream->standby_deadline_us = now_us() + lostream->standby_delay_ms * 1000LL;
+            lostream->first_write_stat = &lostream->stats.first_write_warm_us;
+            pthread_cond_signal(&lostream->standby_cond);
+        }
+    }
+    pthread_mutex_unlock(&lostream->lock);
     return 0;
 }
 
+// Must be called with lostream->lock held: picks up a PCM kept by out_standby()
+static int out_resume_warm(struct stream_out *lostream)
+{
+    lostream->standby_exit_frames = lostream->frames_written;
+    if (lostream->use_writer && out_start_writer(lostream)) {
+        do_out_standby(lostream);
+        return -1;
+    }
+    lostream->standby_pending = false;
+    out_set_active(lostream, true);
+    android_atomic_inc(&lostream->stats.warm_resumes);
+    return 0;
+}
+
+static unsigned char iec958_rate_code(uint32_t rate)
+{
+    switch (rate) {
+    case 22050: return 0x04;
+    case 24000: return 0x06;
+    case 32000: return 0x03;
+    case 44100: return 0x00;
+    case 48000: return 0x02;
+    case 88200: return 0x08;
+    case 96000: return 0x0a;
+    default: return IEC958_AES3_CON_FS_NOTID;
+    }
+}
+
+/*
+ * Sets the consumer channel status of the HDMI audio for the PCM just
+ * opened: the non-audio bit tells the sink that IEC61937 bursts are not
+ * PCM to be played, and the rate matches config.rate. Does not take the
+ * device lock, the control is set once at adev_open.
+ */
+static void hdmi_set_channel_status(struct stream_out *lostream)
+{
+    struct hdmi_output *hdmi = &lostream->dev->hdmi;
+    struct snd_aes_iec958 iec958;
+
+    if (!hdmi->iec958)
+        return;
+    memset(&iec958, 0, sizeof(iec958));
+    iec958.status[0] = IEC958_AES0_CON_NOT_COPYRIGHT;
+    if (lostream->iec61937)
+        iec958.status[0] |= IEC958_AES0_NONAUDIO;
+    iec958.status[1] = IEC958_AES1_CON_ORIGINAL | IEC958_AES1_CON_PCM_CODER;
+    iec958.status[3] = iec958_rate_code(lostream->config.rate);
+    if (mixer_ctl_set_array(hdmi->iec958, &iec958, 1))
+        LOGW("%s: cannot set the channel status", __func__);
+}
+
 static int out_leave_standby(struct audio_stream *stream)
 {
     struct stream_out *lostream = (struct stream_out *)stream;
     if (lostream->standby)
     {
-        lostream->pcm = pcm_open(CARD, DEVICE, PCM_OUT, &lostream->config);
+        int64_t open_start_us = now_us();
+        if (lostream->use_mmap) {
+            lostream->pcm = pcm_open(lostream->card, lostream->device, PCM_OUT | PCM_MMAP,
+                    &lostream->config);
+            if (!lostream->pcm || !pcm_is_ready(lostream->pcm)) {
+                LOGW("%s: no mmap support, falling back to pcm_write: %s", __func__,
+                        pcm_get_error(lostream->pcm));
+                if (lostream->pcm)
+                    pcm_close(lostream->pcm);
+                lostream->use_mmap = false;
+            } else {
+                mmap_out_init(&lostream->mmap, lostream->pcm, &lostream->config);
+            }
+        }
+        if (!lostream->use_mmap)
+            lostream->pcm = pcm_open(lostream->card, lostream->device, PCM_OUT, &lostream->config);
         if (!lostream->pcm || !pcm_is_ready(lostream->pcm))
         {
             LOGE("Failed to open PCM: %s", pcm_get_error(lostream->pcm));
             return -1; // Maybe this should be changed to other value
         }
+        if (lostream->hdmi)
+            hdmi_set_channel_status(lostream);
+        int32_t open_us = now_us() - open_start_us;
+        android_atomic_release_store(open_us, &lostream->stats.pcm_open_last_us);
+        out_stats_update_max(&lostream->stats.pcm_open_max_us, open_us);
+        lostream->standby_exit_frames = lostream->frames_written;
+        if (lostream->use_writer && out_start_writer(lostream)) {
+            pcm_close(lostream->pcm);
+            lostream->pcm = NULL;
+            return -1;
+        }
         lostream->standby = false;
+        out_set_active(lostream, true);
+        android_atomic_inc(&lostream->stats.standby_exit);
     }
     return 0;
 }
 
+static int out_get_presentation_position(const struct audio_stream_out *stream,
+                                         uint64_t *frames, struct timespec *timestamp);
+
 static int out_dump(const struct audio_stream *stream, int fd)
 {
-	LOGW("%s: not implemented.", __func__);
+    struct stream_out *lostream = (struct stream_out *)stream;
+    struct out_stats *stats = &lostream->stats;
+    char buffer[256];
+    unsigned int i;
+
+    uint64_t frames_written = out_frames_written(lostream);
+    // Takes the stream lock, so waits out a write in progress; none in standby
+    char presented[32] = "none";
+    uint64_t frames;
+    struct timespec timestamp;
+    if (!out_get_presentation_position(&lostream->stream, &frames, &timestamp))
+        snprintf(presented, sizeof(presented), "%llu", (unsigned long long)frames);
+
+    snprintf(buffer, sizeof(buffer),
+            "  Output stream %p: %s hw:%u,%u, %s profile, %u Hz, %u channels%s, %u x %u frames%s%s%s\n",
+            lostream, lostream->hdmi ? "HDMI" : "codec", lostream->card, lostream->device,
+            lostream->profile->name, lostream->config.rate, lostream->config.channels,
+            lostream->iec61937 ? " (IEC61937)" : "",
+            lostream->config.period_size, lostream->config.period_count,
+            lostream->standby ? ", standby" : "",
+            lostream->use_writer ? ", writer thread" : "",
+            lostream->use_mmap ? ", mmap" : "");
+    write(fd, buffer, strlen(buffer));
+    snprintf(buffer, sizeof(buffer),
+            "    frames written: %llu, presented: %s, write errors: %d, underruns: %d\n",
+            (unsigned long long)frames_written, presented,
+            android_atomic_acquire_load(&stats->write_errors),
+            android_atomic_acquire_load(&stats->underruns));
+    write(fd, buffer, strlen(buffer));
+    snprintf(buffer, sizeof(buffer),
+            "    standby enter: %d, exit: %d, pcm_open: last %d us, max %d us\n",
+            android_atomic_acquire_load(&stats->standby_enter),
+            android_atomic_acquire_load(&stats->standby_exit),
+            android_atomic_acquire_load(&stats->pcm_open_last_us),
+            android_atomic_acquire_load(&stats->pcm_open_max_us));
+    write(fd, buffer, strlen(buffer));
+    snprintf(buffer, sizeof(buffer),
+            "    standby delay: %u ms, warm resumes: %d, first write: warm %d us, cold %d us\n",
+            lostream->standby_delay_ms,
+            android_atomic_acquire_load(&stats->warm_resumes),
+            android_atomic_acquire_load(&stats->first_write_warm_us),
+            android_atomic_acquire_load(&stats->first_write_cold_us));
+    write(fd, buffer, strlen(buffer));
+    snprintf(buffer, sizeof(buffer), "    write duration (max %d us):",
+            android_atomic_acquire_load(&stats->write_max_us));
+    write(fd, buffer, strlen(buffer));
+    for (i = 0; i < OUT_WRITE_HIST_BUCKETS; i++) {
+        if (i < OUT_WRITE_HIST_BUCKETS - 1)
+            snprintf(buffer, sizeof(buffer), " <%dus: %d", out_write_hist_bounds_us[i],
+                    android_atomic_acquire_load(&stats->write_hist[i]));
+        else
+            snprintf(buffer, sizeof(buffer), " more: %d\n",
+                    android_atomic_acquire_load(&stats->write_hist[i]));
+        write(fd, buffer, strlen(buffer));
+    }
     return 0;
 }
 
-static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
+/*
+ * Must be called with lostream->lock held and the stream in standby. On
+ * -ENOMEM the stream keeps its profile and buffers.
+ */
+static int out_apply_profile(struct stream_out *lostream, const struct out_profile *profile)
+{
+    size_t buffer_size = audio_stream_frame_size(&lostream->stream.common) * profile->period_size;
+    void *volume_buffer = malloc(buffer_size);
+    if (!volume_buffer)
+        return -ENOMEM;
+
+    lostream->profile = profile;
+    lostream->config.period_size = profile->period_size;
+    lostream->config.period_count = profile->period_count;
+    lostream->config.start_threshold = profile->start_threshold;
+    lostream->config.avail_min = profile->avail_min;
+    lostream->buffer_size = buffer_size;
+    // The writer ring is sized in periods
+    free(lostream->ring.data);
+    lostream->ring.data = NULL;
+    free(lostream->volume_buffer);
+    lostream->volume_buffer = volume_buffer;
+    return 0;
+}
+
+static void out_select_route(struct audio_device *adev, int device)
+{
+    const struct route *route = find_route(device);
+    if (!route) {
+        LOGW("%s: unknown route: %i", __func__, device);
+        return;
+    }
+    LOGI("%s: %s route", __func__, route->name);
+    if (adev->router.running) {
+        route_request(adev, route, now_us());
+    } else {
+        pthread_mutex_lock(&adev->lock);
+        apply_route(adev, route);
+        pthread_mutex_unlock(&adev->lock);
+        pthread_mutex_lock(&adev->router.lock);
+        adev->router.requested = route;
+        pthread_mutex_unlock(&adev->router.lock);
+    }
+}
+
+/*
+ * Moves the stream, and the PCM with it, to another rate. The PCM is shared,
+ * so this is refused while another output is playing. The new rate is used
+ * from the next write, after AudioFlinger has read it back.
+ */
+static int out_set_native_rate(struct stream_out *lostream, uint32_t rate)
+{
+    struct audio_device *adev = lostream->dev;
+    unsigned int i;
+    int ret = 0;
+
+    if (rate == lostream->sample_rate)
+        return 0;
+    if (!out_rate_supported(lostream, rate)) {
+        LOGW("%s: %u Hz not supported by the PCM", __func__, rate);
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&adev->lock);
+    for (i = 0; i < ADEV_MAX_OUTPUTS; i++) {
+        struct stream_out *other = adev->outputs[i];
+        // A stream in warm standby has stopped its PCM and counts as idle
+        if (other && other != lostream && other->hdmi == lostream->hdmi &&
+                android_atomic_acquire_load(&other->active)) {
+            LOGW("%s: another output is active, staying at %u Hz", __func__, lostream->sample_rate);
+            ret = -EBUSY;
+            break;
+        }
+    }
+    for (i = 0; i < ADEV_MAX_OUTPUTS && !ret; i++) {
+        struct stream_out *other = adev->outputs[i];
+        if (!other || other == lostream || other->hdmi != lostream->hdmi)
+            continue;
+        // Its warm PCM still holds the device at the old rate; the lock is free while idle
+        pthread_mutex_lock(&other->lock);
+        if (other->standby_pending)
+            do_out_standby(other);
+        pthread_mutex_unlock(&other->lock);
+    }
+    if (!ret) {
+        pthread_mutex_lock(&lostream->lock);
+        LOGI("%s: %u -> %u Hz", __func__, lostream->sample_rate, rate);
+        do_out_standby(lostream);
+        lostream->sample_rate = rate;
+        lostream->config.rate = rate;
+        pthread_mutex_unlock(&lostream->lock);
+    }
+    pthread_mutex_unlock(&adev->lock);
+    return ret;
+}
+
+static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
+{
+	LOGV("%s: %s", __func__, kvpairs);
+	struct stream_out *lostream = (struct stream_out *)stream;
+	struct str_parms *parms = str_parms_create_str(kvpairs);
+	char value[32];
+	int ret = 0;
+
+	if (str_parms_get_str(parms, OUT_PARAMETER_WRITER_THREAD, value, sizeof(value)) >= 0) {
+		// Bursts go out whole from out_write(), see out_write_iec61937()
+		bool use_writer = !strcmp(value, "on") && !lostream->iec61937;
+		pthread_mutex_lock(&lostream->lock);
+		if (use_writer != lostream->use_writer) {
+			LOGI("%s: writer thread %s", __func__, use_writer ? "on" : "off");
+			// The new mode is picked up by the next write
+			do_out_standby(lostream);
+			lostream->use_writer = use_writer;
+		}
+		pthread_mutex_unlock(&lostream->lock);
+	}
+
+	if (str_parms_get_str(parms, OUT_PARAMETER_PROFILE, value, sizeof(value)) >= 0) {
+		const struct out_profile *profile = find_out_profile(value);
+		pthread_mutex_lock(&lostream->lock);
+		if (!profile) {
+			LOGW("%s: unknown output profile: %s", __func__, value);
+		} else if (profile != lostream->profile) {
+			LOGI("%s: %s output profile", __func__, profile->name);
+			// Buffering only changes across standby
+			do_out_standby(lostream);
+			ret = out_apply_profile(lostream, profile);
+			if (ret)
+				LOGE("%s: no memory for the %s output profile", __func__, profile->name);
+		}
+		pthread_mutex_unlock(&lostream->lock);
+	}
+
+	if (str_parms_get_str(parms, OUT_PARAMETER_SAMPLING_RATE, value, sizeof(value)) >= 0) {
+		int rate_ret = out_set_native_rate(lostream, atoi(value));
+		if (!ret)
+			ret = rate_ret;
+	}
+
+	// The codec routes do not apply to the HDMI PCM
+	if (str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_ROUTING, value, sizeof(value)) >= 0 &&
+			!lostream->hdmi) {
+		out_select_route(lostream->dev, atoi(value));
+	}
+
+	str_parms_destroy(parms);
+    return ret;
+}
+
+static char * out_get_parameters(const struct audio_stream *stream, const char *keys)
+{
+	LOGW("%s: not implemented.", __func__);
+    return strdup("");
+}
+
+static uint32_t out_get_latency(const struct audio_stream_out *stream)
+{
+    struct stream_out *lostream = (struct stream_out *)stream;
+    size_t frame_size = audio_stream_frame_size((struct audio_stream *)&stream->common);
+    uint32_t frames = lostream->config.period_size * lostream->config.period_count;
+    // In writer thread mode the ring adds its current depth on top of the kernel buffer
+    if (lostream->use_writer)
+        frames += out_ring_used(&lostream->ring) / frame_size;
+    return frames * 1000 / lostream->config.rate;
+}
+
+/*
+ * Switches routes without a pop: fades the codec outputs out, waits until
+ * the faded frames have played, writes the control diff and fades back in.
+ * The outputs keep streaming the whole time. Runs on the route worker.
+ */
+static void route_switch(struct audio_device *adev, const struct route *route, int64_t request_us)
+{
+    struct route_worker *router = &adev->router;
+    int64_t delay_us = 0;
+    unsigned int i;
+
+    pthread_mutex_lock(&adev->lock);
+    if (route == adev->route) {
+        pthread_mutex_unlock(&adev->lock);
+        return;
+    }
+    /*
+     * The fade starts on the next write and is heard once the buffers ahead
+     * of it drained. The table only gives the delays the outputs published:
+     * their locks are held across pcm_write(), and waiting for them here
+     * would hold up everything else that takes the device lock.
+     */
+    for (i = 0; i < ADEV_MAX_OUTPUTS; i++) {
+        struct stream_out *out = adev->outputs[i];
+        int32_t out_us;
+        if (!out || out->hdmi)
+            continue;
+        out_us = android_atomic_acquire_load(&out->fade_delay_us);
+        if (out_us > delay_us)
+            delay_us = out_us;
+    }
+    pthread_mutex_unlock(&adev->lock);
+
+    if (delay_us) {
+        if (delay_us > ROUTE_MUTE_MAX_MS * 1000)
+            delay_us = ROUTE_MUTE_MAX_MS * 1000;
+        android_atomic_release_store(0, &router->gain);
+        usleep(delay_us);
+    }
+    pthread_mutex_lock(&adev->lock);
+    apply_route(adev, route);
+    pthread_mutex_unlock(&adev->lock);
+    android_atomic_release_store(VOLUME_UNITY, &router->gain);
+
+    int32_t switch_us = now_us() - request_us;
+    android_atomic_inc(&router->switches);
+    android_atomic_release_store(switch_us, &router->switch_last_us);
+    out_stats_update_max(&router->switch_max_us, switch_us);
+    LOGI("%s: %s route in %d us, faded out for %lld us", __func__, route->name, switch_us,
+            (long long)delay_us);
+}
+
+static void *route_worker_thread(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    struct route_worker *router = &adev->router;
+
+    pthread_mutex_lock(&router->lock);
+    for (;;) {
+        while (!router->exit && !router->pending)
+            pthread_cond_wait(&router->cond, &router->lock);
+        if (router->exit)
+            break;
+        const struct route *route = router->pending;
+        int64_t request_us = router->request_us;
+        router->pending = NULL;
+        pthread_mutex_unlock(&router->lock);
+        route_switch(adev, route, request_us);
+        pthread_mutex_lock(&router->lock);
+    }
+    pthread_mutex_unlock(&router->lock);
+    return NULL;
+}
+
+static void route_worker_start(struct audio_device *adev)
+{
+    struct route_worker *router = &adev->router;
+
+    pthread_mutex_init(&router->lock, NULL);
+    pthread_cond_init(&router->cond, NULL);
+    router->gain = VOLUME_UNITY;
+    router->running = !pthread_create(&router->thread, NULL, route_worker_thread, adev);
+    if (!router->running)
+        LOGE("%s: cannot start the route worker, routes will switch synchronously", __func__);
+}
+
+static void route_worker_stop(struct audio_device *adev)
 {
-	LOGV("%s: %s", __func__, kvpairs);
-	struct mixer *mixer = mixer_open(0);
-	int ret = 0;
-	if (mixer) {
-		struct str_parms *parms = str_parms_create_str(kvpairs);
-		char value[32];
-		ret = str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_ROUTING, value, sizeof(value));
-		if (ret >= 0) {
-			int val = atoi(value);
-			switch (val) {
-				case AUDIO_DEVICE_OUT_SPEAKER: {
-						LOGI("%s: speaker route", __func__);
-						unsigned int i;
-						struct mixer_ctl *ctl_jack_function = mixer_get_ctl_by_name(mixer, "Jack Function");
-						if (mixer_ctl_set_enum_by_string(ctl_jack_function, "Speaker")) { LOGE("%s: failed to set: Jack Function", __func__); }
-						struct mixer_ctl *ctl_spk_function = mixer_get_ctl_by_name(mixer, "Speaker Function");
-						if (mixer_ctl_set_enum_by_string(ctl_spk_function, "On")) { LOGE("%s: failed to set: Speaker Function", __func__); }
-						struct mixer_ctl *ctl_spk_switch = mixer_get_ctl_by_name(mixer, "SPK Playback Switch");
-						for (i = 0; i < mixer_ctl_get_num_values(ctl_spk_switch); i++) {
-							if (mixer_ctl_set_value(ctl_spk_switch, i, 1)) { LOGE("%s: failed to set: SPK Playback Switch", __func__); }
-						}
-						struct mixer_ctl *ctl_spk_volume = mixer_get_ctl_by_name(mixer, "SPK Playback Volume");
-						for (i = 0; i < mixer_ctl_get_num_values(ctl_spk_volume); i++) {
-							if (mixer_ctl_set_value(ctl_spk_volume, i, 31)) { LOGE("%s: failed to set: SPK Playback Volume", __func__); }
-						}
-						struct mixer_ctl *ctl_spk_dac_l_switch = mixer_get_ctl_by_name(mixer, "SPXMIX Mixer DACL Playback Switch");
-						for (i = 0; i < mixer_ctl_get_num_values(ctl_spk_dac_l_switch); i++) {
-							if (mixer_ctl_set_value(ctl_spk_dac_l_switch, i, 1)) { LOGE("%s: failed to set: SPXMIX Mixer DACL Playback Switch", __func__); }
-						}
-						struct mixer_ctl *ctl_spk_dac_r_switch = mixer_get_ctl_by_name(mixer, "SPXMIX Mixer DACR Playback Switch");
-						for (i = 0; i < mixer_ctl_get_num_values(ctl_spk_dac_r_switch); i++) {
-							if (mixer_ctl_set_value(ctl_spk_dac_r_switch, i, 1)) { LOGE("%s: failed to set: SPXMIX Mixer DACR Playback Switch", __func__); }
-						}
-						struct mixer_ctl *ctl_hp_l_switch = mixer_get_ctl_by_name(mixer, "HPL Playback Switch");
-						for (i = 0; i < mixer_ctl_get_num_values(ctl_hp_l_switch); i++) {
-							if (mixer_ctl_set_value(ctl_hp_l_switch, i, 0)) { LOGE("%s: failed to set: HPL Playback Switch", __func__); }
-						}
-						struct mixer_ctl *ctl_hp_r_switch = mixer_get_ctl_by_name(mixer, "HPR Playback Switch");
-						for (i = 0; i < mixer_ctl_get_num_values(ctl_hp_r_switch); i++) {
-							if (mixer_ctl_set_value(ctl_hp_r_switch, i, 0)) { LOGE("%s: failed to set: HPR Playback Switch", __func__); }
-						}
-						struct mixer_ctl *ctl_hp_volume = mixer_get_ctl_by_name(mixer, "HP Playback Volume");
-						for (i = 0; i < mixer_ctl_get_num_values(ctl_hp_volume); i++) {
-							if (mixer_ctl_set_value(ctl_hp_volume, i, 0)) { LOGE("%s: failed to set: HP Playback Volume", __func__); }
-						}
-						struct mixer_ctl *ctl_hp_dac_l_switch = mixer_get_ctl_by_name(mixer, "HPMIXL Mixer DAC Playback Switch");
-						for (i = 0; i < mixer_ctl_get_num_values(ctl_hp_dac_l_switch); i++) {
-							if (mixer_ctl_set_value(ctl_hp_dac_l_switch, i, 0)) { LOGE("%s: failed to set: HPMIXL Mixer DAC Playback Switch", __func__); }
-						}
-						struct mixer_ctl *ctl_hp_dac_r_switch = mixer_get_ctl_by_name(mixer, "HPMIXR Mixer DAC Playback Switch");
-						for (i = 0; i < mixer_ctl_get_num_values(ctl_hp_dac_r_switch); i++) {
-							if (mixer_ctl_set_value(ctl_hp_dac_r_switch, i, 0)) { LOGE("%s: failed to set: HPMIXR Mixer DAC Playback Switch", __func__); }
-						}
-					}
-					break;
-				case AUDIO_DEVICE_OUT_WIRED_HEADPHONE: {
-						LOGI("%s: wired headphone route", __func__);
-						unsigned int i;
-						struct mixer_ctl *ctl_jack_function = mixer_get_ctl_by_name(mixer, "Jack Function");
-						if (mixer_ctl_set_enum_by_string(ctl_jack_function, "HeadPhone")) { LOGE("%s: failed to set: Jack Function", __func__); }
-						struct mixer_ctl *ctl_spk_function = mixer_get_ctl_by_name(mixer, "Speaker Function");
-						if (mixer_ctl_set_enum_by_string(ctl_spk_function, "Off")) { LOGE("%s: failed to set: Speaker Function", __func__); }
-						struct mixer_ctl *ctl_spk_switch = mixer_get_ctl_by_name(mixer, "SPK Playback Switch");
-						for (i = 0; i < mixer_ctl_get_num_values(ctl_spk_switch); i++) {
-							if (mixer_ctl_set_value(ctl_spk_switch, i, 0)) { LOGE("%s: failed to set: SPK Playback Switch", __func__); }
-						}
-						struct mixer_ctl *ctl_spk_volume = mixer_get_ctl_by_name(mixer, "SPK Playback Volume");
-						for (i = 0; i < mixer_ctl_get_num_values(ctl_spk_volume); i++) {
-							if (mixer_ctl_set_value(ctl_spk_volume, i, 0)) { LOGE("%s: failed to set: SPK Playback Volume", __func__); }
-						}
-						struct mixer_ctl *ctl_spk_dac_l_switch = mixer_get_ctl_by_name(mixer, "SPXMIX Mixer DACL Playback Switch");
-						for (i = 0; i < mixer_ctl_get_num_values(ctl_spk_dac_l_switch); i++) {
-							if (mixer_ctl_set_value(ctl_spk_dac_l_switch, i, 0)) { LOGE("%s: failed to set: SPXMIX Mixer DACL Playback Switch", __func__); }
-						}
-						struct mixer_ctl *ctl_spk_dac_r_switch = mixer_get_ctl_by_name(mixer, "SPXMIX Mixer DACR Playback Switch");
-						for (i = 0; i < mixer_ctl_get_num_values(ctl_spk_dac_r_switch); i++) {
-							if (mixer_ctl_set_value(ctl_spk_dac_r_switch, i, 0)) { LOGE("%s: failed to set: SPXMIX Mixer DACR Playback Switch", __func__); }
-						}
-						struct mixer_ctl *ctl_hp_l_switch = mixer_get_ctl_by_name(mixer, "HPL Playback Switch");
-						for (i = 0; i < mixer_ctl_get_num_values(ctl_hp_l_switch); i++) {
-							if (mixer_ctl_set_value(ctl_hp_l_switch, i, 1)) { LOGE("%s: failed to set: HPL Playback Switch", __func__); }
-						}
-						struct mixer_ctl *ctl_hp_r_switch = mixer_get_ctl_by_name(mixer, "HPR Playback Switch");
-						for (i = 0; i < mixer_ctl_get_num_values(ctl_hp_r_switch); i++) {
-							if (mixer_ctl_set_value(ctl_hp_r_switch, i, 1)) { LOGE("%s: failed to set: HPR Playback Switch", __func__); }
-						}
-						struct mixer_ctl *ctl_hp_volume = mixer_get_ctl_by_name(mixer, "HP Playback Volume");
-						for (i = 0; i < mixer_ctl_get_num_values(ctl_hp_volume); i++) {
-							if (mixer_ctl_set_value(ctl_hp_volume, i, 31)) { LOGE("%s: failed to set: HP Playback Volume", __func__); }
-						}
-						struct mixer_ctl *ctl_hp_dac_l_switch = mixer_get_ctl_by_name(mixer, "HPMIXL Mixer DAC Playback Switch");
-						for (i = 0; i < mixer_ctl_get_num_values(ctl_hp_dac_l_switch); i++) {
-							if (mixer_ctl_set_value(ctl_hp_dac_l_switch, i, 1)) { LOGE("%s: failed to set: HPMIXL Mixer DAC Playback Switch", __func__); }
-						}
-						struct mixer_ctl *ctl_hp_dac_r_switch = mixer_get_ctl_by_name(mixer, "HPMIXR Mixer DAC Playback Switch");
-						for (i = 0; i < mixer_ctl_get_num_values(ctl_hp_dac_r_switch); i++) {
-							if (mixer_ctl_set_value(ctl_hp_dac_r_switch, i, 1)) { LOGE("%s: failed to set: HPMIXR Mixer DAC Playback Switch", __func__); }
-						}
-					}
-					break;
-				default:
-					LOGW("%s: unknown route: %i", __func__, val);
-			}
-		}
-		mixer_close(mixer);
-		str_parms_destroy(parms);
-	} else {
-		LOGV("%s: failed to open mixer!", __func__);
-	}
-    return ret;
+    struct route_worker *router = &adev->router;
+
+    if (router->running) {
+        pthread_mutex_lock(&router->lock);
+        router->exit = true;
+        pthread_cond_signal(&router->cond);
+        pthread_mutex_unlock(&router->lock);
+        pthread_join(router->thread, NULL);
+        router->running = false;
+    }
+    pthread_cond_destroy(&router->cond);
+    pthread_mutex_destroy(&router->lock);
 }
 
-static char * out_get_parameters(const struct audio_stream *stream, const char *keys)
+static int out_set_volume(struct audio_stream_out *stream, float left,
+                          float right)
 {
-	LOGW("%s: not implemented.", __func__);
-    return strdup("");
+    struct stream_out *lostream = (struct stream_out *)stream;
+    // Picked up, with a ramp, by the next block of frames
+    android_atomic_release_store(volume_to_gain(left), &lostream->volume.gain[0]);
+    android_atomic_release_store(volume_to_gain(right), &lostream->volume.gain[1]);
+    return 0;
 }
 
-static uint32_t out_get_latency(const struct audio_stream_out *stream)
+// Queues the buffer for the writer thread, waiting only while the ring is full
+static void out_write_ring(struct stream_out *lostream, const void *buffer, size_t bytes)
 {
-	// The answer to all the questions!
-    return 42;
+    struct out_ring *ring = &lostream->ring;
+    const uint8_t *src = (const uint8_t *)buffer;
+    int32_t remaining = bytes;
+
+    while (remaining > 0) {
+        int32_t space = ring->size - out_ring_used(ring);
+        if (space == 0) {
+            pthread_mutex_lock(&lostream->writer_lock);
+            while (!lostream->writer_exit && out_ring_used(ring) == ring->size) {
+                pthread_cond_wait(&lostream->space_cond, &lostream->writer_lock);
+            }
+            pthread_mutex_unlock(&lostream->writer_lock);
+            continue;
+        }
+
+        int32_t head = android_atomic_acquire_load(&ring->head);
+        int32_t offset = (head >= ring->size) ? head - ring->size : head;
+        int32_t count = (remaining < space) ? remaining : space;
+        int32_t first = (count < ring->size - offset) ? count : ring->size - offset;
+        if (lostream->use_mmap) {
+            // The writer thread applies the volume on the way into the DMA buffer
+            memcpy(ring->data + offset, src, first);
+            memcpy(ring->data, src + first, count - first);
+        } else {
+            out_copy_frames(lostream, ring->data + offset, src, first);
+            out_copy_frames(lostream, ring->data, src + first, count - first);
+        }
+        android_atomic_release_store(out_ring_advance(ring, head, count), &ring->head);
+        src += count;
+        remaining -= count;
+
+        pthread_mutex_lock(&lostream->writer_lock);
+        pthread_cond_signal(&lostream->writer_cond);
+        pthread_mutex_unlock(&lostream->writer_lock);
+    }
 }
 
-static int out_set_volume(struct audio_stream_out *stream, float left,
-                          float right)
+/*
+ * Passthrough: cuts the compressed stream into frames and writes each one
+ * as an IEC61937 burst, untouched by the volume. A partial frame waits in
+ * the packer for the next write. The PCM runs at the rate of the frames,
+ * whatever the stream was opened at, and is reopened when that changes.
+ */
+static int out_write_iec61937(struct stream_out *lostream, const void *buffer, size_t bytes)
 {
-	LOGW("%s: not implemented.", __func__);
+    const uint8_t *src = (const uint8_t *)buffer;
+
+    while (bytes) {
+        size_t in_bytes = bytes;
+        size_t burst_bytes;
+        const void *burst = iec61937_process(lostream->iec61937, src, &in_bytes, &burst_bytes);
+        src += in_bytes;
+        bytes -= in_bytes;
+        if (!burst)
+            continue;
+        uint32_t rate = iec61937_get_rate(lostream->iec61937);
+        int ret = 0;
+        if (rate != lostream->config.rate) {
+            if (out_rate_supported(lostream, rate)) {
+                LOGI("%s: stream at %u Hz, reopening the PCM from %u Hz", __func__, rate,
+                        lostream->config.rate);
+                do_out_standby(lostream);
+                lostream->config.rate = rate;
+                ret = out_leave_standby(&lostream->stream.common);
+            } else {
+                LOGW("%s: %u Hz not supported by the HDMI PCM", __func__, rate);
+                ret = -EINVAL;
+            }
+        }
+        if (!ret)
+            ret = out_pcm_write(lostream, burst, burst_bytes, false);
+        if (ret) {
+            // Bursts are always stereo 16 bit
+            usleep(burst_bytes / 4 * 1000000LL / rate);
+            return ret;
+        }
+    }
     return 0;
 }
 
-static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
-                         size_t bytes)
+/*
+ * *first_write_stat gets the statistic the duration of this write goes to
+ * when it is the first one after standby, or NULL.
+ */
+static ssize_t do_out_write(struct audio_stream_out *stream, const void* buffer,
+                            size_t bytes, volatile int32_t **first_write_stat)
 {
     struct stream_out *lostream = (struct stream_out *)stream;
-    
+
+    pthread_mutex_lock(&lostream->lock);
+    *first_write_stat = lostream->first_write_stat;
+    lostream->first_write_stat = NULL;
+    if (lostream->standby_pending && out_resume_warm(lostream)) {
+        pthread_mutex_unlock(&lostream->lock);
+        LOGE("Write failed! No warm resume!");
+        usleep(bytes * 1000000 / audio_stream_frame_size(&stream->common) /
+           out_get_sample_rate(&stream->common));
+        return bytes;
+    }
     if (lostream->standby && out_leave_standby((struct audio_stream *)stream))
     {
+        pthread_mutex_unlock(&lostream->lock);
         LOGE("Write failed! No out standby!");
         usleep(bytes * 1000000 / audio_stream_frame_size(&stream->common) /
            out_get_sample_rate(&stream->common));
         return bytes;
     }
+
+    if (lostream->iec61937) {
+        if (out_write_iec61937(lostream, buffer, bytes))
+            LOGE("%s: passthrough write failed", __func__);
+        pthread_mutex_unlock(&lostream->lock);
+        return bytes;
+    }
+
+    if (lostream->use_writer) {
+        out_write_ring(lostream, buffer, bytes);
+        pthread_mutex_unlock(&lostream->lock);
+        return bytes;
+    }
     
     const void *current_buffer = buffer;
     size_t current_bytes = bytes;
@@ -298,20 +2262,89 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     
     size_t processed_bytes = bytes;
 
-    if (pcm_write(lostream->pcm, (void *) current_buffer, current_bytes)) {
+    int ret = 0;
+    if (lostream->use_mmap || !lostream->volume_buffer || out_volume_is_unity(lostream)) {
+        ret = out_pcm_write(lostream, current_buffer, current_bytes, true);
+    } else {
+        // Scale into the volume buffer, one stream buffer at a time
+        const uint8_t *src = (const uint8_t *)current_buffer;
+        size_t remaining = current_bytes;
+        while (remaining && !ret) {
+            size_t count = (remaining < lostream->buffer_size) ? remaining : lostream->buffer_size;
+            out_copy_frames(lostream, lostream->volume_buffer, src, count);
+            ret = out_pcm_write(lostream, lostream->volume_buffer, count, false);
+            src += count;
+            remaining -= count;
+        }
+    }
+    if (ret) {
         LOGE("Write failed");
         usleep(bytes * 1000000 / audio_stream_frame_size(&stream->common) /
            out_get_sample_rate(&stream->common));
         }
+    pthread_mutex_unlock(&lostream->lock);
     
     return processed_bytes; // Still not sure if it is right!
 }
 
+static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
+                         size_t bytes)
+{
+    struct stream_out *lostream = (struct stream_out *)stream;
+    volatile int32_t *first_write_stat;
+    int64_t start_us = now_us();
+    ssize_t ret = do_out_write(stream, buffer, bytes, &first_write_stat);
+    int32_t duration_us = now_us() - start_us;
+    out_stats_add_write(&lostream->stats, duration_us);
+    if (first_write_stat)
+        android_atomic_release_store(duration_us, first_write_stat);
+    return ret;
+}
+
+/*
+ * Frames presented to the DAC since the stream was opened, with the time at
+ * which the last of them left the kernel buffer. The count survives standby,
+ * minus whatever was still queued when the PCM was closed.
+ */
+// Must be called with lostream->lock held
+static int do_out_get_presentation_position(struct stream_out *lostream,
+                                            uint64_t *frames, struct timespec *timestamp)
+{
+    unsigned int avail;
+
+    if (lostream->standby || pcm_get_htimestamp(lostream->pcm, &avail, timestamp))
+        return -ENODATA;
+    unsigned int size = pcm_get_buffer_size(lostream->pcm);
+    uint64_t queued = (avail < size) ? size - avail : 0;
+    uint64_t frames_written = out_frames_written(lostream);
+    *frames = (frames_written > queued) ? frames_written - queued : 0;
+    return 0;
+}
+
+static int out_get_presentation_position(const struct audio_stream_out *stream,
+                                         uint64_t *frames, struct timespec *timestamp)
+{
+    struct stream_out *lostream = (struct stream_out *)stream;
+
+    pthread_mutex_lock(&lostream->lock);
+    int ret = do_out_get_presentation_position(lostream, frames, timestamp);
+    pthread_mutex_unlock(&lostream->lock);
+    return ret;
+}
+
 static int out_get_render_position(const struct audio_stream_out *stream,
                                    uint32_t *dsp_frames)
 {
-	LOGW("%s: not implemented.", __func__);
-    return -EINVAL;
+    struct stream_out *lostream = (struct stream_out *)stream;
+    struct timespec timestamp;
+    uint64_t frames;
+
+    pthread_mutex_lock(&lostream->lock);
+    int ret = do_out_get_presentation_position(lostream, &frames, &timestamp);
+    if (!ret)
+        *dsp_frames = (frames > lostream->standby_exit_frames) ? frames - lostream->standby_exit_frames : 0;
+    pthread_mutex_unlock(&lostream->lock);
+    return ret ? -EINVAL : 0;
 }
 
 static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
@@ -327,10 +2360,220 @@ static int out_remove_audio_effect(const struct audio_stream *stream, effect_han
 }
 
 /** audio_stream_in implementation **/
+
+// Appends frames to the capture ring, silence if data is NULL. Must be called with engine->lock held
+static void capture_ring_write(struct capture_engine *engine, const int16_t *data, int64_t frames)
+{
+    size_t frame_samples = engine->config.channels;
+
+    // Only the newest ring_frames stay in the ring
+    if (frames > (int64_t)engine->ring_frames) {
+        engine->write_pos += frames - engine->ring_frames;
+        if (data)
+            data += (frames - engine->ring_frames) * frame_samples;
+        frames = engine->ring_frames;
+    }
+    size_t offset = engine->write_pos % engine->ring_frames;
+    size_t first = engine->ring_frames - offset;
+    if (first > (size_t)frames)
+        first = frames;
+    if (data) {
+        memcpy(engine->ring + offset * frame_samples, data, first * frame_samples * sizeof(int16_t));
+        memcpy(engine->ring, data + first * frame_samples,
+                (frames - first) * frame_samples * sizeof(int16_t));
+    } else {
+        memset(engine->ring + offset * frame_samples, 0, first * frame_samples * sizeof(int16_t));
+        memset(engine->ring, 0, (frames - first) * frame_samples * sizeof(int16_t));
+    }
+    engine->write_pos += frames;
+}
+
+static void *capture_thread(void *context)
+{
+    struct capture_engine *engine = (struct capture_engine *)context;
+    size_t period = engine->config.period_size;
+    size_t frame_samples = engine->config.channels;
+    // Last anchor that came from pcm_get_htimestamp(), none while last_ns is 0
+    int64_t last_pos = 0;
+    int64_t last_ns = 0;
+    bool stop = false;
+
+    LOGI("%s: started", __func__);
+    while (!stop) {
+        struct timespec tstamp;
+        unsigned int avail = 0;
+        bool failed = false;
+        bool timestamped;
+        int64_t gap = 0;
+
+        if (pcm_read(engine->pcm, engine->period_buffer, pcm_frames_to_bytes(engine->pcm, period))) {
+            // Keep the timeline going with a period of silence
+            LOGW("%s: read failed: %s", __func__, pcm_get_error(engine->pcm));
+            memset(engine->period_buffer, 0, period * frame_samples * sizeof(int16_t));
+            usleep(period * 1000000 / engine->config.rate);
+            failed = true;
+        }
+        // avail is what the kernel captured after the period we just got
+        timestamped = !failed && !pcm_get_htimestamp(engine->pcm, &avail, &tstamp);
+        if (!timestamped)
+            clock_gettime(CLOCK_MONOTONIC, &tstamp);
+        int64_t anchor_ns = tstamp.tv_sec * 1000000000LL + tstamp.tv_nsec;
+
+        pthread_mutex_lock(&engine->lock);
+        if (timestamped && last_ns) {
+            /*
+             * pcm_read() restarts the PCM after an overrun without an error:
+             * the frames lost meanwhile only show as a position behind the
+             * time since the last anchor. Timestamp jitter stays far below
+             * half a period.
+             */
+            int64_t expected = last_pos + (anchor_ns - last_ns) * engine->config.rate / 1000000000LL;
+            gap = expected - (engine->write_pos + (int64_t)period + avail);
+            if (gap < (int64_t)period / 2)
+                gap = 0;
+        }
+        if (failed || gap) {
+            engine->overruns++;
+            engine->frames_dropped += failed ? (int64_t)period : gap;
+        }
+        if (gap)
+            capture_ring_write(engine, NULL, gap);
+        capture_ring_write(engine, engine->period_buffer, period);
+        if (timestamped) {
+            last_pos = engine->write_pos + avail;
+            last_ns = anchor_ns;
+        }
+        // Without a timestamp the last one still holds, the clock is a guess until there is one
+        if (timestamped || !last_ns) {
+            engine->anchor_pos = timestamped ? last_pos : engine->write_pos;
+            engine->anchor_ns = anchor_ns;
+        }
+        pthread_cond_broadcast(&engine->data_cond);
+        stop = engine->exit;
+        pthread_mutex_unlock(&engine->lock);
+    }
+    LOGI("%s: stopped", __func__);
+    return NULL;
+}
+
+static void capture_init(struct capture_engine *engine, unsigned int period_size)
+{
+    pthread_mutex_init(&engine->ctl_lock, NULL);
+    pthread_mutex_init(&engine->lock, NULL);
+    pthread_cond_init(&engine->data_cond, NULL);
+    engine->config.format = PCM_FORMAT_S16_LE;
+    engine->config.rate = IN_SAMPLE_RATE;
+    engine->config.channels = IN_CHANNELS;
+    engine->config.period_size = period_size;
+    engine->config.period_count = IN_PERIOD_COUNT;
+    engine->ring_frames = period_size * IN_RING_PERIODS;
+}
+
+/*
+ * Registers a reader, starting the engine for the first one. On success
+ * *read_pos is the current write position, so the reader starts with
+ * fresh frames, and *dropped_seen the current drop count.
+ */
+static int capture_start(struct capture_engine *engine, int64_t *read_pos, int64_t *dropped_seen)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&engine->ctl_lock);
+    if (!engine->clients) {
+        // Ring and period buffer in one block, allocated while capture runs
+        size_t samples = (engine->ring_frames + engine->config.period_size) * engine->config.channels;
+        engine->ring = calloc(samples, sizeof(int16_t));
+        engine->pcm = pcm_open(CARD, DEVICE, PCM_IN, &engine->config);
+        if (!engine->ring || !engine->pcm || !pcm_is_ready(engine->pcm)) {
+            LOGE("%s: cannot open PCM: %s", __func__, pcm_get_error(engine->pcm));
+            ret = -EIO;
+        } else {
+            engine->period_buffer = engine->ring + engine->ring_frames * engine->config.channels;
+            engine->write_pos = 0;
+            engine->frames_dropped = 0;
+            engine->anchor_pos = 0;
+            engine->anchor_ns = 0;
+            engine->exit = false;
+            if (pthread_create(&engine->thread, NULL, capture_thread, engine)) {
+                LOGE("%s: cannot start the capture thread", __func__);
+                ret = -ENOMEM;
+            }
+        }
+        if (ret) {
+            if (engine->pcm)
+                pcm_close(engine->pcm);
+            engine->pcm = NULL;
+            free(engine->ring);
+            engine->ring = NULL;
+            pthread_mutex_unlock(&engine->ctl_lock);
+            return ret;
+        }
+    }
+    engine->clients++;
+
+    pthread_mutex_lock(&engine->lock);
+    engine->running = true;
+    *read_pos = engine->write_pos;
+    *dropped_seen = engine->frames_dropped;
+    pthread_mutex_unlock(&engine->lock);
+    pthread_mutex_unlock(&engine->ctl_lock);
+    return 0;
+}
+
+// Drops a reader, stopping the engine and closing the PCM after the last one
+static void capture_stop(struct capture_engine *engine)
+{
+    pthread_mutex_lock(&engine->ctl_lock);
+    if (engine->clients && !--engine->clients) {
+        pthread_mutex_lock(&engine->lock);
+        engine->exit = true;
+        pthread_mutex_unlock(&engine->lock);
+        // A blocked pcm_read returns within a period
+        pthread_join(engine->thread, NULL);
+        pcm_close(engine->pcm);
+        engine->pcm = NULL;
+        free(engine->ring);
+        engine->ring = NULL;
+        // Wake readers still waiting, they will find the engine stopped
+        pthread_mutex_lock(&engine->lock);
+        engine->running = false;
+        pthread_cond_broadcast(&engine->data_cond);
+        pthread_mutex_unlock(&engine->lock);
+    }
+    pthread_mutex_unlock(&engine->ctl_lock);
+}
+
+static int check_input_parameters(uint32_t sample_rate, int format, int channel_count)
+{
+    if (format != AUDIO_FORMAT_PCM_16_BIT)
+        return -EINVAL;
+    if (channel_count < 1 || channel_count > 2)
+        return -EINVAL;
+    switch (sample_rate) {
+    case 8000:
+    case 11025:
+    case 16000:
+    case 22050:
+    case 32000:
+    case 44100:
+    case 48000:
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
+static size_t get_input_buffer_size(uint32_t sample_rate, int channel_count)
+{
+    // IN_BUFFER_MS worth of frames, in multiples of 16 frames
+    size_t frames = (sample_rate * IN_BUFFER_MS / 1000 + 15) & ~15;
+    return frames * channel_count * sizeof(int16_t);
+}
+
 static uint32_t in_get_sample_rate(const struct audio_stream *stream)
 {
-	LOGW("%s: not implemented.", __func__);
-    return 8000;
+    struct stream_in *listream = (struct stream_in *)stream;
+    return listream->sample_rate;
 }
 
 static int in_set_sample_rate(struct audio_stream *stream, uint32_t rate)
@@ -341,19 +2584,18 @@ static int in_set_sample_rate(struct audio_stream *stream, uint32_t rate)
 
 static size_t in_get_buffer_size(const struct audio_stream *stream)
 {
-	LOGW("%s: not implemented.", __func__);
-    return 320;
+    struct stream_in *listream = (struct stream_in *)stream;
+    return listream->buffer_size;
 }
 
 static uint32_t in_get_channels(const struct audio_stream *stream)
 {
-	LOGW("%s: not implemented.", __func__);
-    return AUDIO_CHANNEL_IN_MONO;
+    struct stream_in *listream = (struct stream_in *)stream;
+    return listream->channel_mask;
 }
 
 static int in_get_format(const struct audio_stream *stream)
 {
-	LOGW("%s: not implemented.", __func__);
     return AUDIO_FORMAT_PCM_16_BIT;
 }
 
@@ -363,15 +2605,104 @@ static int in_set_format(struct audio_stream *stream, int format)
     return 0;
 }
 
+// Must be called with the stream lock held
+static void do_in_standby(struct stream_in *listream)
+{
+    if (!listream->standby) {
+        capture_stop(&listream->dev->capture);
+        listream->standby = true;
+    }
+}
+
 static int in_standby(struct audio_stream *stream)
 {
-	LOGW("%s: not implemented.", __func__);
+    struct stream_in *listream = (struct stream_in *)stream;
+    pthread_mutex_lock(&listream->lock);
+    do_in_standby(listream);
+    pthread_mutex_unlock(&listream->lock);
+    return 0;
+}
+
+static int in_leave_standby(struct stream_in *listream)
+{
+    int ret = capture_start(&listream->dev->capture, &listream->read_pos, &listream->dropped_seen);
+    if (ret)
+        return ret;
+    // Frames kept from before standby are stale
+    listream->remix_frames = 0;
+    listream->remix_offset = 0;
+    if (listream->resampler)
+        polyphase_reset(listream->resampler);
+    // And so is the reference position
+    listream->ref_synced = false;
+    listream->standby = false;
     return 0;
 }
 
+/*
+ * Frames handed to the client so far and the CLOCK_MONOTONIC time, in ns,
+ * at which the next one was captured, from the engine's last timestamp.
+ * Neither ICS nor AudioFlinger have a hook for this yet.
+ */
+// Must be called with the stream lock held
+static int do_in_get_capture_position(struct stream_in *listream, int64_t *frames, int64_t *time)
+{
+    struct capture_engine *engine = &listream->dev->capture;
+    int ret = -ENODATA;
+
+    if (!listream->standby) {
+        pthread_mutex_lock(&engine->lock);
+        if (engine->anchor_ns) {
+            /*
+             * Ring position of the next frame handed out: the remixed frames
+             * taken so far, less those the resampler holds ahead of it
+             */
+            int64_t pos = listream->read_pos - listream->remix_frames;
+            if (listream->resampler)
+                pos -= polyphase_get_pending(listream->resampler);
+            *frames = listream->frames_read;
+            *time = engine->anchor_ns - (engine->anchor_pos - pos) * 1000000000LL / engine->config.rate;
+            // Timestamp jitter must not move the position back in time
+            if (*time < listream->capture_ns)
+                *time = listream->capture_ns;
+            listream->capture_ns = *time;
+            ret = 0;
+        }
+        pthread_mutex_unlock(&engine->lock);
+    }
+    return ret;
+}
+
+static int in_get_capture_position(const struct audio_stream_in *stream,
+                                   int64_t *frames, int64_t *time)
+{
+    struct stream_in *listream = (struct stream_in *)stream;
+    int ret;
+
+    pthread_mutex_lock(&listream->lock);
+    ret = do_in_get_capture_position(listream, frames, time);
+    pthread_mutex_unlock(&listream->lock);
+    return ret;
+}
+
 static int in_dump(const struct audio_stream *stream, int fd)
 {
-	LOGW("%s: not implemented.", __func__);
+    struct stream_in *listream = (struct stream_in *)stream;
+    char buffer[256];
+    int64_t frames, time;
+    int len;
+
+    len = snprintf(buffer, sizeof(buffer),
+            "Input stream: %u Hz, %u channels, %s\n"
+            "  Capture overruns: %u (%lld frames)\n"
+            "  Effects: %u%s\n",
+            listream->sample_rate, listream->channels, listream->standby ? "standby" : "active",
+            listream->dev->capture.overruns, (long long)listream->dev->capture.frames_dropped,
+            listream->num_effects, listream->aec ? " (echo canceller)" : "");
+    if (!in_get_capture_position(&listream->stream, &frames, &time))
+        len += snprintf(buffer + len, sizeof(buffer) - len,
+                "  Capture position: %lld frames at %lld ns\n", (long long)frames, (long long)time);
+    write(fd, buffer, len);
     return 0;
 }
 
@@ -394,30 +2725,393 @@ static int in_set_gain(struct audio_stream_in *stream, float gain)
     return 0;
 }
 
+// Remixes frames of the capture or echo reference ring to the client channel count
+static void in_remix(struct stream_in *listream, int16_t *dst, const int16_t *src,
+                     unsigned int src_channels, size_t frames)
+{
+    if (listream->channels < src_channels)
+        remix_stereo_to_mono_i16(dst, src, frames);
+    else if (listream->channels > src_channels)
+        remix_mono_to_stereo_i16(dst, src, frames);
+    else
+        memcpy(dst, src, frames * listream->channels * sizeof(int16_t));
+}
+
+/*
+ * Takes up to a period of new frames from the capture ring, waiting for the
+ * engine if there are none. A reader that fell behind by more than the ring
+ * skips to the oldest frame still there.
+ */
+static int in_fill_period(struct stream_in *listream)
+{
+    struct capture_engine *engine = &listream->dev->capture;
+    size_t period = engine->config.period_size;
+    unsigned int capture_channels = engine->config.channels;
+    int ret = 0;
+
+    pthread_mutex_lock(&engine->lock);
+    while (engine->running && listream->read_pos == engine->write_pos) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        if (pthread_cond_timedwait(&engine->data_cond, &engine->lock, &deadline) == ETIMEDOUT) {
+            LOGE("%s: no capture data", __func__);
+            ret = -EIO;
+            break;
+        }
+    }
+    if (!engine->running)
+        ret = -EIO;
+    if (!ret) {
+        int64_t behind = engine->write_pos - listream->read_pos;
+        // Periods of silence the engine put in after read errors count as lost too
+        listream->frames_lost += engine->frames_dropped - listream->dropped_seen;
+        listream->dropped_seen = engine->frames_dropped;
+        if (behind > (int64_t)engine->ring_frames) {
+            listream->frames_lost += behind - engine->ring_frames;
+            listream->read_pos = engine->write_pos - engine->ring_frames;
+            behind = engine->ring_frames;
+        }
+        size_t frames = (behind < (int64_t)period) ? (size_t)behind : period;
+        size_t offset = listream->read_pos % engine->ring_frames;
+        size_t first = engine->ring_frames - offset;
+        if (first > frames)
+            first = frames;
+        in_remix(listream, listream->remix_buffer, engine->ring + offset * capture_channels,
+                capture_channels, first);
+        in_remix(listream, listream->remix_buffer + first * listream->channels, engine->ring,
+                capture_channels, frames - first);
+        listream->read_pos += frames;
+        listream->remix_frames = frames;
+        listream->remix_offset = 0;
+    }
+    pthread_mutex_unlock(&engine->lock);
+    return ret;
+}
+
+/*
+ * Points the reference reader at the playback frame that reached the speaker
+ * at capture_ns, unless it is already within ECHO_REF_RESYNC_MS of it. Until
+ * an output has written, the reader stays unsynced and yields silence.
+ */
+static void in_sync_echo_ref(struct stream_in *listream, int64_t capture_ns)
+{
+    struct echo_reference *ref = &listream->dev->echo_ref;
+    int64_t target = 0;
+    uint32_t rate;
+
+    pthread_mutex_lock(&ref->lock);
+    rate = ref->rate;
+    if (rate) {
+        // Frames more than the ring away are silence either way
+        int64_t delta_ns = ref->anchor_ns - capture_ns;
+        int64_t limit_ns = 2LL * ECHO_REF_MS * 1000000;
+        if (delta_ns > limit_ns)
+            delta_ns = limit_ns;
+        else if (delta_ns < -limit_ns)
+            delta_ns = -limit_ns;
+        target = ref->anchor_pos - delta_ns * rate / 1000000000LL;
+    }
+    pthread_mutex_unlock(&ref->lock);
+    if (!rate) {
+        listream->ref_synced = false;
+        return;
+    }
+
+    if (listream->ref_synced && rate == listream->ref_rate) {
+        int64_t drift = listream->ref_pos - listream->ref_remix_frames - target;
+        if (drift < 0)
+            drift = -drift;
+        if (drift <= rate * ECHO_REF_RESYNC_MS / 1000)
+            return;
+        LOGI("%s: reference drifted by %lld frames", __func__, (long long)drift);
+    }
+
+    if (rate != listream->ref_rate) {
+        polyphase_release(listream->ref_resampler);
+        listream->ref_resampler = NULL;
+        listream->ref_rate = 0;
+        if (rate != listream->sample_rate &&
+                polyphase_create(rate, listream->sample_rate, listream->channels,
+                                 listream->dev->resampler_quality, &listream->ref_resampler)) {
+            LOGE("%s: no resampler for %u -> %u Hz", __func__, rate, listream->sample_rate);
+            listream->ref_synced = false;
+            return;
+        }
+        listream->ref_rate = rate;
+    } else if (listream->ref_resampler) {
+        polyphase_reset(listream->ref_resampler);
+    }
+    listream->ref_pos = target;
+    listream->ref_remix_frames = 0;
+    listream->ref_remix_offset = 0;
+    listream->ref_synced = true;
+}
+
+// Takes a capture period worth of reference frames, silence where the ring has none
+static void in_fill_echo_ref(struct stream_in *listream)
+{
+    struct echo_reference *ref = &listream->dev->echo_ref;
+    size_t chunk = listream->dev->capture.config.period_size;
+    size_t done = 0;
+
+    pthread_mutex_lock(&ref->lock);
+    bool valid = ref->ring && ref->rate == listream->ref_rate;
+    int64_t oldest = ref->write_pos - (int64_t)ref->ring_frames;
+    while (done < chunk) {
+        int64_t pos = listream->ref_pos + done;
+        int16_t *dst = listream->ref_remix + done * listream->channels;
+        size_t frames = chunk - done;
+        if (!valid || pos < oldest || pos >= ref->write_pos) {
+            if (valid && pos < oldest && oldest - pos < (int64_t)frames)
+                frames = oldest - pos;
+            memset(dst, 0, frames * listream->channels * sizeof(int16_t));
+        } else {
+            size_t offset = pos % ref->ring_frames;
+            if ((int64_t)frames > ref->write_pos - pos)
+                frames = ref->write_pos - pos;
+            if (frames > ref->ring_frames - offset)
+                frames = ref->ring_frames - offset;
+            in_remix(listream, dst, ref->ring + offset * ref->channels, ref->channels, frames);
+        }
+        done += frames;
+    }
+    pthread_mutex_unlock(&ref->lock);
+
+    listream->ref_pos += chunk;
+    listream->ref_remix_frames = chunk;
+    listream->ref_remix_offset = 0;
+}
+
+// Reference frames at the stream rate and channels, in step with the capture
+static void in_read_echo_ref(struct stream_in *listream, int16_t *dst, size_t frames)
+{
+    if (!listream->ref_synced) {
+        memset(dst, 0, frames * listream->channels * sizeof(int16_t));
+        return;
+    }
+    while (frames) {
+        if (!listream->ref_remix_frames)
+            in_fill_echo_ref(listream);
+        const int16_t *src = listream->ref_remix + listream->ref_remix_offset * listream->channels;
+        size_t in_frames = listream->ref_remix_frames;
+        size_t out_frames = frames;
+        if (listream->ref_resampler) {
+            polyphase_process(listream->ref_resampler, src, &in_frames, dst, &out_frames);
+        } else {
+            in_frames = out_frames = (in_frames < frames) ? in_frames : frames;
+            memcpy(dst, src, out_frames * listream->channels * sizeof(int16_t));
+        }
+        listream->ref_remix_offset += in_frames;
+        listream->ref_remix_frames -= in_frames;
+        dst += out_frames * listream->channels;
+        frames -= out_frames;
+    }
+}
+
+/*
+ * Runs the preprocessing chain in place on frames just read into buffer.
+ * The echo canceller first gets the playback that was reaching the speaker
+ * while they were captured, located through both sides' timestamps.
+ * Must be called with the stream lock held.
+ */
+static void in_process_effects(struct stream_in *listream, int16_t *buffer, size_t frames)
+{
+    audio_buffer_t buf;
+    unsigned int i;
+
+    if (listream->aec) {
+        effect_handle_t aec = listream->aec;
+        size_t chunk = listream->buffer_size / (listream->channels * sizeof(int16_t));
+        int64_t next_frame, next_ns;
+        size_t done = 0;
+
+        if (!do_in_get_capture_position(listream, &next_frame, &next_ns))
+            in_sync_echo_ref(listream, next_ns - (int64_t)frames * 1000000000LL / listream->sample_rate);
+        while (done < frames) {
+            size_t count = (frames - done < chunk) ? frames - done : chunk;
+            in_read_echo_ref(listream, listream->ref_buffer, count);
+            buf.frameCount = count;
+            buf.s16 = listream->ref_buffer;
+            (*aec)->process_reverse(aec, &buf, NULL);
+            done += count;
+        }
+    }
+
+    for (i = 0; i < listream->num_effects; i++) {
+        effect_handle_t effect = listream->effects[i];
+        buf.frameCount = frames;
+        buf.s16 = buffer;
+        (*effect)->process(effect, &buf, &buf);
+    }
+}
+
 static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
                        size_t bytes)
 {
-    /* XXX: fake timing for audio input */
-    usleep(bytes * 1000000 / audio_stream_frame_size(&stream->common) /
-           in_get_sample_rate(&stream->common));
+    struct stream_in *listream = (struct stream_in *)stream;
+    size_t frame_size = audio_stream_frame_size(&stream->common);
+    size_t remaining = bytes / frame_size;
+    int16_t *dst = (int16_t *)buffer;
+    int ret = 0;
+
+    pthread_mutex_lock(&listream->lock);
+    if (listream->standby)
+        ret = in_leave_standby(listream);
+
+    // Remixed frames the resampler did not take yet stay for the next read
+    while (!ret && remaining) {
+        if (!listream->remix_frames) {
+            ret = in_fill_period(listream);
+            if (ret)
+                break;
+        }
+        const int16_t *src = listream->remix_buffer + listream->remix_offset * listream->channels;
+        size_t in_frames = listream->remix_frames;
+        size_t out_frames = remaining;
+        if (listream->resampler) {
+            polyphase_process(listream->resampler, src, &in_frames, dst, &out_frames);
+        } else {
+            in_frames = out_frames = (in_frames < remaining) ? in_frames : remaining;
+            memcpy(dst, src, out_frames * frame_size);
+        }
+        listream->remix_offset += in_frames;
+        listream->remix_frames -= in_frames;
+        listream->frames_read += out_frames;
+        dst += out_frames * listream->channels;
+        remaining -= out_frames;
+    }
+    if (listream->num_effects && dst != buffer)
+        in_process_effects(listream, (int16_t *)buffer, (dst - (int16_t *)buffer) / listream->channels);
+    pthread_mutex_unlock(&listream->lock);
+
+    if (ret) {
+        // Keep the client's timing: silence at the stream rate
+        memset(dst, 0, remaining * frame_size);
+        usleep(bytes * 1000000 / frame_size / listream->sample_rate);
+    }
     return bytes;
 }
 
 static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
 {
-	LOGW("%s: not implemented.", __func__);
+    struct stream_in *listream = (struct stream_in *)stream;
+    int64_t lost;
+
+    pthread_mutex_lock(&listream->lock);
+    lost = listream->frames_lost;
+    listream->frames_lost = 0;
+    pthread_mutex_unlock(&listream->lock);
+    // The ring counts frames at the codec rate
+    return lost * listream->sample_rate / listream->dev->capture.config.rate;
+}
+
+// Must be called with the stream lock held
+static int in_start_echo_ref(struct stream_in *listream)
+{
+    listream->ref_remix = malloc(listream->dev->capture.config.period_size *
+            listream->channels * sizeof(int16_t));
+    listream->ref_buffer = malloc(listream->buffer_size);
+    if (!listream->ref_remix || !listream->ref_buffer ||
+            echo_ref_start(&listream->dev->echo_ref)) {
+        free(listream->ref_remix);
+        free(listream->ref_buffer);
+        listream->ref_remix = listream->ref_buffer = NULL;
+        return -ENOMEM;
+    }
+    listream->ref_synced = false;
+    listream->ref_rate = 0;
     return 0;
 }
 
+// Must be called with the stream lock held
+static void in_stop_echo_ref(struct stream_in *listream)
+{
+    echo_ref_stop(&listream->dev->echo_ref);
+    polyphase_release(listream->ref_resampler);
+    listream->ref_resampler = NULL;
+    free(listream->ref_remix);
+    free(listream->ref_buffer);
+    listream->ref_remix = listream->ref_buffer = NULL;
+    listream->aec = NULL;
+}
+
 static int in_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
-	LOGW("%s: not implemented.", __func__);
-    return 0;
+    struct stream_in *listream = (struct stream_in *)stream;
+    effect_descriptor_t desc;
+    int ret = 0;
+
+    if ((*effect)->get_descriptor(effect, &desc))
+        return -EINVAL;
+
+    pthread_mutex_lock(&listream->lock);
+    if (listream->num_effects == IN_MAX_EFFECTS) {
+        ret = -ENOSPC;
+    } else if (!memcmp(&desc.type, FX_IID_AEC, sizeof(effect_uuid_t))) {
+        // One canceller per stream: there is one reference to feed
+        if (listream->aec)
+            ret = -EBUSY;
+        else if (!(ret = in_start_echo_ref(listream)))
+            listream->aec = effect;
+    }
+    if (!ret)
+        listream->effects[listream->num_effects++] = effect;
+    pthread_mutex_unlock(&listream->lock);
+
+    if (ret)
+        LOGE("%s: cannot add %s: %d", __func__, desc.name, ret);
+    else
+        LOGI("%s: %s, %u effects", __func__, desc.name, listream->num_effects);
+    return ret;
 }
 
 static int in_remove_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
-	LOGW("%s: not implemented.", __func__);
+    struct stream_in *listream = (struct stream_in *)stream;
+    unsigned int i;
+    int ret = -EINVAL;
+
+    pthread_mutex_lock(&listream->lock);
+    for (i = 0; i < listream->num_effects; i++) {
+        if (listream->effects[i] == effect) {
+            memmove(&listream->effects[i], &listream->effects[i + 1],
+                    (listream->num_effects - i - 1) * sizeof(effect_handle_t));
+            listream->num_effects--;
+            if (listream->aec == effect)
+                in_stop_echo_ref(listream);
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&listream->lock);
+    return ret;
+}
+
+/*
+ * Sets up a stream on the HDMI PCM: 16 bit PCM on 6 or 8 channels when the
+ * sink takes them and stereo otherwise, or AC3/DTS passed through as
+ * IEC61937 bursts on a stereo PCM.
+ */
+static int out_setup_hdmi(struct stream_out *lostream, int format, uint32_t channel_mask)
+{
+    struct hdmi_output *hdmi = &lostream->dev->hdmi;
+    unsigned int channels = popcount(channel_mask);
+
+    lostream->card = hdmi->card;
+    lostream->device = hdmi->device;
+    if (format == HDMI_FORMAT_AC3 || format == HDMI_FORMAT_DTS) {
+        int ret = iec61937_create(format == HDMI_FORMAT_AC3 ? IEC61937_FORMAT_AC3 : IEC61937_FORMAT_DTS,
+                &lostream->iec61937);
+        if (ret)
+            return ret;
+        lostream->format = format;
+    } else if ((channels == 6 || channels == 8) && channels <= hdmi->max_channels) {
+        lostream->channel_mask = channel_mask;
+        lostream->channels = channels;
+    }
+    LOGI("%s: %s, %u channels", __func__, lostream->iec61937 ? "passthrough" : "PCM",
+            lostream->channels);
     return 0;
 }
 
@@ -454,26 +3148,96 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->dev = ladev;
 
     out->format = AUDIO_FORMAT_PCM_16_BIT;
-	out->sample_rate = 48000;
 	out->channel_mask = AUDIO_CHANNEL_OUT_STEREO;
 	out->channels = 2;
 
-	out->config.format = PCM_FORMAT_S16_LE;
-	out->config.rate = ladev->out_sample_rate;
-    out->config.channels = ladev->out_channels;
+	out->card = CARD;
+	out->device = DEVICE;
+	out->hdmi = (devices & AUDIO_DEVICE_OUT_AUX_DIGITAL) && ladev->hdmi.present;
+	if (out->hdmi) {
+		ret = out_setup_hdmi(out, *format, *channels);
+		if (ret)
+			goto err_open;
+	}
 
-    out->config.period_size = ladev->out_period_size;
-    out->config.period_count = ladev->out_period_count;
+	// Play the requested rate natively when the PCM has it, the framework resamples otherwise
+	out->sample_rate = ladev->out_sample_rate;
+	if (*sample_rate && out_rate_supported(out, *sample_rate))
+		out->sample_rate = *sample_rate;
+
+	out->config.format = PCM_FORMAT_S16_LE;
+	out->config.rate = out->sample_rate;
+    out->config.channels = out->hdmi ? out->channels : ladev->out_channels;
 
     out->config.start_threshold = 0;
     out->config.stop_threshold = 0;
     out->config.silence_threshold = 0;
     out->config.avail_min = 0;
 
-    out->buffer_size = audio_stream_frame_size(&out->stream.common) * out->config.period_size;
-
     out->standby = true;
 
+    pthread_mutex_init(&out->lock, NULL);
+    pthread_mutex_init(&out->writer_lock, NULL);
+    pthread_cond_init(&out->writer_cond, NULL);
+    pthread_cond_init(&out->space_cond, NULL);
+    pthread_cond_init(&out->standby_cond, NULL);
+    out->first_write_stat = &out->stats.first_write_cold_us;
+    volume_init(&out->volume);
+
+    char value[PROPERTY_VALUE_MAX];
+    property_get(OUT_PROPERTY_WRITER_THREAD, value, "off");
+    out->use_writer = !strcmp(value, "on");
+    property_get(OUT_PROPERTY_MMAP, value, "off");
+    out->use_mmap = !strcmp(value, "on");
+    if (out->iec61937) {
+        // Bursts are written whole and bit exact, see out_write_iec61937()
+        out->use_writer = false;
+        out->use_mmap = false;
+    }
+
+    // Sets the period size and the buffer size reported back to the framework
+    property_get(OUT_PROPERTY_PROFILE, value, out_profiles[OUT_PROFILE_PRIMARY].name);
+    const struct out_profile *profile = find_out_profile(value);
+    if (!profile) {
+        LOGW("%s: unknown output profile: %s", __func__, value);
+        profile = &out_profiles[OUT_PROFILE_PRIMARY];
+    }
+    if (out_apply_profile(out, profile)) {
+        iec61937_release(out->iec61937);
+        free(out);
+        *stream_out = NULL;
+        return -ENOMEM;
+    }
+    LOGI("%s: %s output profile, %u x %u frames", __func__, profile->name,
+            profile->period_size, profile->period_count);
+
+    // Rate changes and the route fade only see the streams in the table
+    unsigned int i;
+    pthread_mutex_lock(&ladev->lock);
+    for (i = 0; i < ADEV_MAX_OUTPUTS; i++) {
+        if (!ladev->outputs[i]) {
+            ladev->outputs[i] = out;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ladev->lock);
+    if (i == ADEV_MAX_OUTPUTS) {
+        LOGE("%s: already %d outputs open", __func__, ADEV_MAX_OUTPUTS);
+        free(out->volume_buffer);
+        iec61937_release(out->iec61937);
+        free(out);
+        *stream_out = NULL;
+        return -ENOSPC;
+    }
+
+    property_get(OUT_PROPERTY_STANDBY_DELAY, value, "");
+    out->standby_delay_ms = value[0] ? atoi(value) : OUT_STANDBY_DELAY_MS;
+    if (pthread_create(&out->standby_thread, NULL, out_standby_thread, out)) {
+        LOGW("%s: no standby thread, standby will not be delayed", __func__);
+        out->standby_delay_ms = 0;
+        out->standby_thread_exit = true;
+    }
+
     *format = out_get_format(&out->stream.common);
     *channels = out_get_channels(&out->stream.common);
     *sample_rate = out_get_sample_rate(&out->stream.common);
@@ -489,11 +3253,34 @@ err_open:
 static void adev_close_output_stream(struct audio_hw_device *dev,
                                      struct audio_stream_out *stream)
 {
+    struct audio_device *ladev = (struct audio_device *)dev;
     struct stream_out *lostream = (struct stream_out *)stream;
-	if (!lostream->standby) {
-        out_standby((struct audio_stream *)stream);
+    unsigned int i;
+
+    pthread_mutex_lock(&lostream->lock);
+    do_out_standby(lostream);
+    bool join_standby_thread = !lostream->standby_thread_exit;
+    lostream->standby_thread_exit = true;
+    pthread_cond_signal(&lostream->standby_cond);
+    pthread_mutex_unlock(&lostream->lock);
+    if (join_standby_thread)
+        pthread_join(lostream->standby_thread, NULL);
+
+    pthread_mutex_lock(&ladev->lock);
+    for (i = 0; i < ADEV_MAX_OUTPUTS; i++) {
+        if (ladev->outputs[i] == lostream)
+            ladev->outputs[i] = NULL;
     }
-
+    pthread_mutex_unlock(&ladev->lock);
+
+    pthread_cond_destroy(&lostream->standby_cond);
+    pthread_cond_destroy(&lostream->space_cond);
+    pthread_cond_destroy(&lostream->writer_cond);
+    pthread_mutex_destroy(&lostream->writer_lock);
+    pthread_mutex_destroy(&lostream->lock);
+    free(lostream->ring.data);
+    free(lostream->volume_buffer);
+    iec61937_release(lostream->iec61937);
     free(stream);
 }
 
@@ -506,8 +3293,25 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
 static char * adev_get_parameters(const struct audio_hw_device *dev,
                                   const char *keys)
 {
-	LOGW("%s: not implemented.", __func__);
-    return NULL;
+    struct audio_device *adev = (struct audio_device *)dev;
+    struct str_parms *query = str_parms_create_str(keys);
+    char value[32];
+    char *str = NULL;
+
+    // What the jack monitor last saw, while it runs
+    if (str_parms_get_str(query, JACK_PARAMETER_DEVICES, value, sizeof(value)) >= 0 &&
+            adev->jack.running) {
+        struct str_parms *reply = str_parms_create();
+        pthread_mutex_lock(&adev->lock);
+        str_parms_add_int(reply, JACK_PARAMETER_DEVICES, adev->jack.devices);
+        pthread_mutex_unlock(&adev->lock);
+        str = str_parms_to_str(reply);
+        str_parms_destroy(reply);
+    } else {
+        LOGW("%s: not implemented: %s", __func__, keys);
+    }
+    str_parms_destroy(query);
+    return str;
 }
 
 static int adev_init_check(const struct audio_hw_device *dev)
@@ -523,8 +3327,18 @@ static int adev_set_voice_volume(struct audio_hw_device *dev, float volume)
 
 static int adev_set_master_volume(struct audio_hw_device *dev, float volume)
 {
-	LOGW("%s: not implemented. Parameter: %f", __func__, volume);
-    return -ENOSYS;
+    struct audio_device *adev = (struct audio_device *)dev;
+    pthread_mutex_lock(&adev->lock);
+    adev->master_volume = volume;
+    if (adev->hw_master_volume) {
+        // Only the route volume control changes, see route_setting_value()
+        if (adev->route)
+            apply_route(adev, adev->route);
+    } else {
+        android_atomic_release_store(volume_to_gain(volume), &adev->master_gain);
+    }
+    pthread_mutex_unlock(&adev->lock);
+    return 0;
 }
 
 static int adev_set_mode(struct audio_hw_device *dev, int mode)
@@ -547,7 +3361,9 @@ static size_t adev_get_input_buffer_size(const struct audio_hw_device *dev,
                                          uint32_t sample_rate, int format,
                                          int channel_count)
 {
-    return 320;
+    if (check_input_parameters(sample_rate, format, channel_count))
+        return 0;
+    return get_input_buffer_size(sample_rate, channel_count);
 }
 
 static int adev_open_input_stream(struct audio_hw_device *dev, uint32_t devices,
@@ -560,6 +3376,16 @@ static int adev_open_input_stream(struct audio_hw_device *dev, uint32_t devices,
     struct stream_in *in;
     int ret;
 
+    // AudioFlinger retries with the values we put back
+    if (check_input_parameters(*sample_rate, *format, popcount(*channels))) {
+        if (check_input_parameters(*sample_rate, AUDIO_FORMAT_PCM_16_BIT, 1))
+            *sample_rate = IN_SAMPLE_RATE;
+        *format = AUDIO_FORMAT_PCM_16_BIT;
+        if (popcount(*channels) < 1 || popcount(*channels) > 2)
+            *channels = AUDIO_CHANNEL_IN_MONO;
+        return -EINVAL;
+    }
+
     in = (struct stream_in *)calloc(1, sizeof(struct stream_in));
     if (!in)
         return -ENOMEM;
@@ -580,6 +3406,33 @@ static int adev_open_input_stream(struct audio_hw_device *dev, uint32_t devices,
     in->stream.read = in_read;
     in->stream.get_input_frames_lost = in_get_input_frames_lost;
 
+    in->dev = ladev;
+    in->sample_rate = *sample_rate;
+    in->channel_mask = *channels;
+    in->channels = popcount(*channels);
+    in->buffer_size = get_input_buffer_size(in->sample_rate, in->channels);
+
+    in->standby = true;
+    pthread_mutex_init(&in->lock, NULL);
+
+    const struct pcm_config *capture = &ladev->capture.config;
+    in->remix_buffer = malloc(capture->period_size * in->channels * sizeof(int16_t));
+    if (!in->remix_buffer) {
+        ret = -ENOMEM;
+        goto err_open;
+    }
+
+    if (in->sample_rate != capture->rate) {
+        ret = polyphase_create(capture->rate, in->sample_rate, in->channels,
+                               ladev->resampler_quality, &in->resampler);
+        if (ret) {
+            LOGE("%s: no resampler for %u -> %u Hz", __func__, capture->rate, in->sample_rate);
+            free(in->remix_buffer);
+            goto err_open;
+        }
+    }
+    LOGI("%s: %u Hz, %u channels", __func__, in->sample_rate, in->channels);
+
     *stream_in = &in->stream;
     return 0;
 
@@ -592,17 +3445,65 @@ err_open:
 static void adev_close_input_stream(struct audio_hw_device *dev,
                                    struct audio_stream_in *in)
 {
-    return;
+    struct stream_in *listream = (struct stream_in *)in;
+    in_standby(&in->common);
+    // AudioFlinger removes its effects first; a canceller left over still holds the reference
+    if (listream->aec)
+        in_stop_echo_ref(listream);
+    polyphase_release(listream->resampler);
+    free(listream->remix_buffer);
+    pthread_mutex_destroy(&listream->lock);
+    free(in);
 }
 
 static int adev_dump(const audio_hw_device_t *device, int fd)
 {
-	LOGW("%s: not implemented.", __func__);
+    struct audio_device *adev = (struct audio_device *)device;
+    char buffer[128];
+    unsigned int i;
+
+    pthread_mutex_lock(&adev->lock);
+    snprintf(buffer, sizeof(buffer), "LifeDJIK audio HW HAL: mixer %s, route %s, output rates %u..%u Hz\n",
+            adev->mixer ? "open" : "unavailable", adev->route ? adev->route->name : "none",
+            adev->out_rate_min, adev->out_rate_max);
+    write(fd, buffer, strlen(buffer));
+    if (adev->hdmi.present) {
+        snprintf(buffer, sizeof(buffer), "  HDMI: hw:%u,%u, %u channels, %u..%u Hz\n",
+                adev->hdmi.card, adev->hdmi.device, adev->hdmi.max_channels,
+                adev->hdmi.rate_min, adev->hdmi.rate_max);
+        write(fd, buffer, strlen(buffer));
+    }
+    snprintf(buffer, sizeof(buffer), "  Route switches: %d, request to route last %d us, max %d us\n",
+            android_atomic_acquire_load(&adev->router.switches),
+            android_atomic_acquire_load(&adev->router.switch_last_us),
+            android_atomic_acquire_load(&adev->router.switch_max_us));
+    write(fd, buffer, strlen(buffer));
+    if (adev->jack.running) {
+        snprintf(buffer, sizeof(buffer), "  Jack (%s): devices %#x, %d events\n",
+                adev->jack.source.name, adev->jack.devices,
+                android_atomic_acquire_load(&adev->jack.events));
+        write(fd, buffer, strlen(buffer));
+    }
+    for (i = 0; i < ADEV_MAX_OUTPUTS; i++) {
+        if (adev->outputs[i])
+            out_dump(&adev->outputs[i]->stream.common, fd);
+    }
+    pthread_mutex_unlock(&adev->lock);
     return 0;
 }
 
 static int adev_close(hw_device_t *device)
 {
+    struct audio_device *adev = (struct audio_device *)device;
+    jack_monitor_stop(adev);
+    route_worker_stop(adev);
+    if (adev->mixer) {
+        mixer_close(adev->mixer);
+    }
+    if (adev->hdmi.mixer)
+        mixer_close(adev->hdmi.mixer);
+    pthread_mutex_destroy(&adev->echo_ref.lock);
+    pthread_mutex_destroy(&adev->lock);
     free(device);
     return 0;
 }
@@ -666,8 +3567,27 @@ static int adev_open(const hw_module_t* module, const char* name,
 
     adev->out_sample_rate = OUT_SAMPLE_RATE;
     adev->out_channels = OUT_CHANNELS;
-    adev->out_period_size = OUT_PERIOD_SIZE;
-    adev->out_period_count = OUT_PERIOD_COUNT;
+    adev_probe_out_rates(adev);
+    adev_probe_hdmi(adev);
+
+    char value[PROPERTY_VALUE_MAX];
+    property_get(IN_PROPERTY_PERIOD_SIZE, value, "");
+    unsigned int in_period_size = value[0] ? atoi(value) : IN_PERIOD_SIZE;
+    capture_init(&adev->capture, in_period_size ? in_period_size : IN_PERIOD_SIZE);
+    pthread_mutex_init(&adev->echo_ref.lock, NULL);
+    adev->echo_ref.channels = adev->out_channels;
+    property_get(RESAMPLER_PROPERTY_QUALITY, value, "medium");
+    adev->resampler_quality = polyphase_quality_from_name(value, POLYPHASE_QUALITY_MEDIUM);
+
+    property_get(VOLUME_PROPERTY_MODE, value, "software");
+    adev->hw_master_volume = !strcmp(value, "hardware");
+    adev->master_volume = 1.0f;
+    adev->master_gain = VOLUME_UNITY;
+
+    pthread_mutex_init(&adev->lock, NULL);
+    adev_open_mixer(adev);
+    route_worker_start(adev);
+    jack_monitor_start(adev);
 
     *device = &adev->device.common;
 
@@ -0,0 +1,853 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Benchmark for the primary audio HAL. It loads the module the way
+ * libhardware does, through HAL_MODULE_INFO_SYM, and drives it as
+ * AudioFlinger would: a tone written to outputs and capture read from
+ * inputs at each rate and channel count, then routing and standby on a
+ * playing output. Results go to stdout as one JSON object, the HAL log
+ * goes to logcat (stderr on the host).
+ *
+ * With -l it measures round-trip latency instead: pulses played on the
+ * speaker and captured by the microphone, for each output profile. On the
+ * host, set TINYALSA_SIM_LOOPBACK_US for the simulated card to loop back.
+ *
+ * Stop the media server first on a device, the HAL drives one card.
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <hardware/audio.h>
+#include <hardware/hardware.h>
+#include <system/audio.h>
+
+#ifdef HAVE_ANDROID_OS
+#define BENCH_MODULE "/system/lib/hw/audio.primary.tcc892x.so"
+#else
+#define BENCH_MODULE "audio.primary.tcc892x.so"
+#endif
+#define BENCH_SECONDS 3
+#define BENCH_CYCLES 10
+// Long enough for a fade and switch on the route worker to finish
+#define BENCH_ROUTE_SETTLE_MS 300
+// Past OUT_STANDBY_DELAY_MS, so the write after standby reopens the PCM
+#define BENCH_COLD_PAUSE_MS 2500
+#define BENCH_TONE_HZ 1000
+#define BENCH_TONE_AMPLITUDE 8192
+
+// Loopback pulses: a short full scale square burst every interval
+#define BENCH_PULSE_INTERVAL_MS 1000
+#define BENCH_PULSE_MS 2
+#define BENCH_PULSE_HZ 2000
+#define BENCH_PULSE_AMPLITUDE 24576
+// Captured level that counts as the pulse, and how long to wait for it
+#define BENCH_PULSE_THRESHOLD 2048
+#define BENCH_PULSE_TIMEOUT_MS 2000
+#define BENCH_LOOPBACK_RATE 48000
+
+static const uint32_t bench_rates[] = { 8000, 16000, 44100, 48000 };
+static const unsigned int bench_channels[] = { 1, 2 };
+// Names of out_profiles in audio_hw.c, selected with the output_profile parameter
+static const char * const bench_profiles[] = { "primary", "low_latency", "deep_buffer" };
+
+struct bench_options {
+    const char *module;
+    unsigned int seconds;
+    unsigned int cycles;
+    bool loopback;
+    int threshold;
+};
+
+// Call durations in ns, for percentiles
+struct bench_samples {
+    int64_t *values;
+    size_t count;
+    size_t size;
+};
+
+// A second of tone, a whole number of cycles, played in a loop
+struct bench_tone {
+    int16_t *samples;
+    size_t frames;
+    size_t pos;
+    unsigned int channels;
+};
+
+// Output kept playing by a feeder thread while routing is measured
+struct bench_feeder {
+    struct audio_stream_out *out;
+    void *buffer;
+    size_t bytes;
+    pthread_mutex_t lock;
+    bool exit;
+    pthread_t thread;
+};
+
+static int64_t bench_now_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void samples_add(struct bench_samples *samples, int64_t value)
+{
+    if (samples->count == samples->size) {
+        size_t size = samples->size ? samples->size * 2 : 256;
+        int64_t *values = realloc(samples->values, size * sizeof(int64_t));
+        if (!values)
+            return;
+        samples->values = values;
+        samples->size = size;
+    }
+    samples->values[samples->count++] = value;
+}
+
+static void samples_free(struct bench_samples *samples)
+{
+    free(samples->values);
+    memset(samples, 0, sizeof(*samples));
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double samples_percentile_us(struct bench_samples *samples, unsigned int percent)
+{
+    size_t index;
+    if (!samples->count)
+        return 0;
+    index = (samples->count - 1) * percent / 100;
+    return samples->values[index] / 1000.0;
+}
+
+// Prints "name": {count, p50, p90, p99, max} in us; sorts the samples
+static void print_samples(FILE *json, const char *name, struct bench_samples *samples)
+{
+    qsort(samples->values, samples->count, sizeof(int64_t), compare_int64);
+    fprintf(json, "\"%s\": {\"count\": %zu, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+            "\"max\": %.1f}", name, samples->count, samples_percentile_us(samples, 50),
+            samples_percentile_us(samples, 90), samples_percentile_us(samples, 99),
+            samples_percentile_us(samples, 100));
+}
+
+// Computed up front so that the CPU time measured is the HAL's
+static int tone_init(struct bench_tone *tone, uint32_t rate, unsigned int channels)
+{
+    size_t i;
+    unsigned int c;
+
+    tone->samples = malloc(rate * channels * sizeof(int16_t));
+    if (!tone->samples)
+        return -ENOMEM;
+    tone->frames = rate;
+    tone->pos = 0;
+    tone->channels = channels;
+    for (i = 0; i < rate; i++) {
+        int16_t sample = BENCH_TONE_AMPLITUDE * sin(2 * M_PI * BENCH_TONE_HZ * i / rate);
+        for (c = 0; c < channels; c++)
+            tone->samples[i * channels + c] = sample;
+    }
+    return 0;
+}
+
+static void tone_fill(struct bench_tone *tone, int16_t *buffer, size_t frames)
+{
+    while (frames) {
+        size_t count = tone->frames - tone->pos;
+        if (count > frames)
+            count = frames;
+        memcpy(buffer, tone->samples + tone->pos * tone->channels,
+                count * tone->channels * sizeof(int16_t));
+        buffer += count * tone->channels;
+        tone->pos = (tone->pos + count) % tone->frames;
+        frames -= count;
+    }
+}
+
+static void tone_free(struct bench_tone *tone)
+{
+    free(tone->samples);
+}
+
+static int bench_open_output(struct audio_hw_device *dev, uint32_t devices, uint32_t rate,
+                             unsigned int channels, struct audio_stream_out **out)
+{
+    int format = AUDIO_FORMAT_PCM_16_BIT;
+    uint32_t channel_mask = (channels == 1) ? AUDIO_CHANNEL_OUT_MONO : AUDIO_CHANNEL_OUT_STEREO;
+    return dev->open_output_stream(dev, devices, &format, &channel_mask, &rate, out);
+}
+
+/*
+ * Writes a tone for the benchmark duration. The HAL may open the stream at
+ * another rate or channel count than requested; the tone follows what it
+ * reports, like AudioFlinger does.
+ */
+static void bench_output(FILE *json, struct audio_hw_device *dev,
+                         const struct bench_options *options, uint32_t rate,
+                         unsigned int channels)
+{
+    struct audio_stream_out *out;
+    struct bench_samples samples;
+    struct bench_tone tone;
+    int ret = bench_open_output(dev, AUDIO_DEVICE_OUT_SPEAKER, rate, channels, &out);
+
+    fprintf(json, "{\"rate\": %u, \"channels\": %u, ", rate, channels);
+    if (ret) {
+        fprintf(json, "\"error\": %d}", ret);
+        return;
+    }
+
+    uint32_t out_rate = out->common.get_sample_rate(&out->common);
+    unsigned int out_channels = popcount(out->common.get_channels(&out->common));
+    size_t bytes = out->common.get_buffer_size(&out->common);
+    size_t frames = bytes / (out_channels * sizeof(int16_t));
+    int16_t *buffer = malloc(bytes);
+    uint64_t total_frames = 0;
+    unsigned int errors = 0;
+    int64_t first_write_ns;
+
+    memset(&samples, 0, sizeof(samples));
+    if (!buffer || tone_init(&tone, out_rate, out_channels)) {
+        free(buffer);
+        dev->close_output_stream(dev, out);
+        fprintf(json, "\"error\": %d}", -ENOMEM);
+        return;
+    }
+
+    // The first write leaves standby, it is reported on its own
+    tone_fill(&tone, buffer, frames);
+    int64_t start_ns = bench_now_ns(CLOCK_MONOTONIC);
+    int64_t start_cpu_ns = bench_now_ns(CLOCK_PROCESS_CPUTIME_ID);
+    if (out->write(out, buffer, bytes) < 0)
+        errors++;
+    first_write_ns = bench_now_ns(CLOCK_MONOTONIC) - start_ns;
+    total_frames += frames;
+
+    while (total_frames < (uint64_t)out_rate * options->seconds) {
+        tone_fill(&tone, buffer, frames);
+        int64_t call_ns = bench_now_ns(CLOCK_MONOTONIC);
+        if (out->write(out, buffer, bytes) < 0)
+            errors++;
+        samples_add(&samples, bench_now_ns(CLOCK_MONOTONIC) - call_ns);
+        total_frames += frames;
+    }
+    double wall_s = (bench_now_ns(CLOCK_MONOTONIC) - start_ns) / 1e9;
+    double cpu_ms = (bench_now_ns(CLOCK_PROCESS_CPUTIME_ID) - start_cpu_ns) / 1e6;
+    double audio_s = (double)total_frames / out_rate;
+
+    out->common.standby(&out->common);
+    dev->close_output_stream(dev, out);
+    tone_free(&tone);
+    free(buffer);
+
+    fprintf(json, "\"stream_rate\": %u, \"stream_channels\": %u, \"buffer_frames\": %zu, "
+            "\"frames\": %llu, \"errors\": %u, \"frames_per_s\": %.1f, \"realtime_ratio\": %.3f, "
+            "\"cpu_ms_per_audio_s\": %.3f, \"first_write_us\": %.1f, ", out_rate, out_channels,
+            frames, (unsigned long long)total_frames, errors, total_frames / wall_s,
+            audio_s / wall_s, cpu_ms / audio_s, first_write_ns / 1000.0);
+    print_samples(json, "write_us", &samples);
+    fprintf(json, "}");
+    samples_free(&samples);
+}
+
+static void bench_input(FILE *json, struct audio_hw_device *dev,
+                        const struct bench_options *options, uint32_t rate,
+                        unsigned int channels)
+{
+    struct audio_stream_in *in;
+    struct bench_samples samples;
+    int format = AUDIO_FORMAT_PCM_16_BIT;
+    uint32_t channel_mask = (channels == 1) ? AUDIO_CHANNEL_IN_MONO : AUDIO_CHANNEL_IN_STEREO;
+    uint32_t requested_rate = rate;
+    int ret = dev->open_input_stream(dev, AUDIO_DEVICE_IN_BUILTIN_MIC, &format, &channel_mask,
+                                     &requested_rate, (audio_in_acoustics_t)0, &in);
+
+    fprintf(json, "{\"rate\": %u, \"channels\": %u, ", rate, channels);
+    if (ret) {
+        fprintf(json, "\"error\": %d}", ret);
+        return;
+    }
+
+    uint32_t in_rate = in->common.get_sample_rate(&in->common);
+    unsigned int in_channels = popcount(in->common.get_channels(&in->common));
+    size_t bytes = in->common.get_buffer_size(&in->common);
+    size_t frames = bytes / (in_channels * sizeof(int16_t));
+    void *buffer = malloc(bytes);
+    uint64_t total_frames = 0;
+    unsigned int errors = 0;
+    int64_t first_read_ns;
+
+    memset(&samples, 0, sizeof(samples));
+    if (!buffer) {
+        dev->close_input_stream(dev, in);
+        fprintf(json, "\"error\": %d}", -ENOMEM);
+        return;
+    }
+
+    int64_t start_ns = bench_now_ns(CLOCK_MONOTONIC);
+    int64_t start_cpu_ns = bench_now_ns(CLOCK_PROCESS_CPUTIME_ID);
+    if (in->read(in, buffer, bytes) < 0)
+        errors++;
+    first_read_ns = bench_now_ns(CLOCK_MONOTONIC) - start_ns;
+    total_frames += frames;
+
+    while (total_frames < (uint64_t)in_rate * options->seconds) {
+        int64_t call_ns = bench_now_ns(CLOCK_MONOTONIC);
+        if (in->read(in, buffer, bytes) < 0)
+            errors++;
+        samples_add(&samples, bench_now_ns(CLOCK_MONOTONIC) - call_ns);
+        total_frames += frames;
+    }
+    double wall_s = (bench_now_ns(CLOCK_MONOTONIC) - start_ns) / 1e9;
+    double cpu_ms = (bench_now_ns(CLOCK_PROCESS_CPUTIME_ID) - start_cpu_ns) / 1e6;
+    double audio_s = (double)total_frames / in_rate;
+
+    in->common.standby(&in->common);
+    dev->close_input_stream(dev, in);
+    free(buffer);
+
+    fprintf(json, "\"stream_rate\": %u, \"stream_channels\": %u, \"buffer_frames\": %zu, "
+            "\"frames\": %llu, \"errors\": %u, \"frames_per_s\": %.1f, \"realtime_ratio\": %.3f, "
+            "\"cpu_ms_per_audio_s\": %.3f, \"first_read_us\": %.1f, ", in_rate, in_channels,
+            frames, (unsigned long long)total_frames, errors,
+            total_frames / wall_s, audio_s / wall_s, cpu_ms / audio_s, first_read_ns / 1000.0);
+    print_samples(json, "read_us", &samples);
+    fprintf(json, "}");
+    samples_free(&samples);
+}
+
+static void *bench_feeder_thread(void *context)
+{
+    struct bench_feeder *feeder = (struct bench_feeder *)context;
+    for (;;) {
+        pthread_mutex_lock(&feeder->lock);
+        bool exit = feeder->exit;
+        pthread_mutex_unlock(&feeder->lock);
+        if (exit)
+            break;
+        feeder->out->write(feeder->out, feeder->buffer, feeder->bytes);
+    }
+    return NULL;
+}
+
+static int bench_feeder_start(struct bench_feeder *feeder, struct audio_stream_out *out)
+{
+    struct bench_tone tone;
+    uint32_t rate = out->common.get_sample_rate(&out->common);
+    unsigned int channels = popcount(out->common.get_channels(&out->common));
+
+    feeder->out = out;
+    feeder->bytes = out->common.get_buffer_size(&out->common);
+    feeder->buffer = malloc(feeder->bytes);
+    if (!feeder->buffer || tone_init(&tone, rate, channels)) {
+        free(feeder->buffer);
+        return -ENOMEM;
+    }
+    // The same buffer over and over: not a continuous tone, but the HAL does not care
+    tone_fill(&tone, feeder->buffer, feeder->bytes / (channels * sizeof(int16_t)));
+    tone_free(&tone);
+    feeder->exit = false;
+    pthread_mutex_init(&feeder->lock, NULL);
+    if (pthread_create(&feeder->thread, NULL, bench_feeder_thread, feeder)) {
+        pthread_mutex_destroy(&feeder->lock);
+        free(feeder->buffer);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void bench_feeder_stop(struct bench_feeder *feeder)
+{
+    pthread_mutex_lock(&feeder->lock);
+    feeder->exit = true;
+    pthread_mutex_unlock(&feeder->lock);
+    pthread_join(feeder->thread, NULL);
+    pthread_mutex_destroy(&feeder->lock);
+    free(feeder->buffer);
+}
+
+/*
+ * Cost of a routing request to the caller, alternating speaker and
+ * headphone on an output kept playing. The switch itself runs on the
+ * route worker and shows in the HAL dump, not here.
+ */
+static void bench_routing(FILE *json, struct audio_hw_device *dev,
+                          const struct bench_options *options)
+{
+    struct audio_stream_out *out;
+    struct bench_feeder feeder;
+    struct bench_samples samples;
+    unsigned int i;
+    int ret = bench_open_output(dev, AUDIO_DEVICE_OUT_SPEAKER, 0, 2, &out);
+
+    fprintf(json, "{");
+    if (!ret) {
+        ret = bench_feeder_start(&feeder, out);
+        if (ret)
+            dev->close_output_stream(dev, out);
+    }
+    if (ret) {
+        fprintf(json, "\"error\": %d}", ret);
+        return;
+    }
+
+    memset(&samples, 0, sizeof(samples));
+    usleep(BENCH_ROUTE_SETTLE_MS * 1000);
+    for (i = 0; i < options->cycles; i++) {
+        char kvpairs[32];
+        snprintf(kvpairs, sizeof(kvpairs), "%s=%d", AUDIO_PARAMETER_STREAM_ROUTING,
+                (i & 1) ? AUDIO_DEVICE_OUT_SPEAKER : AUDIO_DEVICE_OUT_WIRED_HEADPHONE);
+        int64_t call_ns = bench_now_ns(CLOCK_MONOTONIC);
+        out->common.set_parameters(&out->common, kvpairs);
+        samples_add(&samples, bench_now_ns(CLOCK_MONOTONIC) - call_ns);
+        usleep(BENCH_ROUTE_SETTLE_MS * 1000);
+    }
+
+    bench_feeder_stop(&feeder);
+    out->common.standby(&out->common);
+    dev->close_output_stream(dev, out);
+    print_samples(json, "set_parameters_us", &samples);
+    fprintf(json, "}");
+    samples_free(&samples);
+}
+
+/*
+ * Standby on a playing output and the write that brings it back, which
+ * is where a PCM reopen shows. A write right after standby finds the PCM
+ * kept for the standby delay, the one after a pause of the delay does not.
+ */
+static void bench_standby(FILE *json, struct audio_hw_device *dev,
+                          const struct bench_options *options, unsigned int pause_ms)
+{
+    struct audio_stream_out *out;
+    struct bench_samples standby_samples;
+    struct bench_samples resume_samples;
+    struct bench_tone tone;
+    unsigned int i;
+    int ret = bench_open_output(dev, AUDIO_DEVICE_OUT_SPEAKER, 0, 2, &out);
+
+    fprintf(json, "{\"pause_ms\": %u, ", pause_ms);
+    if (ret) {
+        fprintf(json, "\"error\": %d}", ret);
+        return;
+    }
+
+    uint32_t rate = out->common.get_sample_rate(&out->common);
+    unsigned int channels = popcount(out->common.get_channels(&out->common));
+    size_t bytes = out->common.get_buffer_size(&out->common);
+    size_t frames = bytes / (channels * sizeof(int16_t));
+    int16_t *buffer = malloc(bytes);
+
+    if (!buffer || tone_init(&tone, rate, channels)) {
+        free(buffer);
+        dev->close_output_stream(dev, out);
+        fprintf(json, "\"error\": %d}", -ENOMEM);
+        return;
+    }
+    memset(&standby_samples, 0, sizeof(standby_samples));
+    memset(&resume_samples, 0, sizeof(resume_samples));
+
+    for (i = 0; i < options->cycles; i++) {
+        unsigned int j;
+        // Enough writes for the PCM to be running
+        for (j = 0; j < 4; j++) {
+            tone_fill(&tone, buffer, frames);
+            out->write(out, buffer, bytes);
+        }
+        int64_t call_ns = bench_now_ns(CLOCK_MONOTONIC);
+        out->common.standby(&out->common);
+        samples_add(&standby_samples, bench_now_ns(CLOCK_MONOTONIC) - call_ns);
+        usleep(pause_ms * 1000);
+        tone_fill(&tone, buffer, frames);
+        call_ns = bench_now_ns(CLOCK_MONOTONIC);
+        out->write(out, buffer, bytes);
+        samples_add(&resume_samples, bench_now_ns(CLOCK_MONOTONIC) - call_ns);
+    }
+
+    out->common.standby(&out->common);
+    dev->close_output_stream(dev, out);
+    tone_free(&tone);
+    free(buffer);
+    print_samples(json, "standby_us", &standby_samples);
+    fprintf(json, ", ");
+    print_samples(json, "resume_write_us", &resume_samples);
+    fprintf(json, "}");
+    samples_free(&standby_samples);
+    samples_free(&resume_samples);
+}
+
+/*
+ * One loopback run. The main thread plays silence with a pulse every
+ * interval and notes when it handed each one to the HAL, the capture
+ * thread notes when it read each one back.
+ */
+struct bench_loopback {
+    struct audio_stream_out *out;
+    struct audio_stream_in *in;
+    int threshold;
+    pthread_mutex_t lock;
+    // Handed over, oldest first, and not heard yet
+    int64_t pending_ns[BENCH_PULSE_TIMEOUT_MS / BENCH_PULSE_INTERVAL_MS + 2];
+    unsigned int pending;
+    struct bench_samples round_trip;
+    bool exit;
+};
+
+// Matches a pulse heard at heard_ns to the oldest one played within the timeout
+static void loopback_heard(struct bench_loopback *loopback, int64_t heard_ns)
+{
+    pthread_mutex_lock(&loopback->lock);
+    while (loopback->pending) {
+        int64_t played_ns = loopback->pending_ns[0];
+        loopback->pending--;
+        memmove(loopback->pending_ns, loopback->pending_ns + 1,
+                loopback->pending * sizeof(int64_t));
+        if (heard_ns - played_ns <= BENCH_PULSE_TIMEOUT_MS * 1000000LL) {
+            if (heard_ns >= played_ns)
+                samples_add(&loopback->round_trip, heard_ns - played_ns);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&loopback->lock);
+}
+
+static void loopback_played(struct bench_loopback *loopback, int64_t played_ns)
+{
+    pthread_mutex_lock(&loopback->lock);
+    if (loopback->pending == sizeof(loopback->pending_ns) / sizeof(loopback->pending_ns[0])) {
+        // The oldest was not heard within the timeout
+        loopback->pending--;
+        memmove(loopback->pending_ns, loopback->pending_ns + 1,
+                loopback->pending * sizeof(int64_t));
+    }
+    loopback->pending_ns[loopback->pending++] = played_ns;
+    pthread_mutex_unlock(&loopback->lock);
+}
+
+static bool loopback_exiting(struct bench_loopback *loopback)
+{
+    bool exit;
+    pthread_mutex_lock(&loopback->lock);
+    exit = loopback->exit;
+    pthread_mutex_unlock(&loopback->lock);
+    return exit;
+}
+
+static void *loopback_capture_thread(void *context)
+{
+    struct bench_loopback *loopback = (struct bench_loopback *)context;
+    struct audio_stream_in *in = loopback->in;
+    uint32_t rate = in->common.get_sample_rate(&in->common);
+    unsigned int channels = popcount(in->common.get_channels(&in->common));
+    size_t bytes = in->common.get_buffer_size(&in->common);
+    size_t frames = bytes / (channels * sizeof(int16_t));
+    // After a pulse, its tail and echoes are not new pulses
+    int64_t holdoff = (int64_t)rate * BENCH_PULSE_INTERVAL_MS / 2000;
+    int64_t position = 0;
+    int64_t last = -holdoff;
+    int16_t *buffer = malloc(bytes);
+
+    if (!buffer)
+        return NULL;
+    while (!loopback_exiting(loopback)) {
+        size_t i;
+        if (in->read(in, buffer, bytes) < 0) {
+            usleep(frames * 1000000LL / rate);
+            position += frames;
+            continue;
+        }
+        int64_t read_ns = bench_now_ns(CLOCK_MONOTONIC);
+        for (i = 0; i < frames; i++) {
+            int sample = buffer[i * channels];
+            if (position + (int64_t)i - last < holdoff)
+                continue;
+            if (sample > loopback->threshold || sample < -loopback->threshold) {
+                last = position + i;
+                // The frame was captured the rest of the buffer before the read returned
+                loopback_heard(loopback, read_ns - (frames - i) * 1000000000LL / rate);
+            }
+        }
+        position += frames;
+    }
+    free(buffer);
+    return NULL;
+}
+
+static void loopback_pulse(int16_t *buffer, size_t frames, unsigned int channels, uint32_t rate)
+{
+    size_t half_cycle = rate / (2 * BENCH_PULSE_HZ);
+    size_t i;
+    unsigned int c;
+
+    for (i = 0; i < frames; i++) {
+        int16_t sample = ((i / half_cycle) & 1) ? -BENCH_PULSE_AMPLITUDE : BENCH_PULSE_AMPLITUDE;
+        for (c = 0; c < channels; c++)
+            *buffer++ = sample;
+    }
+}
+
+/*
+ * Round trip from the write() that hands a pulse over to the read() that
+ * returns it, per pulse, with the output on one profile. This is the
+ * latency an application doing both sees, not only the HAL buffering.
+ */
+static void bench_loopback(FILE *json, struct audio_hw_device *dev,
+                           const struct bench_options *options, const char *profile)
+{
+    struct bench_loopback loopback;
+    pthread_t thread;
+    char kvpairs[64];
+    int format = AUDIO_FORMAT_PCM_16_BIT;
+    uint32_t channel_mask = AUDIO_CHANNEL_IN_MONO;
+    uint32_t in_rate = BENCH_LOOPBACK_RATE;
+    int ret;
+
+    memset(&loopback, 0, sizeof(loopback));
+    loopback.threshold = options->threshold;
+    pthread_mutex_init(&loopback.lock, NULL);
+    fprintf(json, "{\"profile\": \"%s\", ", profile);
+
+    ret = bench_open_output(dev, AUDIO_DEVICE_OUT_SPEAKER, BENCH_LOOPBACK_RATE, 2, &loopback.out);
+    if (ret) {
+        fprintf(json, "\"error\": %d}", ret);
+        return;
+    }
+    snprintf(kvpairs, sizeof(kvpairs), "output_profile=%s", profile);
+    loopback.out->common.set_parameters(&loopback.out->common, kvpairs);
+    ret = dev->open_input_stream(dev, AUDIO_DEVICE_IN_BUILTIN_MIC, &format, &channel_mask,
+                                 &in_rate, (audio_in_acoustics_t)0, &loopback.in);
+    if (ret) {
+        dev->close_output_stream(dev, loopback.out);
+        fprintf(json, "\"error\": %d}", ret);
+        return;
+    }
+
+    struct audio_stream_out *out = loopback.out;
+    uint32_t rate = out->common.get_sample_rate(&out->common);
+    unsigned int channels = popcount(out->common.get_channels(&out->common));
+    size_t bytes = out->common.get_buffer_size(&out->common);
+    size_t frames = bytes / (channels * sizeof(int16_t));
+    size_t pulse_frames = rate * BENCH_PULSE_MS / 1000;
+    size_t interval = rate * BENCH_PULSE_INTERVAL_MS / 1000;
+    int16_t *buffer = malloc(bytes);
+    // Writes only block, and so pace the pulses, once the output buffer is full
+    uint64_t next_pulse = (uint64_t)rate * out->get_latency(out) / 1000 + interval / 2;
+    uint64_t position = 0;
+    uint64_t end = next_pulse + (uint64_t)interval * options->cycles +
+            (uint64_t)rate * BENCH_PULSE_TIMEOUT_MS / 1000;
+    unsigned int pulses = 0;
+
+    if (!buffer || pthread_create(&thread, NULL, loopback_capture_thread, &loopback)) {
+        free(buffer);
+        dev->close_input_stream(dev, loopback.in);
+        dev->close_output_stream(dev, out);
+        fprintf(json, "\"error\": %d}", -ENOMEM);
+        return;
+    }
+
+    while (position < end) {
+        int64_t write_ns = -1;
+        memset(buffer, 0, bytes);
+        // Pulses start within a buffer and are cut at its end, they are short enough
+        if (pulses < options->cycles && next_pulse < position + frames) {
+            size_t offset = next_pulse - position;
+            size_t count = (pulse_frames < frames - offset) ? pulse_frames : frames - offset;
+            loopback_pulse(buffer + offset * channels, count, channels, rate);
+            write_ns = bench_now_ns(CLOCK_MONOTONIC) + offset * 1000000000LL / rate;
+            next_pulse += interval;
+            pulses++;
+        }
+        if (write_ns >= 0)
+            loopback_played(&loopback, write_ns);
+        out->write(out, buffer, bytes);
+        position += frames;
+    }
+
+    pthread_mutex_lock(&loopback.lock);
+    loopback.exit = true;
+    pthread_mutex_unlock(&loopback.lock);
+    pthread_join(thread, NULL);
+    uint32_t latency_ms = out->get_latency(out);
+    size_t in_frames = loopback.in->common.get_buffer_size(&loopback.in->common) / sizeof(int16_t);
+    dev->close_input_stream(dev, loopback.in);
+    out->common.standby(&out->common);
+    dev->close_output_stream(dev, out);
+    free(buffer);
+
+    // Jitter is the standard deviation of the round trip
+    double mean_us = 0, jitter_us = 0;
+    size_t i;
+    for (i = 0; i < loopback.round_trip.count; i++)
+        mean_us += loopback.round_trip.values[i] / 1000.0;
+    if (loopback.round_trip.count)
+        mean_us /= loopback.round_trip.count;
+    for (i = 0; i < loopback.round_trip.count; i++) {
+        double d = loopback.round_trip.values[i] / 1000.0 - mean_us;
+        jitter_us += d * d;
+    }
+    if (loopback.round_trip.count)
+        jitter_us = sqrt(jitter_us / loopback.round_trip.count);
+
+    fprintf(json, "\"buffer_frames\": %zu, \"in_buffer_frames\": %zu, "
+            "\"reported_latency_ms\": %u, \"pulses\": %u, \"heard\": %zu, "
+            "\"mean_us\": %.1f, \"jitter_us\": %.1f, ", frames, in_frames, latency_ms, pulses,
+            loopback.round_trip.count, mean_us, jitter_us);
+    print_samples(json, "round_trip_us", &loopback.round_trip);
+    fprintf(json, "}");
+    samples_free(&loopback.round_trip);
+    pthread_mutex_destroy(&loopback.lock);
+}
+
+static void bench_suite(FILE *json, struct audio_hw_device *dev,
+                        const struct bench_options *options)
+{
+    size_t r, c;
+
+    fprintf(json, " \"output\": [");
+    for (r = 0; r < sizeof(bench_rates) / sizeof(bench_rates[0]); r++) {
+        for (c = 0; c < sizeof(bench_channels) / sizeof(bench_channels[0]); c++) {
+            fprintf(json, (r || c) ? ",\n  " : "\n  ");
+            bench_output(json, dev, options, bench_rates[r], bench_channels[c]);
+        }
+    }
+    fprintf(json, "],\n \"input\": [");
+    for (r = 0; r < sizeof(bench_rates) / sizeof(bench_rates[0]); r++) {
+        for (c = 0; c < sizeof(bench_channels) / sizeof(bench_channels[0]); c++) {
+            fprintf(json, (r || c) ? ",\n  " : "\n  ");
+            bench_input(json, dev, options, bench_rates[r], bench_channels[c]);
+        }
+    }
+    fprintf(json, "],\n \"routing\": ");
+    bench_routing(json, dev, options);
+    fprintf(json, ",\n \"standby\": [\n  ");
+    bench_standby(json, dev, options, 0);
+    fprintf(json, ",\n  ");
+    bench_standby(json, dev, options, BENCH_COLD_PAUSE_MS);
+    fprintf(json, "]");
+}
+
+static struct audio_hw_device *bench_load(const char *path, struct hw_module_t **module)
+{
+    struct audio_hw_device *dev;
+    void *handle = dlopen(path, RTLD_NOW);
+
+    if (!handle) {
+        fprintf(stderr, "cannot load %s: %s\n", path, dlerror());
+        return NULL;
+    }
+    *module = (struct hw_module_t *)dlsym(handle, HAL_MODULE_INFO_SYM_AS_STR);
+    if (!*module || strcmp((*module)->id, AUDIO_HARDWARE_MODULE_ID)) {
+        fprintf(stderr, "%s is not an audio HAL\n", path);
+        dlclose(handle);
+        return NULL;
+    }
+    (*module)->dso = handle;
+    if (audio_hw_device_open(*module, &dev)) {
+        fprintf(stderr, "cannot open the audio HAL device\n");
+        dlclose(handle);
+        return NULL;
+    }
+    return dev;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-m module] [-s seconds] [-c cycles] [-l [-t threshold]]\n"
+            "  -m  HAL module to load, default %s\n"
+            "  -s  audio seconds per stream configuration, default %u\n"
+            "  -c  routing and standby cycles, or loopback pulses, default %u\n"
+            "  -l  measure round-trip latency through a loopback instead\n"
+            "  -t  captured level that counts as the pulse, default %d\n",
+            name, BENCH_MODULE, BENCH_SECONDS, BENCH_CYCLES, BENCH_PULSE_THRESHOLD);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_options options = { BENCH_MODULE, BENCH_SECONDS, BENCH_CYCLES, false,
+                                     BENCH_PULSE_THRESHOLD };
+    struct hw_module_t *module;
+    struct audio_hw_device *dev;
+    FILE *json = stdout;
+    size_t p;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:s:c:lt:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            options.module = optarg;
+            break;
+        case 's':
+            options.seconds = atoi(optarg);
+            break;
+        case 'c':
+            options.cycles = atoi(optarg);
+            break;
+        case 'l':
+            options.loopback = true;
+            break;
+        case 't':
+            options.threshold = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!options.seconds || !options.cycles || options.threshold <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    dev = bench_load(options.module, &module);
+    if (!dev)
+        return 1;
+
+    if (options.loopback) {
+        fprintf(json, "{\"module\": \"%s\", \"mode\": \"loopback\", \"pulses\": %u, "
+                "\"threshold\": %d,\n \"profiles\": [", module->name, options.cycles,
+                options.threshold);
+        for (p = 0; p < sizeof(bench_profiles) / sizeof(bench_profiles[0]); p++) {
+            fprintf(json, p ? ",\n  " : "\n  ");
+            bench_loopback(json, dev, &options, bench_profiles[p]);
+        }
+        fprintf(json, "]}\n");
+    } else {
+        fprintf(json, "{\"module\": \"%s\", \"mode\": \"suite\", \"seconds\": %u, "
+                "\"cycles\": %u,\n", module->name, options.seconds, options.cycles);
+        bench_suite(json, dev, &options);
+        fprintf(json, "}\n");
+    }
+
+    audio_hw_device_close(dev);
+    dlclose(module->dso);
+    return 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * Stand-in for the Jelly Bean <cutils/log.h> in the host build of
+ * __portaudio_hw.c: this tree's log macros under their ALOG names.
+ */
+
+#ifndef LIFEDJIK_AUDIO_HOST_JB_CUTILS_LOG_H
+#define LIFEDJIK_AUDIO_HOST_JB_CUTILS_LOG_H
+
+#include_next <cutils/log.h>
+
+#ifndef ALOGV
+#define ALOGV LOGV
+#endif
+#ifndef ALOGD
+#define ALOGD LOGD
+#endif
+#ifndef ALOGI
+#define ALOGI LOGI
+#endif
+#ifndef ALOGW
+#define ALOGW LOGW
+#endif
+#ifndef ALOGE
+#define ALOGE LOGE
+#endif
+
+#endif // LIFEDJIK_AUDIO_HOST_JB_CUTILS_LOG_H
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * Stand-in for the Jelly Bean <hardware/audio.h> in the host build of
+ * __portaudio_hw.c: the audio device API 2.0 with struct audio_config,
+ * I/O handles and output flags. Only what the port uses is declared.
+ */
+
+#ifndef LIFEDJIK_AUDIO_HOST_JB_HARDWARE_AUDIO_H
+#define LIFEDJIK_AUDIO_HOST_JB_HARDWARE_AUDIO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+#include <cutils/bitops.h>
+
+#include <hardware/hardware.h>
+#include <system/audio.h>
+#include <hardware/audio_effect.h>
+
+__BEGIN_DECLS
+
+#define AUDIO_HARDWARE_MODULE_ID "audio"
+#define AUDIO_HARDWARE_INTERFACE "audio_hw_if"
+
+#define AUDIO_MODULE_API_VERSION_0_1 HARDWARE_MAKE_API_VERSION(0, 1)
+#define AUDIO_DEVICE_API_VERSION_2_0 HARDWARE_MAKE_API_VERSION(2, 0)
+
+struct audio_config {
+    uint32_t sample_rate;
+    audio_channel_mask_t channel_mask;
+    audio_format_t format;
+};
+
+struct audio_stream {
+    uint32_t (*get_sample_rate)(const struct audio_stream *stream);
+    int (*set_sample_rate)(struct audio_stream *stream, uint32_t rate);
+    size_t (*get_buffer_size)(const struct audio_stream *stream);
+    audio_channel_mask_t (*get_channels)(const struct audio_stream *stream);
+    audio_format_t (*get_format)(const struct audio_stream *stream);
+    int (*set_format)(struct audio_stream *stream, audio_format_t format);
+    int (*standby)(struct audio_stream *stream);
+    int (*dump)(const struct audio_stream *stream, int fd);
+    audio_devices_t (*get_device)(const struct audio_stream *stream);
+    int (*set_device)(struct audio_stream *stream, audio_devices_t device);
+    int (*set_parameters)(struct audio_stream *stream, const char *kv_pairs);
+    char * (*get_parameters)(const struct audio_stream *stream, const char *keys);
+    int (*add_audio_effect)(const struct audio_stream *stream, effect_handle_t effect);
+    int (*remove_audio_effect)(const struct audio_stream *stream, effect_handle_t effect);
+};
+typedef struct audio_stream audio_stream_t;
+
+struct audio_stream_out {
+    struct audio_stream common;
+    uint32_t (*get_latency)(const struct audio_stream_out *stream);
+    int (*set_volume)(struct audio_stream_out *stream, float left, float right);
+    ssize_t (*write)(struct audio_stream_out *stream, const void* buffer, size_t bytes);
+    int (*get_render_position)(const struct audio_stream_out *stream, uint32_t *dsp_frames);
+    int (*get_next_write_timestamp)(const struct audio_stream_out *stream, int64_t *timestamp);
+};
+typedef struct audio_stream_out audio_stream_out_t;
+
+struct audio_stream_in {
+    struct audio_stream common;
+    int (*set_gain)(struct audio_stream_in *stream, float gain);
+    ssize_t (*read)(struct audio_stream_in *stream, void* buffer, size_t bytes);
+    uint32_t (*get_input_frames_lost)(struct audio_stream_in *stream);
+};
+typedef struct audio_stream_in audio_stream_in_t;
+
+static inline size_t audio_stream_frame_size(const struct audio_stream *s)
+{
+    size_t chan_samp_sz = (s->get_format(s) == AUDIO_FORMAT_PCM_16_BIT) ?
+            sizeof(int16_t) : sizeof(int8_t);
+    return popcount(s->get_channels(s)) * chan_samp_sz;
+}
+
+struct audio_module {
+    struct hw_module_t common;
+};
+
+struct audio_hw_device {
+    struct hw_device_t common;
+    uint32_t (*get_supported_devices)(const struct audio_hw_device *dev);
+    int (*init_check)(const struct audio_hw_device *dev);
+    int (*set_voice_volume)(struct audio_hw_device *dev, float volume);
+    int (*set_master_volume)(struct audio_hw_device *dev, float volume);
+    int (*get_master_volume)(struct audio_hw_device *dev, float *volume);
+    int (*set_mode)(struct audio_hw_device *dev, audio_mode_t mode);
+    int (*set_mic_mute)(struct audio_hw_device *dev, bool state);
+    int (*get_mic_mute)(const struct audio_hw_device *dev, bool *state);
+    int (*set_parameters)(struct audio_hw_device *dev, const char *kv_pairs);
+    char * (*get_parameters)(const struct audio_hw_device *dev, const char *keys);
+    size_t (*get_input_buffer_size)(const struct audio_hw_device *dev,
+                                    const struct audio_config *config);
+    int (*open_output_stream)(struct audio_hw_device *dev, audio_io_handle_t handle,
+                              audio_devices_t devices, audio_output_flags_t flags,
+                              struct audio_config *config, struct audio_stream_out **stream_out);
+    void (*close_output_stream)(struct audio_hw_device *dev, struct audio_stream_out* stream_out);
+    int (*open_input_stream)(struct audio_hw_device *dev, audio_io_handle_t handle,
+                             audio_devices_t devices, struct audio_config *config,
+                             struct audio_stream_in **stream_in);
+    void (*close_input_stream)(struct audio_hw_device *dev, struct audio_stream_in *stream_in);
+    int (*dump)(const struct audio_hw_device *dev, int fd);
+    int (*set_master_mute)(struct audio_hw_device *dev, bool mute);
+    int (*get_master_mute)(struct audio_hw_device *dev, bool *mute);
+};
+typedef struct audio_hw_device audio_hw_device_t;
+
+static inline int audio_hw_device_open(const struct hw_module_t* module,
+                                       struct audio_hw_device** device)
+{
+    return module->methods->open(module, AUDIO_HARDWARE_INTERFACE,
+            (struct hw_device_t**)device);
+}
+
+static inline int audio_hw_device_close(struct audio_hw_device* device)
+{
+    return device->common.close(&device->common);
+}
+
+__END_DECLS
+
+#endif // LIFEDJIK_AUDIO_HOST_JB_HARDWARE_AUDIO_H
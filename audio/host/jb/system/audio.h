@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * Stand-in for the Jelly Bean <system/audio.h> in the host build of
+ * __portaudio_hw.c: this tree's header plus the output flags it lacks.
+ */
+
+#ifndef LIFEDJIK_AUDIO_HOST_JB_SYSTEM_AUDIO_H
+#define LIFEDJIK_AUDIO_HOST_JB_SYSTEM_AUDIO_H
+
+#include_next <system/audio.h>
+
+__BEGIN_DECLS
+
+typedef enum {
+    AUDIO_OUTPUT_FLAG_NONE = 0x0,
+    AUDIO_OUTPUT_FLAG_DIRECT = 0x1,
+    AUDIO_OUTPUT_FLAG_PRIMARY = 0x2,
+    AUDIO_OUTPUT_FLAG_FAST = 0x4,
+    AUDIO_OUTPUT_FLAG_DEEP_BUFFER = 0x8
+} audio_output_flags_t;
+
+__END_DECLS
+
+#endif // LIFEDJIK_AUDIO_HOST_JB_SYSTEM_AUDIO_H
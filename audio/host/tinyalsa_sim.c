@@ -0,0 +1,949 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Stand-in for tinyalsa in the host build of the audio HAL. It implements
+ * the calls audio_hw.c makes against a simulated sound card: a PCM buffer
+ * drained (or filled, for capture) by the monotonic clock at the stream
+ * rate, with the tinyalsa defaults for the start and stop thresholds, and a
+ * mixer that accepts any control and logs every write. Controls belong to
+ * the card, so a second mixer_open() reads back what the HAL set.
+ *
+ * Set in the environment:
+ *  TINYALSA_SIM_RECORD_DIR   playback is written to <dir>/pcmC<card>D<device>p.raw,
+ *                            with underrun gaps as silence
+ *  TINYALSA_SIM_CAPTURE_FILE capture input, raw or WAV in the format of the PCM,
+ *                            looped; silence when unset
+ *  TINYALSA_SIM_LOOPBACK_US  capture hears the playback on its card instead,
+ *                            this many us after the DAC played it
+ *  TINYALSA_SIM_XRUN_EVERY   every Nth write or read stalls the clock for a buffer
+ *  TINYALSA_SIM_DELAY_US     extra time spent in write and read calls...
+ *  TINYALSA_SIM_DELAY_EVERY  ...every Nth of them, default every one
+ */
+
+#define LOG_TAG "tinyalsa_sim"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <cutils/log.h>
+#include <sound/asound.h>
+#include <tinyalsa/asoundlib.h>
+
+#define SIM_MAX_CARDS 8
+#define SIM_MAX_DEVICES 8
+// Longest underrun gap written to a recording
+#define SIM_MAX_GAP_MS 10000
+// Playback kept for the loopback, longer than any buffer plus the loopback delay
+#define SIM_LOOPBACK_MS 4000
+
+// What the simulated card takes, returned by pcm_params_get()
+#define SIM_RATE_MIN 8000
+#define SIM_RATE_MAX 48000
+#define SIM_CHANNELS_MAX 8
+
+static struct {
+    const char *record_dir;
+    const char *capture_file;
+    // Negative when the loopback is off
+    int64_t loopback_ns;
+    unsigned int xrun_every;
+    unsigned int delay_us;
+    unsigned int delay_every;
+} sim_config;
+
+/*
+ * Playback on a card as capture on it hears it: the first channel of the
+ * 16 bit playback PCM opened last, kept by position, and the clock that
+ * maps those positions to the time the DAC played them.
+ */
+static struct {
+    pthread_mutex_t lock;
+    struct pcm *source;
+    int16_t *history;
+    size_t history_frames;
+    int64_t written;
+    unsigned int card;
+    unsigned int rate;
+    // The source plays position start_ptr at start_ns and on until stop_ns
+    int64_t start_ptr;
+    int64_t start_ns;
+    int64_t stop_ns;
+} sim_loopback = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Controls of each card, created on first lookup and kept for the process
+static struct {
+    pthread_mutex_t lock;
+    struct mixer_ctl *ctls[SIM_MAX_CARDS];
+    int64_t open_ns[SIM_MAX_CARDS];
+} sim_mixers = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_once_t sim_config_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t sim_record_lock = PTHREAD_MUTEX_INITIALIZER;
+// Recordings are truncated by the first PCM of the process and appended to after
+static bool sim_recorded[SIM_MAX_CARDS][SIM_MAX_DEVICES];
+
+enum sim_state {
+    SIM_SETUP,
+    SIM_PREPARED,
+    SIM_RUNNING,
+    SIM_XRUN,
+};
+
+struct pcm {
+    pthread_mutex_t lock;
+    unsigned int card;
+    unsigned int device;
+    unsigned int flags;
+    struct pcm_config config;
+    unsigned int frame_bytes;
+    unsigned int buffer_frames;
+    unsigned int start_threshold;
+    unsigned int stop_threshold;
+    unsigned int avail_min;
+
+    enum sim_state state;
+    // Frames since open: appl_ptr moved by the caller, hw_ptr by the simulated DMA
+    int64_t appl_ptr;
+    int64_t hw_ptr;
+    // hw_ptr and the time when the clock last started
+    int64_t start_ptr;
+    int64_t start_ns;
+
+    uint8_t *area;
+    FILE *record;
+    FILE *capture;
+    // Where the samples start in the capture file, past a WAV header
+    long capture_start;
+    unsigned int calls;
+    unsigned int xruns;
+    char error[PCM_ERROR_MAX];
+};
+
+struct pcm_params {
+    unsigned int channels_max;
+};
+
+struct mixer_ctl {
+    unsigned int card;
+    struct mixer_ctl *next;
+    char *name;
+    int value;
+    // Array value of IEC958 controls
+    struct snd_aes_iec958 iec958;
+};
+
+struct mixer {
+    unsigned int card;
+};
+
+static unsigned int sim_getenv_uint(const char *name, unsigned int def)
+{
+    const char *value = getenv(name);
+    return (value && *value) ? strtoul(value, NULL, 0) : def;
+}
+
+static void sim_read_config(void)
+{
+    sim_config.record_dir = getenv("TINYALSA_SIM_RECORD_DIR");
+    sim_config.capture_file = getenv("TINYALSA_SIM_CAPTURE_FILE");
+    sim_config.loopback_ns = getenv("TINYALSA_SIM_LOOPBACK_US") ?
+            sim_getenv_uint("TINYALSA_SIM_LOOPBACK_US", 0) * 1000LL : -1;
+    sim_config.xrun_every = sim_getenv_uint("TINYALSA_SIM_XRUN_EVERY", 0);
+    sim_config.delay_us = sim_getenv_uint("TINYALSA_SIM_DELAY_US", 0);
+    sim_config.delay_every = sim_getenv_uint("TINYALSA_SIM_DELAY_EVERY", 1);
+}
+
+static int64_t sim_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sim_sleep_ns(int64_t ns)
+{
+    struct timespec ts;
+    if (ns <= 0)
+        return;
+    ts.tv_sec = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    nanosleep(&ts, NULL);
+}
+
+static int64_t sim_frames_to_ns(struct pcm *pcm, int64_t frames)
+{
+    return frames * 1000000000LL / pcm->config.rate;
+}
+
+// Where the DMA would be by now had it never stopped since the last start
+static int64_t sim_clock_ptr(struct pcm *pcm, int64_t now)
+{
+    return pcm->start_ptr + (now - pcm->start_ns) / 1000 * pcm->config.rate / 1000000;
+}
+
+// Frames the caller can write (playback) or read (capture)
+static int64_t sim_avail(struct pcm *pcm)
+{
+    if (pcm->flags & PCM_IN)
+        return pcm->hw_ptr - pcm->appl_ptr;
+    return pcm->buffer_frames - (pcm->appl_ptr - pcm->hw_ptr);
+}
+
+// Moves the DMA on to now; it stops in XRUN once avail reaches the stop threshold
+static void sim_update(struct pcm *pcm, int64_t now)
+{
+    int64_t clock;
+    int64_t limit;
+
+    if (pcm->state != SIM_RUNNING)
+        return;
+    clock = sim_clock_ptr(pcm, now);
+    if (pcm->flags & PCM_IN)
+        limit = pcm->appl_ptr + pcm->stop_threshold;
+    else
+        limit = pcm->appl_ptr + pcm->stop_threshold - pcm->buffer_frames;
+    if (clock >= limit) {
+        pcm->hw_ptr = limit;
+        pcm->state = SIM_XRUN;
+    } else {
+        pcm->hw_ptr = clock;
+    }
+}
+
+static void sim_loopback_attach(struct pcm *pcm)
+{
+    size_t frames = (size_t)pcm->config.rate * SIM_LOOPBACK_MS / 1000;
+    int16_t *history;
+
+    if (sim_config.loopback_ns < 0 || pcm->config.format != PCM_FORMAT_S16_LE)
+        return;
+    history = calloc(frames, sizeof(int16_t));
+    if (!history)
+        return;
+    pthread_mutex_lock(&sim_loopback.lock);
+    free(sim_loopback.history);
+    sim_loopback.source = pcm;
+    sim_loopback.history = history;
+    sim_loopback.history_frames = frames;
+    sim_loopback.written = 0;
+    sim_loopback.card = pcm->card;
+    sim_loopback.rate = pcm->config.rate;
+    sim_loopback.start_ns = 0;
+    sim_loopback.stop_ns = 0;
+    pthread_mutex_unlock(&sim_loopback.lock);
+}
+
+static void sim_loopback_detach(struct pcm *pcm)
+{
+    pthread_mutex_lock(&sim_loopback.lock);
+    if (sim_loopback.source == pcm)
+        sim_loopback.source = NULL;
+    pthread_mutex_unlock(&sim_loopback.lock);
+}
+
+// Follows the clock of the source after it starts, stops or stalls
+static void sim_loopback_clock(struct pcm *pcm)
+{
+    pthread_mutex_lock(&sim_loopback.lock);
+    if (sim_loopback.source == pcm) {
+        if (pcm->state == SIM_RUNNING) {
+            sim_loopback.start_ptr = pcm->start_ptr;
+            sim_loopback.start_ns = pcm->start_ns;
+            sim_loopback.stop_ns = INT64_MAX;
+        } else if (sim_loopback.stop_ns == INT64_MAX) {
+            sim_loopback.stop_ns = sim_now_ns();
+        }
+    }
+    pthread_mutex_unlock(&sim_loopback.lock);
+}
+
+// Called before the source moves appl_ptr past the frames
+static void sim_loopback_write(struct pcm *pcm, const void *data, unsigned int frames)
+{
+    const int16_t *src = (const int16_t *)data;
+    unsigned int channels = pcm->config.channels;
+    unsigned int i;
+
+    pthread_mutex_lock(&sim_loopback.lock);
+    if (sim_loopback.source == pcm) {
+        for (i = 0; i < frames; i++)
+            sim_loopback.history[(pcm->appl_ptr + i) % sim_loopback.history_frames] =
+                    src[i * channels];
+        sim_loopback.written = pcm->appl_ptr + frames;
+    }
+    pthread_mutex_unlock(&sim_loopback.lock);
+}
+
+/*
+ * Capture frames from the playback the DAC played the loopback delay
+ * before the ADC took them, silence where nothing was playing.
+ */
+static void sim_loopback_read(struct pcm *pcm, int16_t *dst, unsigned int frames)
+{
+    unsigned int channels = pcm->config.channels;
+    unsigned int i, c;
+
+    pthread_mutex_lock(&sim_loopback.lock);
+    for (i = 0; i < frames; i++) {
+        int64_t position = pcm->appl_ptr + i;
+        int64_t capture_ns = pcm->start_ns +
+                sim_frames_to_ns(pcm, position - pcm->start_ptr) - sim_config.loopback_ns;
+        int16_t sample = 0;
+
+        if (sim_loopback.source && sim_loopback.card == pcm->card &&
+                capture_ns >= sim_loopback.start_ns && capture_ns < sim_loopback.stop_ns) {
+            // In ns: rounding to us would take a frame early whenever the
+            // two clocks are about in phase
+            int64_t played = sim_loopback.start_ptr +
+                    (capture_ns - sim_loopback.start_ns) * sim_loopback.rate / 1000000000LL;
+            if (played < sim_loopback.written &&
+                    played >= sim_loopback.written - (int64_t)sim_loopback.history_frames)
+                sample = sim_loopback.history[played % sim_loopback.history_frames];
+        }
+        for (c = 0; c < channels; c++)
+            *dst++ = sample;
+    }
+    pthread_mutex_unlock(&sim_loopback.lock);
+}
+
+static void sim_start(struct pcm *pcm, int64_t now)
+{
+    pcm->state = SIM_RUNNING;
+    pcm->start_ptr = pcm->hw_ptr;
+    pcm->start_ns = now;
+    sim_loopback_clock(pcm);
+}
+
+static void sim_prepare(struct pcm *pcm)
+{
+    pcm->state = SIM_PREPARED;
+    pcm->hw_ptr = pcm->appl_ptr;
+    sim_loopback_clock(pcm);
+}
+
+static void sim_record(struct pcm *pcm, const void *data, unsigned int frames)
+{
+    if (pcm->record && frames)
+        fwrite(data, pcm->frame_bytes, frames, pcm->record);
+}
+
+/*
+ * Restarts after an xrun the way pcm_write() and pcm_read() do, without
+ * reporting it. The DAC played nothing since the underrun: that time goes
+ * to the recording as silence.
+ */
+static void sim_recover(struct pcm *pcm, int64_t now)
+{
+    if (pcm->record) {
+        static const uint8_t silence[4096];
+        int64_t gap = sim_clock_ptr(pcm, now) - pcm->appl_ptr;
+        int64_t max_gap = (int64_t)pcm->config.rate * SIM_MAX_GAP_MS / 1000;
+        unsigned int chunk = sizeof(silence) / pcm->frame_bytes;
+
+        if (gap > max_gap)
+            gap = max_gap;
+        while (gap > 0) {
+            unsigned int frames = (gap < chunk) ? gap : chunk;
+            sim_record(pcm, silence, frames);
+            gap -= frames;
+        }
+    }
+    pcm->xruns++;
+    sim_prepare(pcm);
+}
+
+// Injected faults, at the end of a write or read call: a stall and a slow return
+static int64_t sim_inject(struct pcm *pcm)
+{
+    pcm->calls++;
+    if (sim_config.xrun_every && !(pcm->calls % sim_config.xrun_every) &&
+            pcm->state == SIM_RUNNING) {
+        // As if the caller had been descheduled for a buffer and a period
+        pcm->start_ns -= sim_frames_to_ns(pcm, pcm->buffer_frames + pcm->config.period_size);
+        sim_loopback_clock(pcm);
+    }
+    if (sim_config.delay_us && sim_config.delay_every &&
+            !(pcm->calls % sim_config.delay_every))
+        return sim_config.delay_us * 1000LL;
+    return 0;
+}
+
+static void sim_open_record(struct pcm *pcm)
+{
+    char path[PATH_MAX];
+    bool append = true;
+
+    if (!sim_config.record_dir)
+        return;
+    snprintf(path, sizeof(path), "%s/pcmC%uD%up.raw", sim_config.record_dir,
+            pcm->card, pcm->device);
+    pthread_mutex_lock(&sim_record_lock);
+    if (pcm->card < SIM_MAX_CARDS && pcm->device < SIM_MAX_DEVICES) {
+        append = sim_recorded[pcm->card][pcm->device];
+        sim_recorded[pcm->card][pcm->device] = true;
+    }
+    pthread_mutex_unlock(&sim_record_lock);
+    pcm->record = fopen(path, append ? "ab" : "wb");
+    if (!pcm->record)
+        LOGW("cannot record to %s: %s", path, strerror(errno));
+}
+
+static uint32_t sim_le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*
+ * Opens the capture file and skips to the samples of a WAV file; anything
+ * without a RIFF header is taken as raw. A WAV format other than the PCM's
+ * is only warned about: the samples play as they are.
+ */
+static void sim_open_capture(struct pcm *pcm)
+{
+    uint8_t header[12], chunk[8], fmt[16];
+
+    pcm->capture = fopen(sim_config.capture_file, "rb");
+    if (!pcm->capture) {
+        LOGW("cannot capture from %s: %s", sim_config.capture_file, strerror(errno));
+        return;
+    }
+    if (fread(header, 1, sizeof(header), pcm->capture) != sizeof(header) ||
+            memcmp(header, "RIFF", 4) || memcmp(header + 8, "WAVE", 4)) {
+        rewind(pcm->capture);
+        return;
+    }
+    while (fread(chunk, 1, sizeof(chunk), pcm->capture) == sizeof(chunk)) {
+        uint32_t size = sim_le32(chunk + 4);
+        if (!memcmp(chunk, "data", 4)) {
+            pcm->capture_start = ftell(pcm->capture);
+            return;
+        }
+        if (!memcmp(chunk, "fmt ", 4) && size >= sizeof(fmt) &&
+                fread(fmt, 1, sizeof(fmt), pcm->capture) == sizeof(fmt)) {
+            unsigned int channels = fmt[2] | fmt[3] << 8;
+            unsigned int bits = fmt[14] | fmt[15] << 8;
+            if (sim_le32(fmt + 4) != pcm->config.rate || channels != pcm->config.channels ||
+                    bits != pcm->frame_bytes / channels * 8)
+                LOGW("%s: %u Hz, %u channels, %u bits for a %u Hz, %u channel PCM",
+                        sim_config.capture_file, sim_le32(fmt + 4), channels, bits,
+                        pcm->config.rate, pcm->config.channels);
+            size -= sizeof(fmt);
+        }
+        // Chunks are padded to an even size
+        fseek(pcm->capture, size + (size & 1), SEEK_CUR);
+    }
+    LOGW("%s: no data chunk", sim_config.capture_file);
+    fclose(pcm->capture);
+    pcm->capture = NULL;
+}
+
+// Fills frames of capture from the input file, looping it, or with silence
+static void sim_capture(struct pcm *pcm, uint8_t *dst, unsigned int frames)
+{
+    size_t bytes = frames * pcm->frame_bytes;
+    bool rewound = false;
+
+    while (pcm->capture && bytes) {
+        size_t got = fread(dst, 1, bytes, pcm->capture);
+        if (!got) {
+            if (rewound)
+                break;
+            fseek(pcm->capture, pcm->capture_start, SEEK_SET);
+            rewound = true;
+            continue;
+        }
+        rewound = false;
+        dst += got;
+        bytes -= got;
+    }
+    memset(dst, 0, bytes);
+}
+
+struct pcm *pcm_open(unsigned int card, unsigned int device, unsigned int flags,
+                     struct pcm_config *config)
+{
+    struct pcm *pcm;
+
+    pthread_once(&sim_config_once, sim_read_config);
+    pcm = calloc(1, sizeof(struct pcm));
+    if (!pcm)
+        return NULL;
+    pthread_mutex_init(&pcm->lock, NULL);
+    pcm->card = card;
+    pcm->device = device;
+    pcm->flags = flags;
+    if (!config || !config->rate || !config->channels || !config->period_size ||
+            !config->period_count) {
+        snprintf(pcm->error, sizeof(pcm->error), "invalid config");
+        return pcm;
+    }
+    pcm->config = *config;
+    pcm->frame_bytes = config->channels * (config->format == PCM_FORMAT_S32_LE ? 4 : 2);
+    pcm->buffer_frames = config->period_size * config->period_count;
+    // Same defaults as tinyalsa for what the caller leaves at zero
+    pcm->start_threshold = config->start_threshold ? config->start_threshold :
+            pcm->buffer_frames / 2;
+    pcm->stop_threshold = config->stop_threshold ? config->stop_threshold :
+            pcm->buffer_frames;
+    pcm->avail_min = (config->avail_min > 0) ? (unsigned int)config->avail_min : config->period_size;
+    pcm->area = calloc(pcm->buffer_frames, pcm->frame_bytes);
+    if (!pcm->area) {
+        snprintf(pcm->error, sizeof(pcm->error), "out of memory");
+        return pcm;
+    }
+
+    if (flags & PCM_IN) {
+        if (sim_config.capture_file)
+            sim_open_capture(pcm);
+    } else {
+        sim_open_record(pcm);
+        sim_loopback_attach(pcm);
+    }
+    sim_prepare(pcm);
+    LOGI("pcm %u:%u %s%s: %u Hz, %u channels, %u x %u frames", card, device,
+            (flags & PCM_IN) ? "capture" : "playback", (flags & PCM_MMAP) ? " mmap" : "",
+            config->rate, config->channels, config->period_size, config->period_count);
+    return pcm;
+}
+
+int pcm_close(struct pcm *pcm)
+{
+    if (!pcm)
+        return 0;
+    sim_loopback_detach(pcm);
+    if (pcm->area)
+        LOGI("pcm %u:%u closed: %lld frames, %u xruns", pcm->card, pcm->device,
+                (long long)pcm->appl_ptr, pcm->xruns);
+    if (pcm->record)
+        fclose(pcm->record);
+    if (pcm->capture)
+        fclose(pcm->capture);
+    free(pcm->area);
+    pthread_mutex_destroy(&pcm->lock);
+    free(pcm);
+    return 0;
+}
+
+int pcm_is_ready(struct pcm *pcm)
+{
+    return pcm->area != NULL;
+}
+
+const char *pcm_get_error(struct pcm *pcm)
+{
+    return pcm ? pcm->error : "no pcm";
+}
+
+unsigned int pcm_get_buffer_size(struct pcm *pcm)
+{
+    return pcm->buffer_frames;
+}
+
+unsigned int pcm_frames_to_bytes(struct pcm *pcm, unsigned int frames)
+{
+    return frames * pcm->frame_bytes;
+}
+
+unsigned int pcm_bytes_to_frames(struct pcm *pcm, unsigned int bytes)
+{
+    return bytes / pcm->frame_bytes;
+}
+
+int pcm_get_htimestamp(struct pcm *pcm, unsigned int *avail, struct timespec *tstamp)
+{
+    int64_t now = sim_now_ns();
+    int ret = -1;
+
+    pthread_mutex_lock(&pcm->lock);
+    sim_update(pcm, now);
+    if (pcm->state == SIM_RUNNING) {
+        *avail = sim_avail(pcm);
+        tstamp->tv_sec = now / 1000000000LL;
+        tstamp->tv_nsec = now % 1000000000LL;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&pcm->lock);
+    return ret;
+}
+
+int pcm_prepare(struct pcm *pcm)
+{
+    int64_t now = sim_now_ns();
+
+    pthread_mutex_lock(&pcm->lock);
+    sim_update(pcm, now);
+    if (pcm->state == SIM_XRUN)
+        sim_recover(pcm, now);
+    else
+        sim_prepare(pcm);
+    pthread_mutex_unlock(&pcm->lock);
+    return 0;
+}
+
+// Like SNDRV_PCM_IOCTL_START, only from the prepared state
+int pcm_start(struct pcm *pcm)
+{
+    int64_t now = sim_now_ns();
+    int ret = 0;
+
+    pthread_mutex_lock(&pcm->lock);
+    sim_update(pcm, now);
+    if (pcm->state == SIM_PREPARED) {
+        sim_start(pcm, now);
+    } else {
+        snprintf(pcm->error, sizeof(pcm->error), "cannot start channel: %s",
+                (pcm->state == SIM_XRUN) ? "xrun" : "not prepared");
+        ret = -1;
+    }
+    pthread_mutex_unlock(&pcm->lock);
+    return ret;
+}
+
+int pcm_stop(struct pcm *pcm)
+{
+    pthread_mutex_lock(&pcm->lock);
+    sim_update(pcm, sim_now_ns());
+    pcm->state = SIM_SETUP;
+    sim_loopback_clock(pcm);
+    pthread_mutex_unlock(&pcm->lock);
+    return 0;
+}
+
+int pcm_write(struct pcm *pcm, const void *data, unsigned int count)
+{
+    const uint8_t *src = (const uint8_t *)data;
+    unsigned int frames = count / pcm->frame_bytes;
+    int64_t delay_ns;
+
+    if (pcm->flags & PCM_IN)
+        return -EINVAL;
+    pthread_mutex_lock(&pcm->lock);
+    if (pcm->state == SIM_SETUP)
+        sim_prepare(pcm);
+    while (frames) {
+        int64_t now = sim_now_ns();
+        int64_t space;
+        unsigned int n;
+
+        sim_update(pcm, now);
+        if (pcm->state == SIM_XRUN) {
+            sim_recover(pcm, now);
+            continue;
+        }
+        space = sim_avail(pcm);
+        if (space <= 0) {
+            if (pcm->state != SIM_RUNNING) {
+                // A full buffer starts whatever the threshold
+                sim_start(pcm, now);
+                continue;
+            }
+            pthread_mutex_unlock(&pcm->lock);
+            sim_sleep_ns(sim_frames_to_ns(pcm, (frames < pcm->avail_min) ? frames : pcm->avail_min));
+            pthread_mutex_lock(&pcm->lock);
+            continue;
+        }
+        n = (space < frames) ? space : frames;
+        sim_record(pcm, src, n);
+        sim_loopback_write(pcm, src, n);
+        pcm->appl_ptr += n;
+        src += n * pcm->frame_bytes;
+        frames -= n;
+        if (pcm->state == SIM_PREPARED &&
+                pcm->appl_ptr - pcm->hw_ptr >= pcm->start_threshold)
+            sim_start(pcm, now);
+    }
+    delay_ns = sim_inject(pcm);
+    pthread_mutex_unlock(&pcm->lock);
+    sim_sleep_ns(delay_ns);
+    return 0;
+}
+
+// Reads longer than avail_min are taken in pieces as they come, as the kernel does
+int pcm_read(struct pcm *pcm, void *data, unsigned int count)
+{
+    uint8_t *dst = (uint8_t *)data;
+    unsigned int frames = count / pcm->frame_bytes;
+    int64_t delay_ns;
+
+    if (!(pcm->flags & PCM_IN))
+        return -EINVAL;
+    pthread_mutex_lock(&pcm->lock);
+    while (frames) {
+        int64_t now = sim_now_ns();
+        int64_t avail;
+        unsigned int want = (frames < pcm->avail_min) ? frames : pcm->avail_min;
+        unsigned int n;
+
+        sim_update(pcm, now);
+        if (pcm->state == SIM_XRUN)
+            sim_recover(pcm, now);
+        if (pcm->state != SIM_RUNNING)
+            sim_start(pcm, now);
+        avail = sim_avail(pcm);
+        if (avail < want) {
+            pthread_mutex_unlock(&pcm->lock);
+            sim_sleep_ns(sim_frames_to_ns(pcm, want - avail));
+            pthread_mutex_lock(&pcm->lock);
+            continue;
+        }
+        n = (avail < frames) ? avail : frames;
+        if (sim_config.loopback_ns >= 0 && pcm->config.format == PCM_FORMAT_S16_LE)
+            sim_loopback_read(pcm, (int16_t *)dst, n);
+        else
+            sim_capture(pcm, dst, n);
+        pcm->appl_ptr += n;
+        dst += n * pcm->frame_bytes;
+        frames -= n;
+    }
+    delay_ns = sim_inject(pcm);
+    pthread_mutex_unlock(&pcm->lock);
+    sim_sleep_ns(delay_ns);
+    return 0;
+}
+
+/*
+ * As with tinyalsa there is no error after an xrun: the DMA stopped at the
+ * stop threshold, so a playback PCM reports a whole buffer available.
+ */
+int pcm_avail_update(struct pcm *pcm)
+{
+    int avail;
+
+    pthread_mutex_lock(&pcm->lock);
+    sim_update(pcm, sim_now_ns());
+    avail = sim_avail(pcm);
+    pthread_mutex_unlock(&pcm->lock);
+    return avail;
+}
+
+int pcm_wait(struct pcm *pcm, int timeout)
+{
+    int64_t deadline = sim_now_ns() + timeout * 1000000LL;
+
+    pthread_mutex_lock(&pcm->lock);
+    for (;;) {
+        int64_t now = sim_now_ns();
+        int64_t wait_ns;
+
+        sim_update(pcm, now);
+        if (pcm->state == SIM_XRUN) {
+            pthread_mutex_unlock(&pcm->lock);
+            return -EPIPE;
+        }
+        if (sim_avail(pcm) >= pcm->avail_min) {
+            pthread_mutex_unlock(&pcm->lock);
+            return 1;
+        }
+        if (now >= deadline || pcm->state != SIM_RUNNING)
+            break;
+        wait_ns = sim_frames_to_ns(pcm, pcm->avail_min - sim_avail(pcm));
+        if (wait_ns > deadline - now)
+            wait_ns = deadline - now;
+        pthread_mutex_unlock(&pcm->lock);
+        sim_sleep_ns(wait_ns);
+        pthread_mutex_lock(&pcm->lock);
+    }
+    pthread_mutex_unlock(&pcm->lock);
+    return 0;
+}
+
+int pcm_mmap_begin(struct pcm *pcm, void **areas, unsigned int *offset, unsigned int *frames)
+{
+    int64_t avail;
+    unsigned int contiguous;
+
+    pthread_mutex_lock(&pcm->lock);
+    sim_update(pcm, sim_now_ns());
+    avail = sim_avail(pcm);
+    if (avail > pcm->buffer_frames)
+        avail = pcm->buffer_frames;
+    else if (avail < 0)
+        avail = 0;
+    *offset = pcm->appl_ptr % pcm->buffer_frames;
+    contiguous = pcm->buffer_frames - *offset;
+    if (*frames > avail)
+        *frames = avail;
+    if (*frames > contiguous)
+        *frames = contiguous;
+    *areas = pcm->area;
+    pthread_mutex_unlock(&pcm->lock);
+    return 0;
+}
+
+// Only moves appl_ptr, in any state, like the SNDRV_PCM_IOCTL_SYNC_PTR behind it
+int pcm_mmap_commit(struct pcm *pcm, unsigned int offset, unsigned int frames)
+{
+    int64_t delay_ns;
+
+    pthread_mutex_lock(&pcm->lock);
+    sim_update(pcm, sim_now_ns());
+    sim_record(pcm, pcm->area + offset * pcm->frame_bytes, frames);
+    sim_loopback_write(pcm, pcm->area + offset * pcm->frame_bytes, frames);
+    pcm->appl_ptr += frames;
+    delay_ns = sim_inject(pcm);
+    pthread_mutex_unlock(&pcm->lock);
+    sim_sleep_ns(delay_ns);
+    return frames;
+}
+
+struct pcm_params *pcm_params_get(unsigned int card, unsigned int device, unsigned int flags)
+{
+    struct pcm_params *params = calloc(1, sizeof(struct pcm_params));
+    if (params)
+        params->channels_max = (card == 0) ? 2 : SIM_CHANNELS_MAX;
+    return params;
+}
+
+void pcm_params_free(struct pcm_params *pcm_params)
+{
+    free(pcm_params);
+}
+
+unsigned int pcm_params_get_min(struct pcm_params *pcm_params, enum pcm_param param)
+{
+    switch (param) {
+    case PCM_PARAM_RATE:
+        return SIM_RATE_MIN;
+    case PCM_PARAM_CHANNELS:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+unsigned int pcm_params_get_max(struct pcm_params *pcm_params, enum pcm_param param)
+{
+    switch (param) {
+    case PCM_PARAM_RATE:
+        return SIM_RATE_MAX;
+    case PCM_PARAM_CHANNELS:
+        return pcm_params->channels_max;
+    default:
+        return 0;
+    }
+}
+
+struct mixer *mixer_open(unsigned int card)
+{
+    if (card >= SIM_MAX_CARDS)
+        return NULL;
+    struct mixer *mixer = calloc(1, sizeof(struct mixer));
+    if (!mixer)
+        return NULL;
+    mixer->card = card;
+    pthread_mutex_lock(&sim_mixers.lock);
+    if (!sim_mixers.open_ns[card])
+        sim_mixers.open_ns[card] = sim_now_ns();
+    pthread_mutex_unlock(&sim_mixers.lock);
+    return mixer;
+}
+
+void mixer_close(struct mixer *mixer)
+{
+    free(mixer);
+}
+
+// Every name is a control: it is created on first lookup
+struct mixer_ctl *mixer_get_ctl_by_name(struct mixer *mixer, const char *name)
+{
+    struct mixer_ctl *ctl;
+
+    pthread_mutex_lock(&sim_mixers.lock);
+    for (ctl = sim_mixers.ctls[mixer->card]; ctl; ctl = ctl->next) {
+        if (!strcmp(ctl->name, name))
+            break;
+    }
+    if (!ctl) {
+        ctl = calloc(1, sizeof(struct mixer_ctl));
+        if (ctl) {
+            ctl->name = strdup(name);
+            ctl->card = mixer->card;
+            ctl->next = sim_mixers.ctls[mixer->card];
+            sim_mixers.ctls[mixer->card] = ctl;
+        }
+    }
+    pthread_mutex_unlock(&sim_mixers.lock);
+    return ctl;
+}
+
+// Time of a control write since the card's first mixer, for ordering them against
+// the PCM log. A macro so that it goes away with the log.
+#define SIM_MIXER_MS(ctl) ((long long)(sim_now_ns() - sim_mixers.open_ns[(ctl)->card]) / 1000000)
+
+unsigned int mixer_ctl_get_num_values(struct mixer_ctl *ctl)
+{
+    return 1;
+}
+
+// Under the lock of the mixers: the HAL writes from its workers while a test reads
+int mixer_ctl_get_value(struct mixer_ctl *ctl, unsigned int id)
+{
+    pthread_mutex_lock(&sim_mixers.lock);
+    int value = ctl->value;
+    pthread_mutex_unlock(&sim_mixers.lock);
+    return value;
+}
+
+int mixer_ctl_set_value(struct mixer_ctl *ctl, unsigned int id, int value)
+{
+    pthread_mutex_lock(&sim_mixers.lock);
+    ctl->value = value;
+    pthread_mutex_unlock(&sim_mixers.lock);
+    LOGI("mixer %u +%lld ms: '%s'[%u] = %d", ctl->card, SIM_MIXER_MS(ctl),
+            ctl->name, id, value);
+    return 0;
+}
+
+// Arrays are IEC958 channel status, one struct snd_aes_iec958 per control
+int mixer_ctl_get_array(struct mixer_ctl *ctl, void *array, size_t count)
+{
+    if (count != 1)
+        return -EINVAL;
+    pthread_mutex_lock(&sim_mixers.lock);
+    memcpy(array, &ctl->iec958, sizeof(ctl->iec958));
+    pthread_mutex_unlock(&sim_mixers.lock);
+    return 0;
+}
+
+int mixer_ctl_set_array(struct mixer_ctl *ctl, const void *array, size_t count)
+{
+    const struct snd_aes_iec958 *iec958 = (const struct snd_aes_iec958 *)array;
+
+    if (count != 1)
+        return -EINVAL;
+    pthread_mutex_lock(&sim_mixers.lock);
+    memcpy(&ctl->iec958, iec958, sizeof(ctl->iec958));
+    pthread_mutex_unlock(&sim_mixers.lock);
+    LOGI("mixer %u +%lld ms: '%s' = %02x %02x %02x %02x", ctl->card, SIM_MIXER_MS(ctl),
+            ctl->name, iec958->status[0], iec958->status[1], iec958->status[2],
+            iec958->status[3]);
+    return 0;
+}
+
+int mixer_ctl_set_enum_by_string(struct mixer_ctl *ctl, const char *string)
+{
+    LOGI("mixer %u +%lld ms: '%s' = %s", ctl->card, SIM_MIXER_MS(ctl),
+            ctl->name, string);
+    return 0;
+}
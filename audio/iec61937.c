@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iec61937.h"
+
+// Preamble words and the burst data types we send
+#define IEC61937_PA 0xF872
+#define IEC61937_PB 0x4E1F
+#define IEC61937_TYPE_AC3 1
+#define IEC61937_TYPE_DTS1 11 // 512 samples
+#define IEC61937_TYPE_DTS2 12 // 1024 samples
+#define IEC61937_TYPE_DTS3 13 // 2048 samples
+#define IEC61937_PREAMBLE_BYTES 8
+
+// Longest burst: DTS type III, 2048 stereo 16 bit frames
+#define IEC61937_MAX_BURST_BYTES (2048 * 4)
+#define IEC61937_AC3_SAMPLES 1536
+
+// Bytes needed to size a frame
+#define IEC61937_AC3_HEADER_BYTES 6
+#define IEC61937_DTS_HEADER_BYTES 9
+
+static const uint8_t ac3_sync[] = { 0x0B, 0x77 };
+static const uint8_t dts_sync[] = { 0x7F, 0xFE, 0x80, 0x01 };
+
+// kbps for each frmsizecod / 2
+static const uint16_t ac3_bitrates[] = {
+    32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512, 576, 640
+};
+static const uint32_t ac3_rates[] = { 48000, 44100, 32000 };
+// Core sample rate for each SFREQ, 0 where invalid
+static const uint32_t dts_rates[] = {
+    0, 8000, 16000, 32000, 0, 0, 11025, 22050, 44100, 0, 0, 12000, 24000, 48000, 0, 0
+};
+
+struct iec61937 {
+    enum iec61937_format format;
+    const uint8_t *sync;
+    size_t sync_bytes;
+    size_t header_bytes;
+
+    // Frame being collected: have bytes so far, need once the header is read
+    uint8_t frame[IEC61937_MAX_BURST_BYTES - IEC61937_PREAMBLE_BYTES];
+    size_t have;
+    size_t need;
+    // Burst of the frame, from its header
+    uint16_t burst_info;
+    size_t burst_bytes;
+    uint32_t rate;
+    // Rate of the last burst returned
+    uint32_t burst_rate;
+
+    uint8_t burst[IEC61937_MAX_BURST_BYTES];
+};
+
+// Sizes an AC3 frame from its header, 0 if it is not one we can send
+static size_t ac3_frame_bytes(struct iec61937 *packer)
+{
+    const uint8_t *h = packer->frame;
+    unsigned int fscod = h[4] >> 6;
+    unsigned int frmsizecod = h[4] & 0x3f;
+    unsigned int bsid = h[5] >> 3;
+
+    // bsid above 10 is E-AC3, which needs a different burst
+    if (fscod > 2 || frmsizecod / 2 >= sizeof(ac3_bitrates) / sizeof(ac3_bitrates[0]) || bsid > 10)
+        return 0;
+    // 16 bit words per 1536 samples; 44.1 kHz alternates to keep the bit rate
+    size_t words = ac3_bitrates[frmsizecod / 2] * 1000 * IEC61937_AC3_SAMPLES / (ac3_rates[fscod] * 16);
+    if (fscod == 1)
+        words += frmsizecod & 1;
+    packer->burst_info = IEC61937_TYPE_AC3 | (h[5] & 0x7) << 8; // bsmod
+    packer->burst_bytes = IEC61937_AC3_SAMPLES * 4;
+    packer->rate = ac3_rates[fscod];
+    return words * 2;
+}
+
+// Sizes a DTS core frame from its header, 0 if it is not one we can send
+static size_t dts_frame_bytes(struct iec61937 *packer)
+{
+    const uint8_t *h = packer->frame;
+    unsigned int blocks = (((h[4] & 0x1) << 6) | (h[5] >> 2)) + 1;
+    size_t bytes = (((h[5] & 0x3) << 12) | (h[6] << 4) | (h[7] >> 4)) + 1;
+    uint32_t rate = dts_rates[(h[8] >> 2) & 0xf];
+
+    switch (blocks * 32) {
+    case 512:
+        packer->burst_info = IEC61937_TYPE_DTS1;
+        break;
+    case 1024:
+        packer->burst_info = IEC61937_TYPE_DTS2;
+        break;
+    case 2048:
+        packer->burst_info = IEC61937_TYPE_DTS3;
+        break;
+    default:
+        return 0;
+    }
+    packer->burst_bytes = blocks * 32 * 4;
+    // Smallest valid frame is 96 bytes, and it has to fit its burst
+    if (!rate || bytes < 96 || bytes + IEC61937_PREAMBLE_BYTES > packer->burst_bytes)
+        return 0;
+    packer->rate = rate;
+    return bytes;
+}
+
+static void iec61937_put_word(uint8_t *dst, uint16_t word)
+{
+    dst[0] = word & 0xff;
+    dst[1] = word >> 8;
+}
+
+static void iec61937_pack(struct iec61937 *packer)
+{
+    uint8_t *dst = packer->burst;
+    size_t i;
+
+    iec61937_put_word(dst, IEC61937_PA);
+    iec61937_put_word(dst + 2, IEC61937_PB);
+    iec61937_put_word(dst + 4, packer->burst_info);
+    // Payload length in bits
+    iec61937_put_word(dst + 6, ((packer->need + 1) & ~1) * 8);
+    dst += IEC61937_PREAMBLE_BYTES;
+    // The frame is big endian words, the PCM little endian
+    for (i = 0; i + 1 < packer->need; i += 2) {
+        dst[i] = packer->frame[i + 1];
+        dst[i + 1] = packer->frame[i];
+    }
+    if (i < packer->need) {
+        dst[i] = 0;
+        dst[i + 1] = packer->frame[i];
+        i += 2;
+    }
+    memset(dst + i, 0, packer->burst_bytes - IEC61937_PREAMBLE_BYTES - i);
+}
+
+// Drops leading bytes until the collected ones start like a sync word
+static void iec61937_resync(struct iec61937 *packer)
+{
+    while (packer->have) {
+        size_t n = (packer->have < packer->sync_bytes) ? packer->have : packer->sync_bytes;
+        if (!memcmp(packer->frame, packer->sync, n))
+            break;
+        memmove(packer->frame, packer->frame + 1, --packer->have);
+    }
+}
+
+int iec61937_create(enum iec61937_format format, struct iec61937 **packer)
+{
+    struct iec61937 *p = calloc(1, sizeof(struct iec61937));
+    if (!p)
+        return -ENOMEM;
+    p->format = format;
+    if (format == IEC61937_FORMAT_AC3) {
+        p->sync = ac3_sync;
+        p->sync_bytes = sizeof(ac3_sync);
+        p->header_bytes = IEC61937_AC3_HEADER_BYTES;
+    } else {
+        p->sync = dts_sync;
+        p->sync_bytes = sizeof(dts_sync);
+        p->header_bytes = IEC61937_DTS_HEADER_BYTES;
+    }
+    *packer = p;
+    return 0;
+}
+
+void iec61937_reset(struct iec61937 *packer)
+{
+    packer->have = 0;
+    packer->need = 0;
+}
+
+uint32_t iec61937_get_rate(const struct iec61937 *packer)
+{
+    return packer->burst_rate;
+}
+
+void iec61937_release(struct iec61937 *packer)
+{
+    free(packer);
+}
+
+const void *iec61937_process(struct iec61937 *packer, const void *in, size_t *in_bytes,
+                             size_t *burst_bytes)
+{
+    const uint8_t *src = (const uint8_t *)in;
+    size_t size = *in_bytes;
+    size_t used = 0;
+
+    while (used < size) {
+        if (!packer->need) {
+            // Collect the header a byte at a time, sliding past anything that is not a sync word
+            packer->frame[packer->have++] = src[used++];
+            iec61937_resync(packer);
+            if (packer->have == packer->header_bytes) {
+                packer->need = (packer->format == IEC61937_FORMAT_AC3) ?
+                        ac3_frame_bytes(packer) : dts_frame_bytes(packer);
+                if (!packer->need) {
+                    // Not a frame after all: look for the next sync word
+                    memmove(packer->frame, packer->frame + 1, --packer->have);
+                    iec61937_resync(packer);
+                }
+            }
+            continue;
+        }
+
+        size_t count = packer->need - packer->have;
+        if (count > size - used)
+            count = size - used;
+        memcpy(packer->frame + packer->have, src + used, count);
+        packer->have += count;
+        used += count;
+        if (packer->have == packer->need) {
+            iec61937_pack(packer);
+            packer->burst_rate = packer->rate;
+            packer->have = 0;
+            packer->need = 0;
+            *in_bytes = used;
+            *burst_bytes = packer->burst_bytes;
+            return packer->burst;
+        }
+    }
+    *in_bytes = used;
+    return NULL;
+}
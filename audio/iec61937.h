@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIFEDJIK_AUDIO_IEC61937_H
+#define LIFEDJIK_AUDIO_IEC61937_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/*
+ * IEC61937 packer: cuts an AC3 or DTS elementary stream into frames and
+ * wraps each one in a data burst that goes out as 16 bit stereo PCM, so a
+ * receiver on S/PDIF or HDMI decodes it instead of the tablet.
+ *
+ * A burst is the Pa/Pb/Pc/Pd preamble, the frame as little endian 16 bit
+ * words and zero padding up to the frame duration: 1536 PCM frames for
+ * AC3, 512 to 2048 for DTS. DTS is taken in the 16 bit big endian form
+ * found in files and on discs, 14 bit streams are not supported.
+ */
+
+enum iec61937_format {
+    IEC61937_FORMAT_AC3,
+    IEC61937_FORMAT_DTS,
+};
+
+struct iec61937;
+
+int iec61937_create(enum iec61937_format format, struct iec61937 **packer);
+// Drops a partial frame, for standby and flush
+void iec61937_reset(struct iec61937 *packer);
+void iec61937_release(struct iec61937 *packer);
+
+/*
+ * Sample rate of the stream in the last burst returned, 0 before the first.
+ * The PCM carrying the bursts has to run at this rate.
+ */
+uint32_t iec61937_get_rate(const struct iec61937 *packer);
+
+/*
+ * Takes up to *in_bytes of the stream and sets *in_bytes to what it took.
+ * Returns the burst, *burst_bytes long, when that completed a frame, NULL
+ * when it needs more input. The burst stays valid until the next call.
+ * Bytes that do not form a valid frame are skipped.
+ */
+const void *iec61937_process(struct iec61937 *packer, const void *in, size_t *in_bytes,
+                             size_t *burst_bytes);
+
+__END_DECLS
+
+#endif // LIFEDJIK_AUDIO_IEC61937_H
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+
+#include "mmap_out.h"
+
+void mmap_out_init(struct mmap_out *mmap, struct pcm *pcm, const struct pcm_config *config)
+{
+    mmap->pcm = pcm;
+    mmap->buffer_frames = pcm_get_buffer_size(pcm);
+    // Same default as tinyalsa
+    mmap->start_threshold = config->start_threshold ? config->start_threshold :
+            mmap->buffer_frames / 2;
+    mmap->wait_ms = 2 * config->period_size * 1000 / config->rate + 1;
+    mmap->running = false;
+}
+
+// A running PCM with nothing left to play has stopped on an underrun
+static int mmap_out_recover(struct mmap_out *mmap)
+{
+    mmap->running = false;
+    return pcm_prepare(mmap->pcm) ? -EPIPE : 0;
+}
+
+int mmap_out_begin(struct mmap_out *mmap, void **area, unsigned int *offset, unsigned int *frames)
+{
+    for (;;) {
+        int avail = pcm_avail_update(mmap->pcm);
+        if (avail < 0)
+            return avail;
+        if (mmap->running && (unsigned int)avail >= mmap->buffer_frames) {
+            int ret = mmap_out_recover(mmap);
+            if (ret)
+                return ret;
+            continue;
+        }
+        if (avail > 0)
+            break;
+        // A full buffer always runs: the commit that filled it started the PCM
+        if (pcm_wait(mmap->pcm, mmap->wait_ms) < 0) {
+            int ret = mmap_out_recover(mmap);
+            if (ret)
+                return ret;
+        }
+    }
+    return pcm_mmap_begin(mmap->pcm, area, offset, frames);
+}
+
+int mmap_out_commit(struct mmap_out *mmap, unsigned int offset, unsigned int frames)
+{
+    int ret = pcm_mmap_commit(mmap->pcm, offset, frames);
+    if (ret < 0)
+        return ret;
+
+    if (!mmap->running) {
+        int avail = pcm_avail_update(mmap->pcm);
+        if (avail >= 0 && mmap->buffer_frames - avail >= mmap->start_threshold) {
+            if (pcm_start(mmap->pcm))
+                return -EIO;
+            mmap->running = true;
+        }
+    }
+    return 0;
+}
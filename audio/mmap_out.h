@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIFEDJIK_AUDIO_MMAP_OUT_H
+#define LIFEDJIK_AUDIO_MMAP_OUT_H
+
+#include <stdbool.h>
+#include <sys/cdefs.h>
+
+#include <tinyalsa/asoundlib.h>
+
+__BEGIN_DECLS
+
+/*
+ * Playback straight into the DMA buffer of a PCM opened with PCM_MMAP.
+ * mmap_out_begin() gives up to the requested number of contiguous free
+ * frames at area + offset, the caller's last conversion stage writes them
+ * in place and mmap_out_commit() hands them to the DAC.
+ *
+ * The PCM starts once start_threshold frames are queued, as pcm_write()
+ * would start it. After an underrun tinyalsa reports more frames available
+ * than the buffer holds and leaves the PCM stopped: begin prepares it again
+ * and the next commits restart it.
+ */
+struct mmap_out {
+    struct pcm *pcm;
+    unsigned int buffer_frames;
+    unsigned int start_threshold;
+    unsigned int wait_ms;
+    bool running;
+};
+
+// Call after every pcm_open() of the PCM
+void mmap_out_init(struct mmap_out *mmap, struct pcm *pcm, const struct pcm_config *config);
+
+// Returns 0 or a negative errno, with pcm_get_error() telling more
+int mmap_out_begin(struct mmap_out *mmap, void **area, unsigned int *offset, unsigned int *frames);
+int mmap_out_commit(struct mmap_out *mmap, unsigned int offset, unsigned int frames);
+
+__END_DECLS
+
+#endif // LIFEDJIK_AUDIO_MMAP_OUT_H
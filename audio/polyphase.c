@@ -0,0 +1,440 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#include "polyphase.h"
+#include "remix.h"
+
+/*
+ * Coefficients take as many fraction bits as their largest one leaves room
+ * for: Q15 when interpolating, more for the smaller coefficients of a
+ * decimation. Their rounding sets the noise floor of the stop band. Phases
+ * are summed in 64 bits; the NEON loop sums eight taps at a time in 32 bits
+ * first, which two products per lane cannot overflow.
+ */
+#define POLYPHASE_COEF_SHIFT_MAX 20
+// 11025 -> 48000 is the largest ratio we care about (640 phases)
+#define POLYPHASE_MAX_PHASES 1024
+// Every tier of the preloaded ratios, and room for a few more
+#define POLYPHASE_MAX_BANKS 24
+// Input frames taken per refill of the history
+#define POLYPHASE_BLOCK_FRAMES 256
+
+struct polyphase_tier {
+    const char *name;
+    unsigned int taps;  // per phase, multiple of 8 for the NEON loop
+    double beta;        // Kaiser window
+    double cutoff;      // pass band edge, fraction of the lower rate
+};
+
+static const struct polyphase_tier polyphase_tiers[POLYPHASE_QUALITY_COUNT] = {
+    [POLYPHASE_QUALITY_LOW] = { "low", 16, 5.0, 0.42 },
+    [POLYPHASE_QUALITY_MEDIUM] = { "medium", 32, 7.0, 0.45 },
+    [POLYPHASE_QUALITY_HIGH] = { "high", 64, 9.0, 0.46 },
+};
+
+struct polyphase_bank {
+    unsigned int up;
+    unsigned int down;
+    enum polyphase_quality quality;
+    unsigned int taps;
+    // up phases of taps coefficients, each phase stored oldest input first
+    int16_t *coefs;
+    unsigned int shift;
+};
+
+struct polyphase {
+    const struct polyphase_bank *bank;
+    unsigned int channels;
+    // Per output frame the position moves by step + frac / up
+    unsigned int step;
+    unsigned int frac;
+    unsigned int phase;
+    // History index of the newest input frame used by the next output
+    size_t pos;
+    size_t frames;
+    size_t capacity;
+    int16_t *history[2];
+    // By polyphase_create(), so freed by polyphase_release()
+    int allocated;
+};
+
+// The history follows the struct in the same block
+#define POLYPHASE_HISTORY_OFFSET ((sizeof(struct polyphase) + 7) & ~(size_t)7)
+
+static struct polyphase_bank banks[POLYPHASE_MAX_BANKS];
+static unsigned int num_banks;
+static pthread_mutex_t banks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const uint32_t common_rates[] = { 8000, 16000, 44100 };
+
+static double bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    unsigned int k;
+
+    for (k = 1; k < 32; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+static int polyphase_design(struct polyphase_bank *bank)
+{
+    const struct polyphase_tier *tier = &polyphase_tiers[bank->quality];
+    unsigned int up = bank->up, taps = tier->taps;
+    // Decimating, the filter spans as many output frames as interpolating does
+    if (bank->down > up)
+        taps = (taps * bank->down / up + 7) & ~7u;
+    unsigned int n = up * taps;
+    // Cut off in cycles per sample of the upsampled signal
+    double fc = tier->cutoff / (bank->up > bank->down ? bank->up : bank->down);
+    double center = (n - 1) / 2.0;
+    double i0_beta = bessel_i0(tier->beta);
+    double peak_coef = 0;
+    double *h;
+    unsigned int p, k, shift;
+
+    h = malloc(n * sizeof(double));
+    bank->coefs = malloc(n * sizeof(int16_t));
+    if (!h || !bank->coefs) {
+        free(h);
+        free(bank->coefs);
+        bank->coefs = NULL;
+        return -ENOMEM;
+    }
+
+    // Scaled by up so every phase has unity gain
+    for (p = 0; p < up; p++) {
+        for (k = 0; k < taps; k++) {
+            double t = p + (double)k * up - center;
+            double r = t / center;
+            double sinc = t == 0.0 ? 1.0 : sin(2.0 * M_PI * fc * t) / (2.0 * M_PI * fc * t);
+            double v = 2.0 * fc * sinc * bessel_i0(tier->beta * sqrt(1.0 - r * r)) / i0_beta * up;
+            h[p * taps + k] = v;
+            if (fabs(v) > peak_coef)
+                peak_coef = fabs(v);
+        }
+    }
+    // Room for the rounding and the unity correction below, a step per tap
+    for (shift = POLYPHASE_COEF_SHIFT_MAX; shift > 1; shift--) {
+        if (peak_coef * (1 << shift) + taps <= INT16_MAX)
+            break;
+    }
+    bank->shift = shift;
+    bank->taps = taps;
+
+    for (p = 0; p < up; p++) {
+        int16_t *phase = bank->coefs + p * taps;
+        int32_t sum = 0;
+        unsigned int peak = 0;
+
+        // Reversed for the dot product
+        for (k = 0; k < taps; k++) {
+            phase[taps - 1 - k] = lrint(h[p * taps + k] * (1 << shift));
+            sum += phase[taps - 1 - k];
+        }
+        // Rounding leaves each phase slightly off unity, which would modulate
+        // DC at the phase rate. Put the error on the largest tap.
+        for (k = 1; k < taps; k++) {
+            if (abs(phase[k]) > abs(phase[peak]))
+                peak = k;
+        }
+        phase[peak] += (1 << shift) - sum;
+    }
+    free(h);
+    return 0;
+}
+
+static const struct polyphase_bank *polyphase_get_bank(unsigned int up, unsigned int down,
+                                                       enum polyphase_quality quality)
+{
+    struct polyphase_bank *bank = NULL;
+    unsigned int i;
+
+    pthread_mutex_lock(&banks_lock);
+    for (i = 0; i < num_banks; i++) {
+        if (banks[i].up == up && banks[i].down == down && banks[i].quality == quality) {
+            bank = &banks[i];
+            break;
+        }
+    }
+    if (!bank && num_banks < POLYPHASE_MAX_BANKS) {
+        bank = &banks[num_banks];
+        bank->up = up;
+        bank->down = down;
+        bank->quality = quality;
+        if (polyphase_design(bank))
+            bank = NULL;
+        else
+            num_banks++;
+    }
+    pthread_mutex_unlock(&banks_lock);
+    return bank;
+}
+
+static unsigned int gcd(unsigned int a, unsigned int b)
+{
+    while (b) {
+        unsigned int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+enum polyphase_quality polyphase_quality_from_name(const char *name, enum polyphase_quality def)
+{
+    unsigned int i;
+
+    for (i = 0; i < POLYPHASE_QUALITY_COUNT; i++) {
+        if (!strcmp(name, polyphase_tiers[i].name))
+            return i;
+    }
+    return def;
+}
+
+void polyphase_preload(enum polyphase_quality quality)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(common_rates) / sizeof(common_rates[0]); i++) {
+        unsigned int g = gcd(common_rates[i], 48000);
+        polyphase_get_bank(48000 / g, common_rates[i] / g, quality);
+        polyphase_get_bank(common_rates[i] / g, 48000 / g, quality);
+    }
+}
+
+static int polyphase_lookup(uint32_t in_rate, uint32_t out_rate, unsigned int channels,
+                            enum polyphase_quality quality, const struct polyphase_bank **bank)
+{
+    unsigned int g;
+
+    if (!in_rate || !out_rate || channels < 1 || channels > 2 || quality >= POLYPHASE_QUALITY_COUNT)
+        return -EINVAL;
+
+    g = gcd(in_rate, out_rate);
+    if (out_rate / g > POLYPHASE_MAX_PHASES)
+        return -EINVAL;
+
+    *bank = polyphase_get_bank(out_rate / g, in_rate / g, quality);
+    return *bank ? 0 : -ENOMEM;
+}
+
+static size_t polyphase_bytes(const struct polyphase_bank *bank, unsigned int channels)
+{
+    return POLYPHASE_HISTORY_OFFSET +
+            (bank->taps - 1 + POLYPHASE_BLOCK_FRAMES) * channels * sizeof(int16_t);
+}
+
+static struct polyphase *polyphase_build(void *memory, const struct polyphase_bank *bank,
+                                         unsigned int channels)
+{
+    struct polyphase *rs = (struct polyphase *)memory;
+
+    memset(rs, 0, sizeof(*rs));
+    rs->bank = bank;
+    rs->channels = channels;
+    rs->step = bank->down / bank->up;
+    rs->frac = bank->down % bank->up;
+    rs->capacity = bank->taps - 1 + POLYPHASE_BLOCK_FRAMES;
+    rs->history[0] = (int16_t *)((uint8_t *)memory + POLYPHASE_HISTORY_OFFSET);
+    rs->history[1] = rs->history[0] + rs->capacity;
+
+    polyphase_reset(rs);
+    return rs;
+}
+
+int polyphase_create(uint32_t in_rate, uint32_t out_rate, unsigned int channels,
+                     enum polyphase_quality quality, struct polyphase **resampler)
+{
+    const struct polyphase_bank *bank;
+    void *memory;
+    int ret;
+
+    *resampler = NULL;
+    ret = polyphase_lookup(in_rate, out_rate, channels, quality, &bank);
+    if (ret)
+        return ret;
+
+    memory = malloc(polyphase_bytes(bank, channels));
+    if (!memory)
+        return -ENOMEM;
+    *resampler = polyphase_build(memory, bank, channels);
+    (*resampler)->allocated = 1;
+    return 0;
+}
+
+int polyphase_get_size(uint32_t in_rate, uint32_t out_rate, unsigned int channels,
+                       enum polyphase_quality quality, size_t *size)
+{
+    const struct polyphase_bank *bank;
+    int ret;
+
+    *size = 0;
+    ret = polyphase_lookup(in_rate, out_rate, channels, quality, &bank);
+    if (!ret)
+        *size = polyphase_bytes(bank, channels);
+    return ret;
+}
+
+int polyphase_init(void *memory, uint32_t in_rate, uint32_t out_rate, unsigned int channels,
+                   enum polyphase_quality quality, struct polyphase **resampler)
+{
+    const struct polyphase_bank *bank;
+    int ret;
+
+    *resampler = NULL;
+    ret = polyphase_lookup(in_rate, out_rate, channels, quality, &bank);
+    if (!ret)
+        *resampler = polyphase_build(memory, bank, channels);
+    return ret;
+}
+
+void polyphase_reset(struct polyphase *rs)
+{
+    size_t keep = rs->bank->taps - 1;
+    unsigned int c;
+
+    for (c = 0; c < rs->channels; c++)
+        memset(rs->history[c], 0, keep * sizeof(int16_t));
+    rs->frames = keep;
+    rs->pos = keep;
+    rs->phase = 0;
+}
+
+void polyphase_release(struct polyphase *rs)
+{
+    if (rs && rs->allocated)
+        free(rs);
+}
+
+static inline int64_t polyphase_dot(const int16_t *x, const int16_t *h, unsigned int taps)
+{
+#ifdef __ARM_NEON__
+    int64x2_t acc = vdupq_n_s64(0);
+    unsigned int k;
+
+    for (k = 0; k < taps; k += 8) {
+        int16x8_t xv = vld1q_s16(x + k);
+        int16x8_t hv = vld1q_s16(h + k);
+        int32x4_t block = vmull_s16(vget_low_s16(xv), vget_low_s16(hv));
+        block = vmlal_s16(block, vget_high_s16(xv), vget_high_s16(hv));
+        acc = vpadalq_s32(acc, block);
+    }
+    return vgetq_lane_s64(acc, 0) + vgetq_lane_s64(acc, 1);
+#else
+    int64_t acc = 0;
+    unsigned int k;
+
+    for (k = 0; k < taps; k++)
+        acc += (int32_t)x[k] * h[k];
+    return acc;
+#endif
+}
+
+static inline int16_t polyphase_round(int64_t acc, unsigned int shift)
+{
+    acc = (acc + (1 << (shift - 1))) >> shift;
+    if (acc > INT16_MAX)
+        return INT16_MAX;
+    if (acc < INT16_MIN)
+        return INT16_MIN;
+    return acc;
+}
+
+static void polyphase_refill(struct polyphase *rs, const int16_t **in, size_t *in_left)
+{
+    size_t count;
+    unsigned int c;
+
+    if (rs->frames == rs->capacity) {
+        // pos is past the end here, so only the last taps - 1 frames are still needed
+        size_t keep = rs->bank->taps - 1;
+        size_t drop = rs->frames - keep;
+        for (c = 0; c < rs->channels; c++)
+            memmove(rs->history[c], rs->history[c] + drop, keep * sizeof(int16_t));
+        rs->frames = keep;
+        rs->pos -= drop;
+    }
+
+    count = rs->capacity - rs->frames;
+    if (count > *in_left)
+        count = *in_left;
+    if (rs->channels == 2)
+        remix_deinterleave_i16(rs->history[0] + rs->frames, rs->history[1] + rs->frames, *in, count);
+    else
+        memcpy(rs->history[0] + rs->frames, *in, count * sizeof(int16_t));
+
+    *in += count * rs->channels;
+    *in_left -= count;
+    rs->frames += count;
+}
+
+void polyphase_process(struct polyphase *rs,
+                       const int16_t *in, size_t *in_frames,
+                       int16_t *out, size_t *out_frames)
+{
+    const struct polyphase_bank *bank = rs->bank;
+    const unsigned int taps = bank->taps;
+    size_t in_left = *in_frames;
+    size_t produced = 0;
+    unsigned int c;
+
+    while (produced < *out_frames) {
+        const int16_t *coefs;
+        size_t start;
+
+        if (rs->pos >= rs->frames) {
+            if (!in_left)
+                break;
+            polyphase_refill(rs, &in, &in_left);
+            continue;
+        }
+
+        coefs = bank->coefs + rs->phase * taps;
+        start = rs->pos + 1 - taps;
+        for (c = 0; c < rs->channels; c++)
+            *out++ = polyphase_round(polyphase_dot(rs->history[c] + start, coefs, taps),
+                                     bank->shift);
+        produced++;
+
+        rs->pos += rs->step;
+        rs->phase += rs->frac;
+        if (rs->phase >= bank->up) {
+            rs->phase -= bank->up;
+            rs->pos++;
+        }
+    }
+
+    *in_frames -= in_left;
+    *out_frames = produced;
+}
+
+long polyphase_get_pending(const struct polyphase *rs)
+{
+    return (long)rs->frames - (long)rs->pos;
+}
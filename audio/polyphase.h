@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIFEDJIK_AUDIO_POLYPHASE_H
+#define LIFEDJIK_AUDIO_POLYPHASE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/*
+ * Fixed point polyphase resampler for 16 bit PCM, mono or stereo.
+ *
+ * Filter banks are designed once per (ratio, quality) and shared by all
+ * resamplers in the process, so creating one for a known ratio only
+ * allocates the resampler and its history, in one block. polyphase_reset()
+ * clears the history and keeps everything else, which is what standby
+ * transitions need.
+ *
+ * The taps per phase are for interpolation; a decimation by N takes about N
+ * times as many so that its stop band holds as well. The attenuations are
+ * the worst measured on the common ratios.
+ */
+
+enum polyphase_quality {
+    POLYPHASE_QUALITY_LOW,      // 16 taps per phase, 55 dB stop band
+    POLYPHASE_QUALITY_MEDIUM,   // 32 taps per phase, 70 dB stop band
+    POLYPHASE_QUALITY_HIGH,     // 64 taps per phase, 78 dB stop band
+    POLYPHASE_QUALITY_COUNT
+};
+
+struct polyphase;
+
+// Parses "low", "medium" or "high", anything else gives "def"
+enum polyphase_quality polyphase_quality_from_name(const char *name, enum polyphase_quality def);
+
+// Builds the banks of the usual 8/16/44.1 <-> 48 kHz ratios up front
+void polyphase_preload(enum polyphase_quality quality);
+
+int polyphase_create(uint32_t in_rate, uint32_t out_rate, unsigned int channels,
+                     enum polyphase_quality quality, struct polyphase **resampler);
+void polyphase_reset(struct polyphase *resampler);
+void polyphase_release(struct polyphase *resampler);
+
+/*
+ * For callers that keep their buffers in memory of their own:
+ * polyphase_get_size() gives the bytes a resampler and its history take and
+ * polyphase_init() builds one in them, 8 byte aligned. Either fails where
+ * polyphase_create() would. The memory stays the caller's; releasing such a
+ * resampler does nothing.
+ */
+int polyphase_get_size(uint32_t in_rate, uint32_t out_rate, unsigned int channels,
+                       enum polyphase_quality quality, size_t *size);
+int polyphase_init(void *memory, uint32_t in_rate, uint32_t out_rate, unsigned int channels,
+                   enum polyphase_quality quality, struct polyphase **resampler);
+
+/*
+ * Same contract as resample_from_input() of audio_utils: on return
+ * *in_frames holds the number of frames consumed and *out_frames the
+ * number produced. Input that does not fit in the output is left to the
+ * caller; input already consumed but not yet turned into output is kept
+ * in the history.
+ */
+void polyphase_process(struct polyphase *resampler,
+                       const int16_t *in, size_t *in_frames,
+                       int16_t *out, size_t *out_frames);
+
+/*
+ * Input frames consumed ahead of the next output frame: the history takes
+ * all the input it has room for. A position counted in input consumed is
+ * this much past the next output; negative when that output needs more
+ * input first, 0 after a reset.
+ */
+long polyphase_get_pending(const struct polyphase *resampler);
+
+__END_DECLS
+
+#endif // LIFEDJIK_AUDIO_POLYPHASE_H
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "remix.h"
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+void remix_stereo_to_mono_i16_c(int16_t *dst, const int16_t *src, size_t frames)
+{
+    while (frames--) {
+        *dst++ = ((int32_t)src[0] + src[1]) >> 1;
+        src += 2;
+    }
+}
+
+void remix_mono_to_stereo_i16_c(int16_t *dst, const int16_t *src, size_t frames)
+{
+    while (frames--) {
+        dst[0] = dst[1] = *src++;
+        dst += 2;
+    }
+}
+
+void remix_deinterleave_i16_c(int16_t *left, int16_t *right, const int16_t *src, size_t frames)
+{
+    while (frames--) {
+        *left++ = *src++;
+        *right++ = *src++;
+    }
+}
+
+void remix_interleave_i16_c(int16_t *dst, const int16_t *left, const int16_t *right, size_t frames)
+{
+    while (frames--) {
+        *dst++ = *left++;
+        *dst++ = *right++;
+    }
+}
+
+void remix_duplicate_channel_i16_c(int16_t *dst, const int16_t *src, size_t frames, unsigned int channel)
+{
+    src += channel;
+    while (frames--) {
+        dst[0] = dst[1] = *src;
+        src += 2;
+        dst += 2;
+    }
+}
+
+#ifdef __ARM_NEON__
+
+// All NEON loops handle 8 frames at a time and leave the tail to the C versions
+
+void remix_stereo_to_mono_i16(int16_t *dst, const int16_t *src, size_t frames)
+{
+    for (; frames >= 8; frames -= 8) {
+        int16x8x2_t in = vld2q_s16(src);
+        // vhadd is (a + b) >> 1 without intermediate overflow
+        vst1q_s16(dst, vhaddq_s16(in.val[0], in.val[1]));
+        src += 16;
+        dst += 8;
+    }
+    remix_stereo_to_mono_i16_c(dst, src, frames);
+}
+
+void remix_mono_to_stereo_i16(int16_t *dst, const int16_t *src, size_t frames)
+{
+    for (; frames >= 8; frames -= 8) {
+        int16x8x2_t out;
+        out.val[0] = vld1q_s16(src);
+        out.val[1] = out.val[0];
+        vst2q_s16(dst, out);
+        src += 8;
+        dst += 16;
+    }
+    remix_mono_to_stereo_i16_c(dst, src, frames);
+}
+
+void remix_deinterleave_i16(int16_t *left, int16_t *right, const int16_t *src, size_t frames)
+{
+    for (; frames >= 8; frames -= 8) {
+        int16x8x2_t in = vld2q_s16(src);
+        vst1q_s16(left, in.val[0]);
+        vst1q_s16(right, in.val[1]);
+        src += 16;
+        left += 8;
+        right += 8;
+    }
+    remix_deinterleave_i16_c(left, right, src, frames);
+}
+
+void remix_interleave_i16(int16_t *dst, const int16_t *left, const int16_t *right, size_t frames)
+{
+    for (; frames >= 8; frames -= 8) {
+        int16x8x2_t out;
+        out.val[0] = vld1q_s16(left);
+        out.val[1] = vld1q_s16(right);
+        vst2q_s16(dst, out);
+        left += 8;
+        right += 8;
+        dst += 16;
+    }
+    remix_interleave_i16_c(dst, left, right, frames);
+}
+
+void remix_duplicate_channel_i16(int16_t *dst, const int16_t *src, size_t frames, unsigned int channel)
+{
+    for (; frames >= 8; frames -= 8) {
+        int16x8x2_t in = vld2q_s16(src);
+        int16x8x2_t out;
+        out.val[0] = channel ? in.val[1] : in.val[0];
+        out.val[1] = out.val[0];
+        vst2q_s16(dst, out);
+        src += 16;
+        dst += 16;
+    }
+    remix_duplicate_channel_i16_c(dst, src, frames, channel);
+}
+
+#else
+
+void remix_stereo_to_mono_i16(int16_t *dst, const int16_t *src, size_t frames)
+{
+    remix_stereo_to_mono_i16_c(dst, src, frames);
+}
+
+void remix_mono_to_stereo_i16(int16_t *dst, const int16_t *src, size_t frames)
+{
+    remix_mono_to_stereo_i16_c(dst, src, frames);
+}
+
+void remix_deinterleave_i16(int16_t *left, int16_t *right, const int16_t *src, size_t frames)
+{
+    remix_deinterleave_i16_c(left, right, src, frames);
+}
+
+void remix_interleave_i16(int16_t *dst, const int16_t *left, const int16_t *right, size_t frames)
+{
+    remix_interleave_i16_c(dst, left, right, frames);
+}
+
+void remix_duplicate_channel_i16(int16_t *dst, const int16_t *src, size_t frames, unsigned int channel)
+{
+    remix_duplicate_channel_i16_c(dst, src, frames, channel);
+}
+
+#endif
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIFEDJIK_AUDIO_REMIX_H
+#define LIFEDJIK_AUDIO_REMIX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/*
+ * Channel remix kernels for 16 bit PCM. The plain names use NEON when the
+ * build has it (__ARM_NEON__) and are bit exact with the _c reference
+ * versions, which are always available. Buffers must not overlap.
+ */
+
+// dst[i] = (left + right) >> 1
+void remix_stereo_to_mono_i16(int16_t *dst, const int16_t *src, size_t frames);
+void remix_stereo_to_mono_i16_c(int16_t *dst, const int16_t *src, size_t frames);
+
+// Both output channels get the mono sample
+void remix_mono_to_stereo_i16(int16_t *dst, const int16_t *src, size_t frames);
+void remix_mono_to_stereo_i16_c(int16_t *dst, const int16_t *src, size_t frames);
+
+// Interleaved stereo to two planar buffers and back
+void remix_deinterleave_i16(int16_t *left, int16_t *right, const int16_t *src, size_t frames);
+void remix_deinterleave_i16_c(int16_t *left, int16_t *right, const int16_t *src, size_t frames);
+void remix_interleave_i16(int16_t *dst, const int16_t *left, const int16_t *right, size_t frames);
+void remix_interleave_i16_c(int16_t *dst, const int16_t *left, const int16_t *right, size_t frames);
+
+// Stereo to stereo with "channel" (0 left, 1 right) copied to both outputs
+void remix_duplicate_channel_i16(int16_t *dst, const int16_t *src, size_t frames, unsigned int channel);
+void remix_duplicate_channel_i16_c(int16_t *dst, const int16_t *src, size_t frames, unsigned int channel);
+
+__END_DECLS
+
+#endif // LIFEDJIK_AUDIO_REMIX_H
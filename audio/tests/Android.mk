@@ -0,0 +1,75 @@
+# Copyright (C) 2014 Ivan Krakhmaliuk (LifeDJIK)
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+LOCAL_PATH := $(call my-dir)
+
+# Host tests on the simulated sound card, see hal_test.h. Each one is an
+# executable that exits non-zero when a check fails.
+
+# Tests of audio_hw.c and of the simulator
+audio_hw_tests := \
+	capture_position_test.c \
+	capture_test.c \
+	echo_ref_test.c \
+	hdmi_passthrough_test.c \
+	jack_test.c \
+	mixer_cache_test.c \
+	position_test.c \
+	route_switch_test.c \
+	tinyalsa_sim_test.c \
+	volume_test.c \
+	wakeup_test.c \
+	writer_thread_test.c
+
+# Tests of the DSP kernels on their own
+audio_dsp_tests := \
+	polyphase_test.c \
+	remix_test.c
+
+# Tests of __portaudio_hw.c, built against the Jelly Bean HAL API stand-ins
+audio_port_tests := \
+	arena_test.c \
+	port_hal_test.c
+
+$(foreach file,$(audio_hw_tests), \
+    $(eval include $(CLEAR_VARS)) \
+    $(eval LOCAL_MODULE := $(file:%.c=%)) \
+    $(eval LOCAL_SRC_FILES := $(file) ../iec61937.c ../mmap_out.c ../polyphase.c ../remix.c) \
+    $(eval LOCAL_C_INCLUDES += $(LOCAL_PATH)/.. external/tinyalsa/include) \
+    $(eval LOCAL_STATIC_LIBRARIES := libtinyalsa_sim libcutils liblog) \
+    $(eval LOCAL_LDLIBS := -lpthread -lrt -lm) \
+    $(eval LOCAL_MODULE_TAGS := tests) \
+    $(eval include $(BUILD_HOST_EXECUTABLE)) \
+)
+
+$(foreach file,$(audio_port_tests), \
+    $(eval include $(CLEAR_VARS)) \
+    $(eval LOCAL_MODULE := $(file:%.c=%)) \
+    $(eval LOCAL_SRC_FILES := $(file) ../mmap_out.c ../polyphase.c ../remix.c) \
+    $(eval LOCAL_C_INCLUDES += $(LOCAL_PATH)/../host/jb $(LOCAL_PATH)/.. external/tinyalsa/include) \
+    $(eval LOCAL_STATIC_LIBRARIES := libtinyalsa_sim libcutils liblog) \
+    $(eval LOCAL_LDLIBS := -lpthread -lrt -lm) \
+    $(eval LOCAL_MODULE_TAGS := tests) \
+    $(eval include $(BUILD_HOST_EXECUTABLE)) \
+)
+
+$(foreach file,$(audio_dsp_tests), \
+    $(eval include $(CLEAR_VARS)) \
+    $(eval LOCAL_MODULE := $(file:%.c=%)) \
+    $(eval LOCAL_SRC_FILES := $(file) ../polyphase.c ../remix.c) \
+    $(eval LOCAL_C_INCLUDES += $(LOCAL_PATH)/..) \
+    $(eval LOCAL_LDLIBS := -lm) \
+    $(eval LOCAL_MODULE_TAGS := tests) \
+    $(eval include $(BUILD_HOST_EXECUTABLE)) \
+)
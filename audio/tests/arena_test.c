@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Stream buffers of the Jelly Bean port: every allocation goes through a
+ * counting hook. Opening a stream takes the stream and its arena, resampler
+ * included, and nothing else. Writes and reads past the one that leaves
+ * standby must not allocate, and a stream must give back everything it
+ * took once closed, after a failed open too. Streams cover the remix and
+ * resampler buffers, with pcm_write and PCM_MMAP.
+ *
+ * Build it with -fsanitize=address as well, which also catches the stages
+ * overrunning their buffers; the hook then goes through the sanitizer
+ * instead of replacing malloc.
+ */
+
+#include "hal_test.h"
+
+#include "__portaudio_hw.c"
+
+#define WRITES 20
+// The stream and its arena
+#define OPEN_ALLOCS 2
+
+static volatile int counting;
+static volatile int allocs;
+static volatile int frees;
+
+#ifdef __SANITIZE_ADDRESS__
+// From sanitizer/allocator_interface.h, which not every toolchain ships
+int __sanitizer_install_malloc_and_free_hooks(
+        void (*malloc_hook)(const volatile void *ptr, size_t size),
+        void (*free_hook)(const volatile void *ptr));
+
+static void malloc_hook(const volatile void *ptr, size_t size)
+{
+    if (counting)
+        __sync_fetch_and_add(&allocs, 1);
+}
+
+static void free_hook(const volatile void *ptr)
+{
+    if (counting)
+        __sync_fetch_and_add(&frees, 1);
+}
+
+static void install_hooks(void)
+{
+    __sanitizer_install_malloc_and_free_hooks(malloc_hook, free_hook);
+}
+#else
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+    if (counting)
+        __sync_fetch_and_add(&allocs, 1);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    if (counting)
+        __sync_fetch_and_add(&allocs, 1);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (counting) {
+        if (!ptr)
+            __sync_fetch_and_add(&allocs, 1);
+        else if (!size)
+            __sync_fetch_and_add(&frees, 1);
+    }
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    if (counting)
+        __sync_fetch_and_add(&allocs, 1);
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : ENOMEM;
+}
+
+void free(void *ptr)
+{
+    if (counting && ptr)
+        __sync_fetch_and_add(&frees, 1);
+    __libc_free(ptr);
+}
+
+static void install_hooks(void)
+{
+}
+#endif
+
+static void start_counting(void)
+{
+    allocs = 0;
+    frees = 0;
+    counting = 1;
+}
+
+static void stop_counting(void)
+{
+    counting = 0;
+}
+
+static void check_output(struct audio_hw_device *dev, uint32_t rate, audio_channel_mask_t mask)
+{
+    struct audio_config config = {
+        .sample_rate = rate,
+        .channel_mask = mask,
+        .format = AUDIO_FORMAT_PCM_16_BIT,
+    };
+    struct audio_stream_out *out = NULL;
+    unsigned int i;
+
+    start_counting();
+    EXPECT(!adev_open_output_stream(dev, 0, AUDIO_DEVICE_OUT_SPEAKER, AUDIO_OUTPUT_FLAG_PRIMARY,
+            &config, &out));
+    if (!out) {
+        stop_counting();
+        return;
+    }
+    int opened = allocs;
+    size_t bytes = out->common.get_buffer_size(&out->common);
+    void *buffer = __builtin_alloca(bytes);
+    memset(buffer, 0, bytes);
+
+    // The first write leaves standby and opens the PCM
+    EXPECT(out->write(out, buffer, bytes) == (ssize_t)bytes);
+    int standby_exit = allocs - opened;
+    for (i = 0; i < WRITES; i++)
+        EXPECT(out->write(out, buffer, bytes) == (ssize_t)bytes);
+    int hot = allocs - opened - standby_exit;
+    // Again across standby
+    out->common.standby(&out->common);
+    EXPECT(out->write(out, buffer, bytes) == (ssize_t)bytes);
+    int before = allocs;
+    for (i = 0; i < WRITES; i++)
+        EXPECT(out->write(out, buffer, bytes) == (ssize_t)bytes);
+    hot += allocs - before;
+    adev_close_output_stream(dev, out);
+    stop_counting();
+
+    printf("output %u Hz %s: %d allocations at open, %d leaving standby, %d writing,"
+            " %d not freed\n", rate, mask == AUDIO_CHANNEL_OUT_MONO ? "mono" : "stereo",
+            opened, standby_exit, hot, allocs - frees);
+    EXPECT(opened == OPEN_ALLOCS);
+    EXPECT(hot == 0);
+    EXPECT(allocs == frees);
+}
+
+static void check_input(struct audio_hw_device *dev, uint32_t rate, audio_channel_mask_t mask)
+{
+    struct audio_config config = {
+        .sample_rate = rate,
+        .channel_mask = mask,
+        .format = AUDIO_FORMAT_PCM_16_BIT,
+    };
+    struct audio_stream_in *in = NULL;
+    unsigned int i;
+
+    start_counting();
+    EXPECT(!adev_open_input_stream(dev, 0, AUDIO_DEVICE_IN_BUILTIN_MIC, &config, &in));
+    if (!in) {
+        stop_counting();
+        return;
+    }
+    int opened = allocs;
+    size_t bytes = in->common.get_buffer_size(&in->common);
+    void *buffer = __builtin_alloca(bytes);
+
+    EXPECT(in->read(in, buffer, bytes) == (ssize_t)bytes);
+    int standby_exit = allocs - opened;
+    for (i = 0; i < WRITES; i++)
+        EXPECT(in->read(in, buffer, bytes) == (ssize_t)bytes);
+    int hot = allocs - opened - standby_exit;
+    adev_close_input_stream(dev, in);
+    stop_counting();
+
+    printf("input %u Hz %s: %d allocations at open, %d leaving standby, %d reading,"
+            " %d not freed\n", rate, mask == AUDIO_CHANNEL_IN_MONO ? "mono" : "stereo",
+            opened, standby_exit, hot, allocs - frees);
+    EXPECT(opened == OPEN_ALLOCS);
+    EXPECT(hot == 0);
+    EXPECT(allocs == frees);
+}
+
+// An open that fails gives back whatever it took
+static void check_failed_open(struct audio_hw_device *dev)
+{
+    struct audio_config config = {
+        // Too many phases for the resampler
+        .sample_rate = 44101,
+        .channel_mask = AUDIO_CHANNEL_OUT_STEREO,
+        .format = AUDIO_FORMAT_PCM_16_BIT,
+    };
+    struct audio_stream_out *out = NULL;
+
+    start_counting();
+    EXPECT(adev_open_output_stream(dev, 0, AUDIO_DEVICE_OUT_SPEAKER, AUDIO_OUTPUT_FLAG_PRIMARY,
+            &config, &out));
+    stop_counting();
+    EXPECT(!out);
+    printf("failed open: %d allocations, %d not freed\n", allocs, allocs - frees);
+    EXPECT(allocs == frees);
+}
+
+static void check_streams(const char *dir)
+{
+    hw_device_t *device = NULL;
+
+    install_hooks();
+    EXPECT(!HAL_MODULE_INFO_SYM.common.methods->open(&HAL_MODULE_INFO_SYM.common,
+            AUDIO_HARDWARE_INTERFACE, &device));
+    // Which also designs the filter banks, kept for the process
+    struct audio_hw_device *dev = (struct audio_hw_device *)device;
+
+    check_output(dev, OUT_SAMPLE_RATE, AUDIO_CHANNEL_OUT_STEREO);
+    check_output(dev, OUT_SAMPLE_RATE, AUDIO_CHANNEL_OUT_MONO);
+    check_output(dev, 44100, AUDIO_CHANNEL_OUT_STEREO);
+    check_output(dev, 44100, AUDIO_CHANNEL_OUT_MONO);
+    check_input(dev, 16000, AUDIO_CHANNEL_IN_MONO);
+    check_input(dev, 48000, AUDIO_CHANNEL_IN_STEREO);
+    check_input(dev, 8000, AUDIO_CHANNEL_IN_MONO);
+    check_failed_open(dev);
+    dev->common.close(&dev->common);
+}
+
+int main(void)
+{
+    test_run_case(check_streams);
+    test_set_property(OUT_PROPERTY_MMAP, "on");
+    test_run_case(check_streams);
+    return test_result("arena_test");
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Helpers for the tests of audio_hw.c, included after it. Streams are
+ * opened through the HAL entry points the framework uses.
+ */
+
+#ifndef LIFEDJIK_AUDIO_TESTS_AUDIO_HW_TEST_H
+#define LIFEDJIK_AUDIO_TESTS_AUDIO_HW_TEST_H
+
+#include "hal_test.h"
+
+static inline struct audio_hw_device *test_open_device(void)
+{
+    hw_device_t *device = NULL;
+    EXPECT(!HAL_MODULE_INFO_SYM.common.methods->open(&HAL_MODULE_INFO_SYM.common,
+            AUDIO_HARDWARE_INTERFACE, &device));
+    return (struct audio_hw_device *)device;
+}
+
+static inline void test_close_device(struct audio_hw_device *dev)
+{
+    dev->common.close(&dev->common);
+}
+
+// 16 bit output on devices at rate, NULL if the HAL refused it
+static inline struct audio_stream_out *test_open_output(struct audio_hw_device *dev,
+        uint32_t devices, uint32_t rate, uint32_t channels)
+{
+    struct audio_stream_out *out = NULL;
+    int format = AUDIO_FORMAT_PCM_16_BIT;
+
+    EXPECT(!dev->open_output_stream(dev, devices, &format, &channels, &rate, &out));
+    return out;
+}
+
+// 16 bit input from devices at rate, NULL if the HAL refused it
+static inline struct audio_stream_in *test_open_input(struct audio_hw_device *dev,
+        uint32_t devices, uint32_t rate, uint32_t channels)
+{
+    struct audio_stream_in *in = NULL;
+    int format = AUDIO_FORMAT_PCM_16_BIT;
+
+    EXPECT(!dev->open_input_stream(dev, devices, &format, &channels, &rate,
+            (audio_in_acoustics_t)0, &in));
+    return in;
+}
+
+// Frames in the buffer the framework writes at a time
+static inline size_t test_buffer_frames(struct audio_stream_out *out)
+{
+    return out->common.get_buffer_size(&out->common) /
+            audio_stream_frame_size(&out->common);
+}
+
+#endif // LIFEDJIK_AUDIO_TESTS_AUDIO_HW_TEST_H
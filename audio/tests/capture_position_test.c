@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Capture positions while the simulated codec is read late: every few reads
+ * of the capture engine return milliseconds after the data was there, so
+ * the timestamps it anchors on come at uneven points of the stream. After
+ * every client read the position must count the frames handed over, its
+ * time must never go back, and time less frames over the rate, the time the
+ * stream would have started at, must hold within a millisecond: the
+ * position is as good as the codec clock whatever the scheduling.
+ *
+ * An overrun is a read later than the codec buffer lasts: the frames lost
+ * are then reported by get_input_frames_lost() and filled with silence, so
+ * the position keeps to the codec clock across them. Only when the fill
+ * overflows what the stream had not read yet may the start time move, and
+ * then forward by no more than the frames that read reported lost.
+ */
+
+#include "hal_test.h"
+
+#include "audio_hw.c"
+
+#include "audio_hw_test.h"
+
+#define CAPTURE_SECONDS 2
+#define JITTER_US "3000"
+#define JITTER_EVERY "3"
+// Longer than the codec buffer, every 40th period read: twice a run
+#define OVERRUN_US "100000"
+#define OVERRUN_EVERY "40"
+#define MAX_ERROR_NS 1000000LL
+
+struct result {
+    // Worst move of the start time between two reads that the frames lost do not explain
+    int64_t error_ns;
+    int64_t worst_latency_ns;
+    unsigned int back_in_time;
+    unsigned int miscounted;
+    int64_t lost;
+};
+
+static void run(uint32_t rate, uint32_t channels, struct result *result)
+{
+    struct audio_hw_device *dev = test_open_device();
+    struct audio_stream_in *in = test_open_input(dev, AUDIO_DEVICE_IN_BUILTIN_MIC, rate, channels);
+    int64_t frames_read = 0, last_ns = 0, last_start = 0;
+
+    memset(result, 0, sizeof(*result));
+    if (!in)
+        return;
+    size_t bytes = in->common.get_buffer_size(&in->common);
+    size_t buffer_frames = bytes / audio_stream_frame_size(&in->common);
+    void *buffer = malloc(bytes);
+    size_t reads = rate * CAPTURE_SECONDS / buffer_frames, i;
+
+    for (i = 0; i < reads; i++) {
+        int64_t frames, time;
+
+        EXPECT(in->read(in, buffer, bytes) == (ssize_t)bytes);
+        frames_read += buffer_frames;
+        if (in_get_capture_position(in, &frames, &time)) {
+            EXPECT(!"no capture position after a read");
+            continue;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t now_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+
+        int64_t lost = in->get_input_frames_lost(in);
+        result->lost += lost;
+        result->miscounted += frames != frames_read;
+        result->back_in_time += time < last_ns;
+        last_ns = time;
+        if (now_ns - time > result->worst_latency_ns)
+            result->worst_latency_ns = now_ns - time;
+        int64_t start_ns = time - frames * 1000000000LL / rate;
+        // The first reads wait on the resampler and the engine to fill
+        if (i > 4) {
+            int64_t moved = start_ns - last_start;
+            int64_t lost_ns = lost * 1000000000LL / rate;
+            int64_t error = (moved < 0) ? -moved : (moved > lost_ns) ? moved - lost_ns : 0;
+            if (error > result->error_ns)
+                result->error_ns = error;
+        }
+        last_start = start_ns;
+    }
+    free(buffer);
+    dev->close_input_stream(dev, in);
+    test_close_device(dev);
+}
+
+static void check(const char *name, uint32_t rate, uint32_t channels, int overruns)
+{
+    struct result result;
+
+    run(rate, channels, &result);
+    printf("%s, %u Hz %s: start time off by %.2f ms, worst %.1f ms behind,"
+            " %u back in time, %u miscounted, %lld frames lost\n", name, rate,
+            channels == AUDIO_CHANNEL_IN_MONO ? "mono" : "stereo",
+            result.error_ns / 1e6, result.worst_latency_ns / 1e6, result.back_in_time,
+            result.miscounted, (long long)result.lost);
+    EXPECT(!result.back_in_time);
+    EXPECT(!result.miscounted);
+    EXPECT(result.error_ns < MAX_ERROR_NS);
+    // No older than the codec buffer and the engine's ring
+    EXPECT(result.worst_latency_ns <
+            (int64_t)(IN_PERIOD_COUNT + IN_RING_PERIODS) * IN_PERIOD_SIZE * 1000000000LL /
+            IN_SAMPLE_RATE);
+    if (overruns)
+        EXPECT(result.lost > 0);
+    else
+        EXPECT(result.lost == 0);
+}
+
+static void test_jitter(const char *dir)
+{
+    check("jitter", IN_SAMPLE_RATE, AUDIO_CHANNEL_IN_STEREO, 0);
+    check("jitter", 16000, AUDIO_CHANNEL_IN_MONO, 0);
+}
+
+static void test_overruns(const char *dir)
+{
+    check("overruns", IN_SAMPLE_RATE, AUDIO_CHANNEL_IN_STEREO, 1);
+    check("overruns", 16000, AUDIO_CHANNEL_IN_MONO, 1);
+}
+
+int main(void)
+{
+    setenv("TINYALSA_SIM_DELAY_US", JITTER_US, 1);
+    setenv("TINYALSA_SIM_DELAY_EVERY", JITTER_EVERY, 1);
+    test_run_case(test_jitter);
+    setenv("TINYALSA_SIM_DELAY_US", OVERRUN_US, 1);
+    setenv("TINYALSA_SIM_DELAY_EVERY", OVERRUN_EVERY, 1);
+    test_run_case(test_overruns);
+    return test_result("capture_position_test");
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Capture from a WAV file the simulated codec serves at real-time pace.
+ * At the codec rate a ramp must come through without a frame lost or
+ * repeated; at 16 kHz mono a tone must keep its level and stay clean
+ * through the remix and the resampler. Reads take as long as the audio
+ * they return, in the buffer size the device reported.
+ */
+
+#include <math.h>
+
+#include "hal_test.h"
+
+#include "audio_hw.c"
+
+#include "audio_hw_test.h"
+
+#define CAPTURE_SECONDS 1
+#define FILE_SECONDS 2
+#define TONE_HZ 1000
+#define TONE_LEVEL 8000.0
+
+static void put_le16(FILE *file, unsigned int value)
+{
+    fputc(value & 0xff, file);
+    fputc(value >> 8 & 0xff, file);
+}
+
+static void put_le32(FILE *file, uint32_t value)
+{
+    put_le16(file, value & 0xffff);
+    put_le16(file, value >> 16);
+}
+
+// A 16 bit stereo WAV at the codec rate, set as the capture input
+static void write_wav(const char *dir, int16_t (*sample)(size_t frame, unsigned int channel))
+{
+    static char path[128];
+    uint32_t frames = IN_SAMPLE_RATE * FILE_SECONDS;
+    uint32_t bytes = frames * IN_CHANNELS * sizeof(int16_t);
+    size_t i;
+    unsigned int c;
+    FILE *file;
+
+    snprintf(path, sizeof(path), "%s/capture.wav", dir);
+    file = fopen(path, "wb");
+    EXPECT(file);
+    if (!file)
+        return;
+    fwrite("RIFF", 1, 4, file);
+    put_le32(file, 36 + bytes);
+    fwrite("WAVEfmt ", 1, 8, file);
+    put_le32(file, 16);
+    put_le16(file, 1); // PCM
+    put_le16(file, IN_CHANNELS);
+    put_le32(file, IN_SAMPLE_RATE);
+    put_le32(file, IN_SAMPLE_RATE * IN_CHANNELS * sizeof(int16_t));
+    put_le16(file, IN_CHANNELS * sizeof(int16_t));
+    put_le16(file, 16);
+    fwrite("data", 1, 4, file);
+    put_le32(file, bytes);
+    for (i = 0; i < frames; i++) {
+        for (c = 0; c < IN_CHANNELS; c++)
+            put_le16(file, (uint16_t)sample(i, c));
+    }
+    fclose(file);
+    setenv("TINYALSA_SIM_CAPTURE_FILE", path, 1);
+}
+
+// Reads seconds of capture; returns the frames, *elapsed_ms the time it took
+static int16_t *capture(uint32_t rate, uint32_t channels, size_t *frames, double *elapsed_ms)
+{
+    struct audio_hw_device *dev = test_open_device();
+    unsigned int count = popcount(channels);
+    struct audio_stream_in *in = test_open_input(dev, AUDIO_DEVICE_IN_BUILTIN_MIC, rate, channels);
+    int16_t *data;
+    size_t done = 0;
+
+    *frames = 0;
+    if (!in)
+        return NULL;
+    size_t bytes = in->common.get_buffer_size(&in->common);
+    size_t buffer_frames = bytes / (count * sizeof(int16_t));
+    EXPECT(bytes == dev->get_input_buffer_size(dev, rate, AUDIO_FORMAT_PCM_16_BIT, count));
+    EXPECT_NEAR(buffer_frames * 1000.0 / rate, IN_BUFFER_MS, 1);
+
+    size_t total = rate * CAPTURE_SECONDS / buffer_frames * buffer_frames;
+    data = malloc(total * count * sizeof(int16_t));
+    int64_t start = test_now_us();
+    while (done < total) {
+        EXPECT(in->read(in, data + done * count, bytes) == (ssize_t)bytes);
+        done += buffer_frames;
+    }
+    *elapsed_ms = (test_now_us() - start) / 1000.0;
+    dev->close_input_stream(dev, in);
+    test_close_device(dev);
+    *frames = total;
+    return data;
+}
+
+static int16_t ramp(size_t frame, unsigned int channel)
+{
+    return channel ? -(int16_t)(frame & 0x7fff) : (int16_t)(frame & 0x7fff);
+}
+
+static void test_codec_rate(const char *dir)
+{
+    size_t frames, i, broken = 0;
+    double elapsed_ms;
+
+    write_wav(dir, ramp);
+    int16_t *data = capture(IN_SAMPLE_RATE, AUDIO_CHANNEL_IN_STEREO, &frames, &elapsed_ms);
+    for (i = 1; data && i < frames; i++) {
+        int16_t expected = (data[(i - 1) * 2] + 1) & 0x7fff;
+        broken += data[i * 2] != expected || data[i * 2 + 1] != -expected;
+    }
+    printf("%u Hz stereo: %zu frames in %.0f ms, %zu out of sequence\n", IN_SAMPLE_RATE,
+            frames, elapsed_ms, broken);
+    EXPECT(frames && !broken);
+    // The first period may already be waiting
+    EXPECT_NEAR(elapsed_ms, CAPTURE_SECONDS * 1000.0, 60);
+    free(data);
+}
+
+static int16_t tone(size_t frame, unsigned int channel)
+{
+    return lrint(TONE_LEVEL * sin(2 * M_PI * TONE_HZ * frame / IN_SAMPLE_RATE));
+}
+
+static void test_voice_rate(const char *dir)
+{
+    const uint32_t rate = 16000;
+    size_t frames, i;
+    double elapsed_ms;
+
+    write_wav(dir, tone);
+    int16_t *data = capture(rate, AUDIO_CHANNEL_IN_MONO, &frames, &elapsed_ms);
+    if (!data)
+        return;
+
+    // Fit the tone past the filter's start, what is left is noise
+    double w = 2 * M_PI * TONE_HZ / rate;
+    double ss = 0, sc = 0, cc = 0, ys = 0, yc = 0;
+    size_t first = rate / 10;
+    for (i = first; i < frames; i++) {
+        double s = sin(w * i), c = cos(w * i);
+        ss += s * s;
+        sc += s * c;
+        cc += c * c;
+        ys += data[i] * s;
+        yc += data[i] * c;
+    }
+    double det = ss * cc - sc * sc;
+    double a = (ys * cc - yc * sc) / det, b = (yc * ss - ys * sc) / det;
+    double noise = 0;
+    for (i = first; i < frames; i++) {
+        double r = data[i] - a * sin(w * i) - b * cos(w * i);
+        noise += r * r;
+    }
+    noise = sqrt(noise / (frames - first));
+    double level = sqrt(a * a + b * b);
+    double snr = 20 * log10(level / sqrt(2) / (noise + 1e-9));
+    printf("%u Hz mono: %zu frames in %.0f ms, tone at %.0f, %.1f dB above the noise\n",
+            rate, frames, elapsed_ms, level, snr);
+    EXPECT_NEAR(level, TONE_LEVEL, TONE_LEVEL * 0.03);
+    EXPECT(snr > 60);
+    EXPECT_NEAR(elapsed_ms, CAPTURE_SECONDS * 1000.0, 60);
+    free(data);
+}
+
+int main(void)
+{
+    test_run_case(test_codec_rate);
+    test_run_case(test_voice_rate);
+    return test_result("capture_test");
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The echo reference a canceller on the input gets, with the simulated
+ * microphone hearing the speaker through the loopback. Noise plays at a
+ * stream volume of 0.5 while a stand-in canceller records the reference
+ * from process_reverse() and the capture from process(). The reference
+ * must carry the level the DAC played, not the one the client wrote, and
+ * line up with the capture within the resync tolerance of the HAL: that is
+ * what the canceller subtracts. Runs with pcm_write and PCM_MMAP, with and
+ * without the writer thread.
+ */
+
+#include <math.h>
+
+#include "hal_test.h"
+
+#include "audio_hw.c"
+
+#include "audio_hw_test.h"
+
+#define CAPTURE_SECONDS 2
+#define SKIP_MS 300
+#define NOISE_LEVEL 12000
+#define VOLUME 0.5f
+#define MAX_LAG_MS 40
+#define WINDOW_MS 100
+
+static int16_t *reference;
+static int16_t *captured;
+static size_t reference_frames;
+static size_t captured_frames;
+static size_t capacity;
+
+// Left channel of what the canceller gets, in the order it gets it
+static void record(int16_t *dst, size_t *frames, const audio_buffer_t *buffer)
+{
+    size_t i;
+
+    for (i = 0; i < buffer->frameCount && *frames < capacity; i++)
+        dst[(*frames)++] = buffer->s16[i * 2];
+}
+
+static int32_t aec_process(effect_handle_t self, audio_buffer_t *in, audio_buffer_t *out)
+{
+    record(captured, &captured_frames, in);
+    return 0;
+}
+
+static int32_t aec_process_reverse(effect_handle_t self, audio_buffer_t *in, audio_buffer_t *out)
+{
+    record(reference, &reference_frames, in);
+    return 0;
+}
+
+static int32_t aec_command(effect_handle_t self, uint32_t code, uint32_t size, void *data,
+                           uint32_t *reply_size, void *reply)
+{
+    return 0;
+}
+
+static int32_t aec_get_descriptor(effect_handle_t self, effect_descriptor_t *desc)
+{
+    memset(desc, 0, sizeof(*desc));
+    desc->type = *FX_IID_AEC;
+    strcpy(desc->name, "test echo canceller");
+    return 0;
+}
+
+static struct effect_interface_s aec_interface = {
+    .process = aec_process,
+    .command = aec_command,
+    .get_descriptor = aec_get_descriptor,
+    .process_reverse = aec_process_reverse,
+};
+static struct effect_interface_s *aec = &aec_interface;
+
+struct player {
+    struct audio_stream_out *out;
+    volatile int32_t stop;
+};
+
+static void *play(void *context)
+{
+    struct player *player = (struct player *)context;
+    struct audio_stream_out *out = player->out;
+    size_t bytes = out->common.get_buffer_size(&out->common);
+    size_t frames = test_buffer_frames(out), i;
+    int16_t *buffer = malloc(bytes);
+
+    while (!android_atomic_acquire_load(&player->stop)) {
+        for (i = 0; i < frames; i++)
+            buffer[i * 2] = buffer[i * 2 + 1] = rand() % (2 * NOISE_LEVEL + 1) - NOISE_LEVEL;
+        EXPECT(out->write(out, buffer, bytes) == (ssize_t)bytes);
+    }
+    free(buffer);
+    return NULL;
+}
+
+static double rms(const int16_t *data, size_t frames)
+{
+    double sum = 0;
+    size_t i;
+
+    for (i = 0; i < frames; i++)
+        sum += (double)data[i] * data[i];
+    return sqrt(sum / frames);
+}
+
+/*
+ * The lag of the reference behind the capture over frames, where they
+ * correlate best. ref must have max_lag frames to spare on either side.
+ */
+static int best_lag(const int16_t *cap, const int16_t *ref, size_t frames, int max_lag,
+                    double *correlation)
+{
+    int lag, best = 0;
+
+    *correlation = -1;
+    for (lag = -max_lag; lag <= max_lag; lag++) {
+        double sum = 0, cap_sum = 0, ref_sum = 0;
+        size_t i;
+        for (i = 0; i < frames; i++) {
+            sum += (double)cap[i] * ref[i + lag];
+            cap_sum += (double)cap[i] * cap[i];
+            ref_sum += (double)ref[i + lag] * ref[i + lag];
+        }
+        double c = sum / (sqrt(cap_sum * ref_sum) + 1e-9);
+        if (c > *correlation) {
+            *correlation = c;
+            best = lag;
+        }
+    }
+    return best;
+}
+
+static void check_reference(const char *dir)
+{
+    struct audio_hw_device *dev = test_open_device();
+    struct audio_stream_out *out = test_open_output(dev, AUDIO_DEVICE_OUT_SPEAKER,
+            OUT_SAMPLE_RATE, AUDIO_CHANNEL_OUT_STEREO);
+    struct audio_stream_in *in = test_open_input(dev, AUDIO_DEVICE_IN_BUILTIN_MIC,
+            IN_SAMPLE_RATE, AUDIO_CHANNEL_IN_STEREO);
+    struct player player = { .out = out };
+    pthread_t thread;
+
+    if (!out || !in)
+        return;
+    capacity = IN_SAMPLE_RATE * CAPTURE_SECONDS;
+    reference = calloc(capacity, sizeof(int16_t));
+    captured = calloc(capacity, sizeof(int16_t));
+    EXPECT(!out->set_volume(out, VOLUME, VOLUME));
+    EXPECT(!in->common.add_audio_effect(&in->common, (effect_handle_t)&aec));
+
+    pthread_create(&thread, NULL, play, &player);
+    size_t bytes = in->common.get_buffer_size(&in->common);
+    void *buffer = malloc(bytes);
+    while (captured_frames < capacity)
+        EXPECT(in->read(in, buffer, bytes) == (ssize_t)bytes);
+    android_atomic_release_store(1, &player.stop);
+    pthread_join(thread, NULL);
+    EXPECT(!in->common.remove_audio_effect(&in->common, (effect_handle_t)&aec));
+    // Read before close_output_stream() frees the stream
+    bool use_mmap = ((struct stream_out *)out)->use_mmap;
+    bool use_writer = ((struct stream_out *)out)->use_writer;
+    dev->close_input_stream(dev, in);
+    dev->close_output_stream(dev, out);
+    test_close_device(dev);
+    free(buffer);
+
+    /*
+     * The reader drifts up to the resync tolerance before the HAL moves it,
+     * so the lag is taken window by window rather than once for the run.
+     */
+    EXPECT(reference_frames == captured_frames);
+    size_t skip = IN_SAMPLE_RATE * SKIP_MS / 1000;
+    size_t window = IN_SAMPLE_RATE * WINDOW_MS / 1000, pos;
+    int max_lag = IN_SAMPLE_RATE * MAX_LAG_MS / 1000, worst_lag = 0;
+    double worst_correlation = 1;
+    for (pos = skip; pos + window + max_lag <= captured_frames; pos += window) {
+        double correlation;
+        int lag = best_lag(captured + pos, reference + pos, window, max_lag, &correlation);
+        if (abs(lag) > abs(worst_lag))
+            worst_lag = lag;
+        if (correlation < worst_correlation)
+            worst_correlation = correlation;
+    }
+    // Uniform noise has an RMS of its peak over sqrt(3)
+    double level = rms(reference + skip, captured_frames - skip) / (NOISE_LEVEL / sqrt(3));
+    printf("mmap %s, writer thread %s: reference at %.3f of the written level, up to %.2f ms"
+            " behind the capture, correlation %.3f at worst\n", use_mmap ? "on" : "off",
+            use_writer ? "on" : "off", level, worst_lag * 1000.0 / IN_SAMPLE_RATE,
+            worst_correlation);
+    EXPECT_NEAR(level, VOLUME, 0.02);
+    EXPECT(abs(worst_lag) <= IN_SAMPLE_RATE * ECHO_REF_RESYNC_MS / 1000);
+    EXPECT(worst_correlation > 0.9);
+    free(reference);
+    free(captured);
+}
+
+int main(void)
+{
+    // The microphone hears the speaker as it plays
+    setenv("TINYALSA_SIM_LOOPBACK_US", "0", 1);
+    test_run_case(check_reference);
+    test_set_property(OUT_PROPERTY_WRITER_THREAD, "on");
+    test_run_case(check_reference);
+    test_set_property(OUT_PROPERTY_MMAP, "on");
+    test_run_case(check_reference);
+    test_set_property(OUT_PROPERTY_WRITER_THREAD, NULL);
+    test_run_case(check_reference);
+    return test_result("echo_ref_test");
+}
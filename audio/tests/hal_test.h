@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Harness of the host tests. A test is one executable that includes this
+ * header, then the HAL source it tests so its statics are in reach, and
+ * runs it on the simulated sound card of host/tinyalsa_sim.c. The
+ * simulator reads its environment at the first pcm_open(), so tests set it
+ * first thing in main(). The exit status is the number of failed checks.
+ */
+
+#ifndef LIFEDJIK_AUDIO_TESTS_HAL_TEST_H
+#define LIFEDJIK_AUDIO_TESTS_HAL_TEST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// The HAL reads its properties from test_set_property() instead of the system
+#define property_get test_property_get
+#include <cutils/properties.h>
+
+#define TEST_MAX_PROPERTIES 32
+
+static int test_failures;
+
+#define EXPECT(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: FAILED: %s\n", __FILE__, __LINE__, #cond); \
+            test_failures++; \
+        } \
+    } while (0)
+
+#define EXPECT_NEAR(value, expected, tolerance) do { \
+        double test_v_ = (value), test_e_ = (expected); \
+        if (test_v_ < test_e_ - (tolerance) || test_v_ > test_e_ + (tolerance)) { \
+            fprintf(stderr, "%s:%d: FAILED: %s = %g, expected %g +- %g\n", __FILE__, \
+                    __LINE__, #value, test_v_, test_e_, (double)(tolerance)); \
+            test_failures++; \
+        } \
+    } while (0)
+
+static struct {
+    const char *key;
+    const char *value;
+} test_properties[TEST_MAX_PROPERTIES];
+
+// Sets or with NULL clears a property; key and value must outlive the test
+static inline void test_set_property(const char *key, const char *value)
+{
+    unsigned int i, free_slot = TEST_MAX_PROPERTIES;
+
+    for (i = 0; i < TEST_MAX_PROPERTIES; i++) {
+        if (test_properties[i].key && !strcmp(test_properties[i].key, key)) {
+            test_properties[i].value = value;
+            return;
+        }
+        if (!test_properties[i].key && free_slot == TEST_MAX_PROPERTIES)
+            free_slot = i;
+    }
+    if (free_slot < TEST_MAX_PROPERTIES) {
+        test_properties[free_slot].key = key;
+        test_properties[free_slot].value = value;
+    }
+}
+
+int test_property_get(const char *key, char *value, const char *default_value)
+{
+    const char *found = default_value;
+    unsigned int i;
+
+    for (i = 0; i < TEST_MAX_PROPERTIES; i++) {
+        if (test_properties[i].key && !strcmp(test_properties[i].key, key) &&
+                test_properties[i].value) {
+            found = test_properties[i].value;
+            break;
+        }
+    }
+    if (!found)
+        found = "";
+    strncpy(value, found, PROPERTY_VALUE_MAX - 1);
+    value[PROPERTY_VALUE_MAX - 1] = '\0';
+    return strlen(value);
+}
+
+static inline int64_t test_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int test_compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// p-th percentile of n values, which it sorts
+static inline double test_percentile(double *values, size_t n, double p)
+{
+    if (!n)
+        return 0;
+    qsort(values, n, sizeof(double), test_compare_double);
+    size_t i = (size_t)(p / 100 * (n - 1) + 0.5);
+    return values[i < n ? i : n - 1];
+}
+
+/*
+ * Fresh directory for the recordings of the simulator, set as its
+ * TINYALSA_SIM_RECORD_DIR. Playback on card c device d ends up in
+ * <dir>/pcmC<c>D<d>p.raw.
+ */
+static inline const char *test_record_dir(void)
+{
+    static char dir[64];
+
+    snprintf(dir, sizeof(dir), "/tmp/audio_hal_test.XXXXXX");
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    setenv("TINYALSA_SIM_RECORD_DIR", dir, 1);
+    return dir;
+}
+
+// Reads a whole recording, NULL if there is none; *bytes gets its size
+static inline void *test_read_recording(const char *dir, unsigned int card, unsigned int device,
+                                 size_t *bytes)
+{
+    char path[128];
+    struct stat st;
+    void *data;
+    FILE *file;
+
+    snprintf(path, sizeof(path), "%s/pcmC%uD%up.raw", dir, card, device);
+    file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+    if (fstat(fileno(file), &st) || !(data = malloc(st.st_size ? st.st_size : 1))) {
+        fclose(file);
+        return NULL;
+    }
+    *bytes = fread(data, 1, st.st_size, file);
+    fclose(file);
+    return data;
+}
+
+/*
+ * Runs a case in a child process with a fresh recording directory, so it
+ * gets a simulator configured from the environment as it is now.
+ */
+static inline void test_run_case(void (*test_case)(const char *dir))
+{
+    const char *dir = test_record_dir();
+    pid_t pid = fork();
+    int status;
+
+    if (!pid) {
+        test_case(dir);
+        exit(test_failures);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+        fprintf(stderr, "case in %s did not finish\n", dir);
+        test_failures++;
+        return;
+    }
+    test_failures += WEXITSTATUS(status);
+}
+
+static inline int test_result(const char *name)
+{
+    fprintf(stderr, "%s: %s\n", name, test_failures ? "FAILED" : "PASSED");
+    return test_failures ? 1 : 0;
+}
+
+#endif // LIFEDJIK_AUDIO_TESTS_HAL_TEST_H
@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * AC3 passthrough on the HDMI output, with the simulated HDMI PCM recorded
+ * to a file. Every AC3 frame written must come out of the file as one
+ * IEC61937 burst: the preamble, the frame as little endian words and zero
+ * padding to 1536 frames, in order and none missing. The PCM must run at
+ * the rate in the AC3 headers whatever the stream was opened at, measured
+ * on its clock, and the IEC958 channel status must carry the non-audio bit
+ * and that rate. A PCM stream on HDMI clears the non-audio bit again.
+ */
+
+#include "hal_test.h"
+
+#include "audio_hw.c"
+
+#include "audio_hw_test.h"
+
+#define HDMI_CARD 1
+#define HDMI_DEVICE 3
+#define AC3_FRAMES 60
+// 64 kbps
+#define AC3_FRMSIZECOD 8
+#define AC3_BURST_BYTES (1536 * 4)
+// Positions taken once the PCM runs steadily at the rate of the bursts
+#define RATE_FROM_FRAME 20
+
+// Bytes of an AC3 frame at 64 kbps, see ac3_frame_bytes() in iec61937.c
+static size_t ac3_frame_bytes(uint32_t rate)
+{
+    return 64000 * 1536 / (rate * 16) * 2;
+}
+
+static uint8_t ac3_byte(unsigned int frame, size_t i)
+{
+    return (uint8_t)(frame * 31 + i * 7 + 1);
+}
+
+// A frame the packer takes: sync word, header, then a pattern that tells frames apart
+static void make_ac3_frame(uint8_t *dst, uint32_t rate, unsigned int frame)
+{
+    size_t bytes = ac3_frame_bytes(rate), i;
+
+    for (i = 0; i < bytes; i++)
+        dst[i] = ac3_byte(frame, i);
+    dst[0] = 0x0B;
+    dst[1] = 0x77;
+    dst[4] = (rate == 44100 ? 1 : 0) << 6 | AC3_FRMSIZECOD;
+    dst[5] = 8 << 3; // bsid 8, bsmod 0
+}
+
+static uint16_t le16(const uint8_t *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+// Counts the bursts in the recording that carry frame after frame, from the first
+static unsigned int check_bursts(const uint8_t *data, size_t size, uint32_t rate)
+{
+    size_t frame_bytes = ac3_frame_bytes(rate);
+    uint8_t expected[1024];
+    unsigned int found = 0, bad = 0;
+    size_t pos = 0, i;
+
+    while (pos + AC3_BURST_BYTES <= size) {
+        const uint8_t *burst = data + pos;
+        if (le16(burst) != 0xF872 || le16(burst + 2) != 0x4E1F) {
+            // Silence before the PCM starts or across an underrun
+            pos += 4;
+            continue;
+        }
+        make_ac3_frame(expected, rate, found);
+        bool ok = (le16(burst + 4) & 0x1f) == 1 && le16(burst + 6) == frame_bytes * 8;
+        for (i = 0; ok && i < frame_bytes; i += 2)
+            ok = burst[8 + i] == expected[i + 1] && burst[8 + i + 1] == expected[i];
+        for (i = 8 + frame_bytes; ok && i < AC3_BURST_BYTES; i++)
+            ok = !burst[i];
+        bad += !ok;
+        found++;
+        pos += AC3_BURST_BYTES;
+    }
+    if (bad)
+        fprintf(stderr, "%u of %u bursts differ from the frames written\n", bad, found);
+    return bad ? 0 : found;
+}
+
+static void get_channel_status(struct snd_aes_iec958 *iec958)
+{
+    struct mixer *mixer = mixer_open(HDMI_CARD);
+    struct mixer_ctl *ctl = mixer ? mixer_get_ctl_by_name(mixer, HDMI_MIXER_IEC958) : NULL;
+
+    memset(iec958, 0, sizeof(*iec958));
+    EXPECT(ctl && !mixer_ctl_get_array(ctl, iec958, 1));
+    if (mixer)
+        mixer_close(mixer);
+}
+
+// Plays AC3 frames at stream_rate on a stream opened at open_rate
+static void check_passthrough(const char *dir, uint32_t open_rate, uint32_t stream_rate)
+{
+    struct audio_hw_device *dev = test_open_device();
+    struct audio_stream_out *out = NULL;
+    int format = HDMI_FORMAT_AC3;
+    uint32_t channels = AUDIO_CHANNEL_OUT_STEREO, rate = open_rate;
+    struct snd_aes_iec958 iec958;
+    uint8_t frame[1024];
+    uint64_t first_frames = 0, last_frames = 0;
+    struct timespec first_ts, last_ts;
+    unsigned int i;
+
+    EXPECT(!dev->open_output_stream(dev, AUDIO_DEVICE_OUT_AUX_DIGITAL, &format, &channels,
+            &rate, &out));
+    if (!out)
+        return;
+    for (i = 0; i < AC3_FRAMES; i++) {
+        make_ac3_frame(frame, stream_rate, i);
+        size_t bytes = ac3_frame_bytes(stream_rate);
+        EXPECT(out->write(out, frame, bytes) == (ssize_t)bytes);
+        if (i == RATE_FROM_FRAME)
+            EXPECT(!out_get_presentation_position(out, &first_frames, &first_ts));
+        else if (i > RATE_FROM_FRAME)
+            EXPECT(!out_get_presentation_position(out, &last_frames, &last_ts));
+    }
+    get_channel_status(&iec958);
+    dev->close_output_stream(dev, out);
+    test_close_device(dev);
+
+    double seconds = (last_ts.tv_sec - first_ts.tv_sec) + (last_ts.tv_nsec - first_ts.tv_nsec) / 1e9;
+    double pcm_rate = (last_frames - first_frames) / seconds;
+    size_t size = 0;
+    uint8_t *data = test_read_recording(dir, HDMI_CARD, HDMI_DEVICE, &size);
+    unsigned int bursts = check_bursts(data, size, stream_rate);
+    free(data);
+    printf("AC3 at %u Hz on a stream opened at %u Hz: %u of %u bursts, PCM at %.0f Hz,"
+            " channel status %02x %02x %02x %02x\n", stream_rate, open_rate, bursts, AC3_FRAMES,
+            pcm_rate, iec958.status[0], iec958.status[1], iec958.status[2], iec958.status[3]);
+    EXPECT(bursts == AC3_FRAMES);
+    EXPECT_NEAR(pcm_rate, stream_rate, stream_rate * 0.01);
+    EXPECT(iec958.status[0] & IEC958_AES0_NONAUDIO);
+    EXPECT(iec958.status[3] == iec958_rate_code(stream_rate));
+}
+
+static void test_ac3_48000(const char *dir)
+{
+    check_passthrough(dir, 48000, 48000);
+}
+
+static void test_ac3_44100(const char *dir)
+{
+    check_passthrough(dir, 48000, 44100);
+}
+
+// Back to PCM after passthrough, on the same device
+static void test_pcm_after_passthrough(const char *dir)
+{
+    struct audio_hw_device *dev = test_open_device();
+    struct snd_aes_iec958 iec958;
+    int format = HDMI_FORMAT_AC3;
+    uint32_t channels = AUDIO_CHANNEL_OUT_STEREO, rate = 48000;
+    struct audio_stream_out *out = NULL;
+    uint8_t frame[1024];
+
+    EXPECT(!dev->open_output_stream(dev, AUDIO_DEVICE_OUT_AUX_DIGITAL, &format, &channels,
+            &rate, &out));
+    if (out) {
+        make_ac3_frame(frame, 48000, 0);
+        out->write(out, frame, ac3_frame_bytes(48000));
+        dev->close_output_stream(dev, out);
+    }
+    out = test_open_output(dev, AUDIO_DEVICE_OUT_AUX_DIGITAL, 48000, AUDIO_CHANNEL_OUT_STEREO);
+    if (out) {
+        size_t bytes = out->common.get_buffer_size(&out->common);
+        void *buffer = calloc(1, bytes);
+        EXPECT(out->write(out, buffer, bytes) == (ssize_t)bytes);
+        get_channel_status(&iec958);
+        free(buffer);
+        dev->close_output_stream(dev, out);
+        printf("PCM after passthrough: channel status %02x %02x %02x %02x\n", iec958.status[0],
+                iec958.status[1], iec958.status[2], iec958.status[3]);
+        EXPECT(!(iec958.status[0] & IEC958_AES0_NONAUDIO));
+        EXPECT(iec958.status[3] == iec958_rate_code(48000));
+    }
+    test_close_device(dev);
+}
+
+int main(void)
+{
+    char card[4], device[4];
+
+    snprintf(card, sizeof(card), "%d", HDMI_CARD);
+    snprintf(device, sizeof(device), "%d", HDMI_DEVICE);
+    test_set_property(HDMI_PROPERTY_ACTIVE, "true");
+    test_set_property(HDMI_PROPERTY_CARD, card);
+    test_set_property(HDMI_PROPERTY_DEVICE, device);
+    test_run_case(test_ac3_48000);
+    test_run_case(test_ac3_44100);
+    test_run_case(test_pcm_after_passthrough);
+    return test_result("hdmi_passthrough_test");
+}
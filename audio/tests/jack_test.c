@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Plug-to-route latency of the jack monitor, driven through its FIFO
+ * source. Headphones go in and out while the test watches the headphone
+ * switch of the simulated codec: the time from the event to the control
+ * write is what a listener hears the speaker for after a plug. Idle, that
+ * is the monitor and the route worker waking up; while an output plays it
+ * adds the fade, which waits for the buffered frames and is capped at
+ * ROUTE_MUTE_MAX_MS. The monitor also reports the jack devices upward.
+ */
+
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "hal_test.h"
+
+#include "audio_hw.c"
+
+#include "audio_hw_test.h"
+
+#define PLUGS 10
+#define ROUTE_TIMEOUT_US 1000000
+#define IDLE_MAX_US 10000
+
+static const char plug[] = "SWITCH_NAME=h2w\nSWITCH_STATE=2\n";
+static const char unplug[] = "SWITCH_NAME=h2w\nSWITCH_STATE=0\n";
+
+struct player {
+    struct audio_stream_out *out;
+    volatile int32_t stop;
+};
+
+static void *play(void *context)
+{
+    struct player *player = (struct player *)context;
+    size_t bytes = player->out->common.get_buffer_size(&player->out->common);
+    void *buffer = calloc(1, bytes);
+
+    while (!android_atomic_acquire_load(&player->stop))
+        EXPECT(player->out->write(player->out, buffer, bytes) == (ssize_t)bytes);
+    free(buffer);
+    return NULL;
+}
+
+// us from the event until the headphone switch reads value, -1 if it never does
+static int64_t wait_route(struct mixer_ctl *hp_switch, int value, int64_t event_us)
+{
+    while (mixer_ctl_get_value(hp_switch, 0) != value) {
+        if (test_now_us() - event_us > ROUTE_TIMEOUT_US)
+            return -1;
+        usleep(100);
+    }
+    return test_now_us() - event_us;
+}
+
+static int32_t jack_devices(struct audio_hw_device *dev)
+{
+    char *reply = dev->get_parameters(dev, JACK_PARAMETER_DEVICES);
+    int devices = -1;
+    struct str_parms *parms = reply ? str_parms_create_str(reply) : NULL;
+
+    if (parms) {
+        str_parms_get_int(parms, JACK_PARAMETER_DEVICES, &devices);
+        str_parms_destroy(parms);
+    }
+    free(reply);
+    return devices;
+}
+
+// Returns the worst plug-to-route latency in us
+static int64_t measure(const char *dir, const char *name, bool playing)
+{
+    static char source[sizeof("fifo:") + PATH_MAX];
+    char path[PATH_MAX];
+    double latencies[PLUGS * 2];
+    struct player player = { 0 };
+    pthread_t thread;
+    unsigned int i;
+
+    snprintf(path, sizeof(path), "%s/jack", dir);
+    EXPECT(!mkfifo(path, 0600));
+    snprintf(source, sizeof(source), "fifo:%s", path);
+    test_set_property(JACK_PROPERTY_SOURCE, source);
+    int fd = open(path, O_RDWR);
+    EXPECT(fd >= 0);
+
+    struct audio_hw_device *dev = test_open_device();
+    struct audio_device *adev = (struct audio_device *)dev;
+    struct mixer *mixer = mixer_open(CARD);
+    struct mixer_ctl *hp_switch = mixer_get_ctl_by_name(mixer, mixer_ctl_names[CTL_HP_L_SWITCH]);
+    EXPECT(adev->jack.running);
+    // Unplugged at start: the monitor picks the speaker
+    EXPECT(wait_route(hp_switch, 0, test_now_us()) >= 0);
+
+    if (playing) {
+        player.out = test_open_output(dev, AUDIO_DEVICE_OUT_SPEAKER, OUT_SAMPLE_RATE,
+                AUDIO_CHANNEL_OUT_STEREO);
+        if (player.out)
+            pthread_create(&thread, NULL, play, &player);
+        // Running steadily, with the fade delay published
+        usleep(200000);
+    }
+
+    for (i = 0; i < PLUGS * 2; i++) {
+        bool in = !(i & 1);
+        int64_t event_us = test_now_us();
+        EXPECT(write(fd, in ? plug : unplug, strlen(in ? plug : unplug)) > 0);
+        latencies[i] = wait_route(hp_switch, in, event_us);
+        EXPECT(latencies[i] >= 0);
+        EXPECT(jack_devices(dev) == (int32_t)(in ? AUDIO_DEVICE_OUT_WIRED_HEADPHONE : 0));
+        // Let the outputs fade back in before the next event
+        usleep(50000);
+    }
+
+    if (player.out) {
+        android_atomic_release_store(1, &player.stop);
+        pthread_join(thread, NULL);
+        dev->close_output_stream(dev, player.out);
+    }
+    EXPECT(android_atomic_acquire_load(&adev->jack.events) == PLUGS * 2 + 1);
+    int32_t reported_max_us = android_atomic_acquire_load(&adev->router.switch_max_us);
+    mixer_close(mixer);
+    test_close_device(dev);
+    close(fd);
+
+    double p50 = test_percentile(latencies, PLUGS * 2, 50);
+    double max = test_percentile(latencies, PLUGS * 2, 100);
+    printf("%s: plug to route p50 %.0f us, max %.0f us, the HAL reports max %d us\n", name,
+            p50, max, reported_max_us);
+    return max;
+}
+
+static void test_idle(const char *dir)
+{
+    EXPECT(measure(dir, "idle", false) < IDLE_MAX_US);
+}
+
+static void test_playing(const char *dir)
+{
+    // The fade waits for the primary buffer, never longer than the cap
+    EXPECT(measure(dir, "playing", true) < ROUTE_MUTE_MAX_MS * 1000 + IDLE_MAX_US);
+}
+
+int main(void)
+{
+    test_run_case(test_idle);
+    test_run_case(test_playing);
+    return test_result("jack_test");
+}
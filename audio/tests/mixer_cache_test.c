@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Mixer calls per route change. The tinyalsa mixer calls of audio_hw.c go
+ * through counters here. Without the control cache every routing change
+ * opened the mixer and looked each control up by name, the resolve
+ * adev_open() now does once; with it a switch between speaker and wired
+ * headphone is only value writes, one ioctl each on the device.
+ */
+
+#include "hal_test.h"
+
+#include <tinyalsa/asoundlib.h>
+
+#define SWITCHES 10
+#define SWITCH_TIMEOUT_US 1000000
+
+static struct {
+    unsigned int opens;
+    unsigned int lookups;
+    unsigned int writes;
+} test_mixer;
+
+static struct mixer *test_mixer_open(unsigned int card)
+{
+    test_mixer.opens++;
+    return mixer_open(card);
+}
+
+static struct mixer_ctl *test_mixer_get_ctl_by_name(struct mixer *mixer, const char *name)
+{
+    test_mixer.lookups++;
+    return mixer_get_ctl_by_name(mixer, name);
+}
+
+static int test_mixer_ctl_set_value(struct mixer_ctl *ctl, unsigned int id, int value)
+{
+    test_mixer.writes++;
+    return mixer_ctl_set_value(ctl, id, value);
+}
+
+static int test_mixer_ctl_set_enum_by_string(struct mixer_ctl *ctl, const char *string)
+{
+    test_mixer.writes++;
+    return mixer_ctl_set_enum_by_string(ctl, string);
+}
+
+// Only the route worker writes controls once the device is open
+#define mixer_open test_mixer_open
+#define mixer_get_ctl_by_name test_mixer_get_ctl_by_name
+#define mixer_ctl_set_value test_mixer_ctl_set_value
+#define mixer_ctl_set_enum_by_string test_mixer_ctl_set_enum_by_string
+
+#include "audio_hw.c"
+
+#include "audio_hw_test.h"
+
+// Waits until the route worker has applied count switches
+static void wait_switches(struct audio_device *adev, int32_t count)
+{
+    int64_t deadline = test_now_us() + SWITCH_TIMEOUT_US;
+    while (android_atomic_acquire_load(&adev->router.switches) < count &&
+            test_now_us() < deadline)
+        usleep(1000);
+    EXPECT(android_atomic_acquire_load(&adev->router.switches) >= count);
+}
+
+int main(void)
+{
+    char routing[32];
+    unsigned int i;
+
+    test_record_dir();
+    struct audio_hw_device *dev = test_open_device();
+    struct audio_device *adev = (struct audio_device *)dev;
+    // HDMI is off, so this is the codec mixer alone
+    printf("adev_open: %u opens, %u lookups\n", test_mixer.opens, test_mixer.lookups);
+    EXPECT(test_mixer.lookups >= CTL_COUNT);
+
+    struct audio_stream_out *out = test_open_output(dev, AUDIO_DEVICE_OUT_SPEAKER,
+            OUT_SAMPLE_RATE, AUDIO_CHANNEL_OUT_STEREO);
+    if (!out)
+        return test_result("mixer_cache_test");
+    // Start from the speaker route, whatever the open left applied
+    snprintf(routing, sizeof(routing), "%s=%d", AUDIO_PARAMETER_STREAM_ROUTING,
+            AUDIO_DEVICE_OUT_SPEAKER);
+    out->common.set_parameters(&out->common, routing);
+    usleep(100000);
+
+    int32_t switches = android_atomic_acquire_load(&adev->router.switches);
+    unsigned int opens = test_mixer.opens;
+    unsigned int lookups = test_mixer.lookups;
+    unsigned int writes = test_mixer.writes;
+    for (i = 0; i < SWITCHES; i++) {
+        uint32_t devices = (i & 1) ? AUDIO_DEVICE_OUT_SPEAKER : AUDIO_DEVICE_OUT_WIRED_HEADPHONE;
+        snprintf(routing, sizeof(routing), "%s=%u", AUDIO_PARAMETER_STREAM_ROUTING, devices);
+        EXPECT(!out->common.set_parameters(&out->common, routing));
+        wait_switches(adev, switches + i + 1);
+    }
+    opens = test_mixer.opens - opens;
+    lookups = test_mixer.lookups - lookups;
+    writes = test_mixer.writes - writes;
+
+    printf("per route change before: 1 open, %d lookups, then the writes\n", CTL_COUNT);
+    printf("per route change after: %.1f opens, %.1f lookups, %.1f writes\n",
+            (double)opens / SWITCHES, (double)lookups / SWITCHES, (double)writes / SWITCHES);
+    EXPECT(!opens);
+    EXPECT(!lookups);
+    // Every control differs between the two routes, and is written once
+    EXPECT(writes == SWITCHES * CTL_COUNT);
+
+    dev->close_output_stream(dev, out);
+    test_close_device(dev);
+    return test_result("mixer_cache_test");
+}
@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Polyphase resampler: stop band attenuation and cost per frame for each
+ * quality tier on the ratios the HAL uses.
+ *
+ * A tone goes through the resampler and whatever comes out that is not the
+ * tone is leakage: the images of an upsampled tone, or all of a tone above
+ * the output Nyquist frequency when downsampling. The tone is fitted out of
+ * the output by least squares, so pass band ripple does not count. The
+ * leakage relative to the tone must reach the attenuation polyphase.h gives
+ * for the tier.
+ *
+ * The input held ahead of the output, polyphase_get_pending(), must keep
+ * the position of the next output frame exact. A resampler built in memory
+ * of the caller's by polyphase_init() must resample as a created one does.
+ *
+ * The cost is stereo 44.1 -> 48 kHz in cycles per output frame where the
+ * host has a cycle counter (x86), otherwise in ns per output frame.
+ */
+
+#include <errno.h>
+#include <math.h>
+
+#include "hal_test.h"
+
+#include "polyphase.h"
+
+#define SECONDS 1
+// Output skipped while the filter fills
+#define WARMUP_FRAMES 1024
+#define AMPLITUDE 16384.0
+#define BENCH_FRAMES 4096
+#define BENCH_MS 200
+#define TONES 8
+
+// The tones go from low to high: their images, or themselves, are in the stop band
+struct ratio {
+    uint32_t in_rate;
+    uint32_t out_rate;
+    double low;
+    double high;
+};
+
+static const struct ratio ratios[] = {
+    { 44100, 48000, 2000, 18000 },
+    { 48000, 44100, 23000, 23800 },
+    { 16000, 48000, 1000, 6500 },
+    { 48000, 16000, 9000, 23800 },
+    { 8000, 48000, 500, 3200 },
+    { 48000, 8000, 4500, 23800 },
+};
+
+// Attenuation promised in polyphase.h, in dB
+static const double tier_attenuation[POLYPHASE_QUALITY_COUNT] = { 55, 70, 78 };
+static const char * const tier_names[POLYPHASE_QUALITY_COUNT] = { "low", "medium", "high" };
+
+// Resamples the whole input, returns the number of output frames
+static size_t resample(struct polyphase *rs, const int16_t *in, size_t in_frames,
+                       int16_t *out, size_t out_capacity, unsigned int channels)
+{
+    size_t produced = 0;
+
+    while (in_frames && produced < out_capacity) {
+        size_t used = in_frames, made = out_capacity - produced;
+        polyphase_process(rs, in, &used, out + produced * channels, &made);
+        if (!used && !made)
+            break;
+        in += used * channels;
+        in_frames -= used;
+        produced += made;
+    }
+    return produced;
+}
+
+// Leakage of a tone through the resampler, in dB below the tone
+static double leakage_db(const struct ratio *ratio, double tone, enum polyphase_quality quality)
+{
+    size_t in_frames = ratio->in_rate * SECONDS;
+    size_t capacity = ratio->out_rate * SECONDS + 1024;
+    int16_t *in = malloc(in_frames * sizeof(int16_t));
+    int16_t *out = malloc(capacity * sizeof(int16_t));
+    struct polyphase *rs;
+    size_t i;
+
+    EXPECT(!polyphase_create(ratio->in_rate, ratio->out_rate, 1, quality, &rs));
+    for (i = 0; i < in_frames; i++)
+        in[i] = lrint(AMPLITUDE * sin(2 * M_PI * tone * i / ratio->in_rate));
+    size_t frames = resample(rs, in, in_frames, out, capacity, 1);
+    polyphase_release(rs);
+    EXPECT(frames > WARMUP_FRAMES * 2);
+
+    // Fit the tone where it is still in band, then take it out
+    double w = 2 * M_PI * tone / ratio->out_rate;
+    double ss = 0, sc = 0, cc = 0, ys = 0, yc = 0, a = 0, b = 0;
+    if (tone < ratio->out_rate / 2) {
+        for (i = WARMUP_FRAMES; i < frames; i++) {
+            double s = sin(w * i), c = cos(w * i);
+            ss += s * s;
+            sc += s * c;
+            cc += c * c;
+            ys += out[i] * s;
+            yc += out[i] * c;
+        }
+        double det = ss * cc - sc * sc;
+        a = (ys * cc - yc * sc) / det;
+        b = (yc * ss - ys * sc) / det;
+    }
+    double residual = 0;
+    for (i = WARMUP_FRAMES; i < frames; i++) {
+        double r = out[i] - a * sin(w * i) - b * cos(w * i);
+        residual += r * r;
+    }
+    residual = sqrt(residual / (frames - WARMUP_FRAMES));
+    free(in);
+    free(out);
+    // Against the RMS of the tone that went in
+    return -20 * log10((residual + 1e-9) / (AMPLITUDE / sqrt(2)));
+}
+
+/*
+ * Input consumed less polyphase_get_pending() is where the next output
+ * frame is: for 48 -> 16 kHz three input frames on per output frame,
+ * whatever chunks the input comes in.
+ */
+static void check_pending(void)
+{
+    static int16_t in[BENCH_FRAMES], out[BENCH_FRAMES];
+    struct polyphase *rs;
+    int64_t consumed = 0, produced = 0;
+    unsigned int i, off = 0;
+
+    EXPECT(!polyphase_create(48000, 16000, 1, POLYPHASE_QUALITY_MEDIUM, &rs));
+    EXPECT(polyphase_get_pending(rs) == 0);
+    for (i = 0; i < 200; i++) {
+        size_t in_frames = 1 + rand() % 700, out_frames = 1 + rand() % 300;
+        polyphase_process(rs, in, &in_frames, out, &out_frames);
+        consumed += in_frames;
+        produced += out_frames;
+        off += consumed - polyphase_get_pending(rs) != produced * 3;
+    }
+    polyphase_release(rs);
+    if (off)
+        printf("pending: %u of 200 calls off the output position\n", off);
+    EXPECT(!off);
+}
+
+// Stereo 44.1 -> 48 kHz, in memory sized by polyphase_get_size() with a guard after it
+static void check_init(void)
+{
+    static int16_t in[BENCH_FRAMES * 2], expected[BENCH_FRAMES * 2 * 2], out[BENCH_FRAMES * 2 * 2];
+    struct polyphase *created, *initialized;
+    size_t size = 0, i;
+    unsigned int mismatches = 0;
+
+    for (i = 0; i < BENCH_FRAMES * 2; i++)
+        in[i] = rand() % 65536 - 32768;
+    EXPECT(polyphase_get_size(44101, 48000, 2, POLYPHASE_QUALITY_MEDIUM, &size) == -EINVAL);
+    EXPECT(!polyphase_get_size(44100, 48000, 2, POLYPHASE_QUALITY_MEDIUM, &size));
+    uint8_t *memory = malloc(size + 64);
+    memset(memory + size, 0x5a, 64);
+    EXPECT(!polyphase_create(44100, 48000, 2, POLYPHASE_QUALITY_MEDIUM, &created));
+    EXPECT(!polyphase_init(memory, 44100, 48000, 2, POLYPHASE_QUALITY_MEDIUM, &initialized));
+
+    size_t frames = resample(created, in, BENCH_FRAMES, expected, BENCH_FRAMES * 2, 2);
+    EXPECT(resample(initialized, in, BENCH_FRAMES, out, BENCH_FRAMES * 2, 2) == frames);
+    for (i = 0; i < frames * 2; i++)
+        mismatches += out[i] != expected[i];
+    for (i = 0; i < 64; i++)
+        mismatches += memory[size + i] != 0x5a;
+    polyphase_release(created);
+    // Does nothing: the memory is ours
+    polyphase_release(initialized);
+    free(memory);
+    if (mismatches)
+        printf("init: %u samples differ from a created resampler or past its memory\n", mismatches);
+    EXPECT(!mismatches);
+}
+
+static inline uint64_t cycles(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    return __builtin_ia32_rdtsc();
+#else
+    return test_now_us() * 1000;
+#endif
+}
+
+// Cost of a stereo output frame at 44.1 -> 48 kHz
+static double cost(enum polyphase_quality quality)
+{
+    static int16_t in[BENCH_FRAMES * 2], out[BENCH_FRAMES * 2 * 2];
+    struct polyphase *rs;
+    uint64_t frames = 0;
+    size_t i;
+
+    for (i = 0; i < BENCH_FRAMES * 2; i++)
+        in[i] = (int16_t)rand();
+    EXPECT(!polyphase_create(44100, 48000, 2, quality, &rs));
+    // Designing the bank is not part of the cost
+    resample(rs, in, BENCH_FRAMES, out, BENCH_FRAMES * 2, 2);
+    int64_t end = test_now_us() + BENCH_MS * 1000;
+    uint64_t start = cycles();
+    do {
+        frames += resample(rs, in, BENCH_FRAMES, out, BENCH_FRAMES * 2, 2);
+    } while (test_now_us() < end);
+    uint64_t spent = cycles() - start;
+    polyphase_release(rs);
+    return (double)spent / frames;
+}
+
+int main(void)
+{
+    unsigned int i, q;
+
+    for (q = 0; q < POLYPHASE_QUALITY_COUNT; q++) {
+        printf("%s:", tier_names[q]);
+        for (i = 0; i < sizeof(ratios) / sizeof(ratios[0]); i++) {
+            const struct ratio *ratio = &ratios[i];
+            double worst = INFINITY;
+            unsigned int t;
+            for (t = 0; t < TONES; t++) {
+                double tone = ratio->low + (ratio->high - ratio->low) * t / (TONES - 1);
+                double db = leakage_db(ratio, tone, q);
+                if (db < worst)
+                    worst = db;
+            }
+            printf(" %u->%u %.1f dB,", ratio->in_rate, ratio->out_rate, worst);
+            EXPECT(worst >= tier_attenuation[q]);
+        }
+#if defined(__i386__) || defined(__x86_64__)
+        printf(" %.1f cycles per stereo frame\n", cost(q));
+#else
+        printf(" %.1f ns per stereo frame\n", cost(q));
+#endif
+    }
+    check_pending();
+    check_init();
+    return test_result("polyphase_test");
+}
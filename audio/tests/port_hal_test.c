@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The Jelly Bean port end to end: mono output through the remix stage,
+ * 44.1 kHz output through the resampler, both with pcm_write and PCM_MMAP,
+ * and capture at 16 kHz mono. The port does not hook up its stream open
+ * calls yet, so they are called directly.
+ */
+
+#include "hal_test.h"
+
+#include "__portaudio_hw.c"
+
+#define LEVEL 1000
+
+static struct audio_hw_device *open_device(void)
+{
+    hw_device_t *device = NULL;
+    EXPECT(!HAL_MODULE_INFO_SYM.common.methods->open(&HAL_MODULE_INFO_SYM.common,
+            AUDIO_HARDWARE_INTERFACE, &device));
+    return (struct audio_hw_device *)device;
+}
+
+// Plays seconds of a mono level at rate and returns the stereo recording of it
+static int16_t *play_mono(const char *dir, uint32_t rate, unsigned int frames, size_t *recorded)
+{
+    struct audio_hw_device *dev = open_device();
+    struct audio_config config = {
+        .sample_rate = rate,
+        .channel_mask = AUDIO_CHANNEL_OUT_MONO,
+        .format = AUDIO_FORMAT_PCM_16_BIT,
+    };
+    struct audio_stream_out *out = NULL;
+    int16_t buffer[441];
+    unsigned int i, n;
+    size_t bytes = 0;
+    int16_t *data;
+
+    for (i = 0; i < sizeof(buffer) / sizeof(buffer[0]); i++)
+        buffer[i] = LEVEL;
+    EXPECT(!adev_open_output_stream(dev, 0, AUDIO_DEVICE_OUT_SPEAKER, AUDIO_OUTPUT_FLAG_PRIMARY,
+            &config, &out));
+    if (!out)
+        return NULL;
+    for (n = 0; n < frames; n += sizeof(buffer) / sizeof(buffer[0]))
+        EXPECT(out->write(out, buffer, sizeof(buffer)) == sizeof(buffer));
+    adev_close_output_stream(dev, out);
+    dev->common.close(&dev->common);
+
+    data = test_read_recording(dir, CARD, DEVICE, &bytes);
+    *recorded = bytes / (2 * sizeof(int16_t));
+    return data;
+}
+
+static void test_remix(const char *dir)
+{
+    unsigned int frames = 441 * 40;
+    size_t recorded = 0, i, wrong = 0;
+    int16_t *data = play_mono(dir, OUT_SAMPLE_RATE, frames, &recorded);
+
+    EXPECT(recorded == frames);
+    for (i = 0; data && i < recorded * 2; i++)
+        wrong += data[i] != LEVEL;
+    EXPECT(wrong == 0);
+    free(data);
+}
+
+static void test_resample(const char *dir)
+{
+    unsigned int frames = 441 * 50; // 0.5 s
+    size_t recorded = 0, i;
+    int16_t *data = play_mono(dir, 44100, frames, &recorded);
+
+    // Only the filter history is held back
+    EXPECT_NEAR(recorded, frames * OUT_SAMPLE_RATE / 44100.0, 64);
+    // Past the filter's start the level comes through on both channels
+    for (i = recorded / 2; data && i < recorded; i++) {
+        EXPECT_NEAR(data[i * 2], LEVEL, LEVEL / 50);
+        EXPECT_NEAR(data[i * 2 + 1], LEVEL, LEVEL / 50);
+        if (test_failures)
+            break;
+    }
+    free(data);
+}
+
+static void test_capture(const char *dir)
+{
+    struct audio_hw_device *dev = open_device();
+    struct audio_config config = {
+        .sample_rate = 16000,
+        .channel_mask = AUDIO_CHANNEL_IN_MONO,
+        .format = AUDIO_FORMAT_PCM_16_BIT,
+    };
+    struct audio_stream_in *in = NULL;
+    int16_t buffer[320];
+    unsigned int i;
+
+    EXPECT(!adev_open_input_stream(dev, 0, AUDIO_DEVICE_IN_BUILTIN_MIC, &config, &in));
+    if (!in)
+        return;
+    int64_t start = test_now_us();
+    for (i = 0; i < 25; i++)
+        EXPECT(in->read(in, buffer, sizeof(buffer)) == sizeof(buffer));
+    // 25 x 20 ms, paced by the capture clock; the first period comes at once
+    EXPECT_NEAR((test_now_us() - start) / 1000.0, 500, 60);
+    adev_close_input_stream(dev, in);
+    dev->common.close(&dev->common);
+}
+
+int main(void)
+{
+    test_run_case(test_remix);
+    test_run_case(test_resample);
+    test_set_property(OUT_PROPERTY_MMAP, "on");
+    test_run_case(test_remix);
+    test_run_case(test_resample);
+    test_set_property(OUT_PROPERTY_MMAP, NULL);
+    test_run_case(test_capture);
+    return test_result("port_hal_test");
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Latency and positions against the clock of the simulated PCM. The PCM
+ * plays from the write that reaches its start threshold on, at the stream
+ * rate, so what the DAC played by a timestamp is known here. Positions
+ * must match it within a period through plain playback, across standby,
+ * which drops what was queued, and after an underrun, whose silence is no
+ * frames of the stream. The presentation position is not in the ICS
+ * stream API yet, so it is called directly.
+ */
+
+#include "hal_test.h"
+
+#include "audio_hw.c"
+
+#include "audio_hw_test.h"
+
+#define PLAY_MS 500
+#define GAP_MS 200
+
+struct clock {
+    // Frames presented when the PCM started, and when, with the uncertainty of when
+    uint64_t base;
+    int64_t start_us;
+    int64_t slack_us;
+};
+
+static struct audio_stream_out *out;
+static void *buffer;
+static size_t bytes;
+static size_t frames;
+static uint32_t rate;
+
+static int64_t timespec_us(const struct timespec *ts)
+{
+    return ts->tv_sec * 1000000LL + ts->tv_nsec / 1000;
+}
+
+// A write that starts the PCM, which the empty buffer takes without blocking
+static void start(struct clock *clock, uint64_t base)
+{
+    uint64_t position;
+    struct timespec ts;
+
+    clock->base = base;
+    clock->start_us = test_now_us();
+    EXPECT(out->write(out, buffer, bytes) == (ssize_t)bytes);
+    clock->slack_us = test_now_us() - clock->start_us;
+    EXPECT(!out_get_presentation_position(out, &position, &ts));
+}
+
+// Plays for ms, checking both positions after each write; returns the last
+static uint64_t play(const struct clock *clock, unsigned int ms, uint32_t render_base)
+{
+    int64_t end = test_now_us() + ms * 1000LL;
+    uint64_t position = 0, last = 0;
+    uint32_t render = 0;
+    struct timespec ts;
+    double worst = 0;
+
+    while (test_now_us() < end) {
+        EXPECT(out->write(out, buffer, bytes) == (ssize_t)bytes);
+        if (out_get_presentation_position(out, &position, &ts)) {
+            EXPECT(!"no position while playing");
+            continue;
+        }
+        EXPECT(!out->get_render_position(out, &render));
+        double expected = clock->base + (timespec_us(&ts) - clock->start_us) * (double)rate / 1000000;
+        double tolerance = frames + clock->slack_us * (double)rate / 1000000;
+        EXPECT_NEAR(position, expected, tolerance);
+        EXPECT(position >= last);
+        // The render position counts from leaving standby
+        EXPECT_NEAR(render, position - render_base, frames);
+        if (fabs(position - expected) > worst)
+            worst = fabs(position - expected);
+        last = position;
+    }
+    printf("  worst error %.0f frames, a period is %zu\n", worst, frames);
+    return position;
+}
+
+int main(void)
+{
+    struct clock clock;
+    struct timespec ts;
+    uint64_t position;
+
+    test_record_dir();
+    struct audio_hw_device *dev = test_open_device();
+    out = test_open_output(dev, AUDIO_DEVICE_OUT_SPEAKER, OUT_SAMPLE_RATE,
+            AUDIO_CHANNEL_OUT_STEREO);
+    if (!out)
+        return test_result("position_test");
+    struct stream_out *lostream = (struct stream_out *)out;
+    rate = out->common.get_sample_rate(&out->common);
+    bytes = out->common.get_buffer_size(&out->common);
+    frames = test_buffer_frames(out);
+    buffer = calloc(1, bytes);
+
+    // The kernel buffer, nothing queued ahead of it without the writer thread
+    EXPECT(out->get_latency(out) ==
+            OUT_PERIOD_SIZE * OUT_PERIOD_COUNT * 1000 / rate);
+    EXPECT(out_get_presentation_position(out, &position, &ts));
+
+    printf("playback:\n");
+    start(&clock, 0);
+    position = play(&clock, PLAY_MS, 0);
+
+    /*
+     * Standby drops what was queued: the position carries on from what
+     * had played, and the render position starts over.
+     */
+    printf("after standby:\n");
+    EXPECT(!out_get_presentation_position(out, &position, &ts));
+    uint64_t played = position + (test_now_us() - timespec_us(&ts)) * rate / 1000000;
+    out->common.standby(&out->common);
+    EXPECT(out_get_presentation_position(out, &position, &ts));
+    start(&clock, played);
+    // Time played between the query and the standby
+    clock.slack_us += 1000;
+    play(&clock, PLAY_MS, played);
+
+    /*
+     * The PCM runs dry and restarts on the next write, which fills its
+     * buffer; the position resumes from everything written before.
+     */
+    printf("after an underrun:\n");
+    int32_t underruns = android_atomic_acquire_load(&lostream->stats.underruns);
+    usleep(GAP_MS * 1000);
+    uint64_t written = out_frames_written(lostream);
+    start(&clock, written);
+    play(&clock, PLAY_MS, played);
+    EXPECT(android_atomic_acquire_load(&lostream->stats.underruns) == underruns + 1);
+
+    dev->close_output_stream(dev, out);
+    test_close_device(dev);
+    free(buffer);
+    return test_result("position_test");
+}
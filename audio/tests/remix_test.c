@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Remix kernels against their _c references: bit exact on full scale noise
+ * for every length up to a few vector widths past the tail and from
+ * unaligned buffers, then frames per microsecond of both. On the host the
+ * plain names are the references themselves; the comparison means something
+ * on an ARM build with NEON.
+ */
+
+#include "hal_test.h"
+
+#include "remix.h"
+
+#define MAX_FRAMES 4096
+#define TAIL_FRAMES 67
+#define BENCH_MS 100
+
+// Room for an unaligned start
+static int16_t src[MAX_FRAMES * 2 + 1];
+static int16_t dst[MAX_FRAMES * 2 + 1];
+static int16_t ref[MAX_FRAMES * 2 + 1];
+static int16_t left[MAX_FRAMES + 1], right[MAX_FRAMES + 1];
+static int16_t ref_left[MAX_FRAMES + 1], ref_right[MAX_FRAMES + 1];
+
+#define CHECK_SAME(a, b, count, name, frames) do { \
+        if (memcmp(a, b, (count) * sizeof(int16_t))) { \
+            fprintf(stderr, "%s: %zu frames differ from the reference\n", name, \
+                    (size_t)(frames)); \
+            test_failures++; \
+        } \
+    } while (0)
+
+static void check(size_t frames, unsigned int offset)
+{
+    const int16_t *in = src + offset;
+
+    remix_stereo_to_mono_i16(dst + offset, in, frames);
+    remix_stereo_to_mono_i16_c(ref + offset, in, frames);
+    CHECK_SAME(dst + offset, ref + offset, frames, "stereo_to_mono", frames);
+
+    remix_mono_to_stereo_i16(dst + offset, in, frames);
+    remix_mono_to_stereo_i16_c(ref + offset, in, frames);
+    CHECK_SAME(dst + offset, ref + offset, frames * 2, "mono_to_stereo", frames);
+
+    remix_deinterleave_i16(left + offset, right, in, frames);
+    remix_deinterleave_i16_c(ref_left + offset, ref_right, in, frames);
+    CHECK_SAME(left + offset, ref_left + offset, frames, "deinterleave", frames);
+    CHECK_SAME(right, ref_right, frames, "deinterleave", frames);
+
+    remix_interleave_i16(dst + offset, left + offset, right, frames);
+    remix_interleave_i16_c(ref + offset, ref_left + offset, ref_right, frames);
+    CHECK_SAME(dst + offset, ref + offset, frames * 2, "interleave", frames);
+    // And back to where it started
+    CHECK_SAME(dst + offset, in, frames * 2, "interleave", frames);
+
+    remix_duplicate_channel_i16(dst + offset, in, frames, 0);
+    remix_duplicate_channel_i16_c(ref + offset, in, frames, 0);
+    CHECK_SAME(dst + offset, ref + offset, frames * 2, "duplicate_channel", frames);
+    remix_duplicate_channel_i16(dst + offset, in, frames, 1);
+    remix_duplicate_channel_i16_c(ref + offset, in, frames, 1);
+    CHECK_SAME(dst + offset, ref + offset, frames * 2, "duplicate_channel", frames);
+}
+
+// Frames per microsecond of a stereo to mono kernel
+static double bench(void (*kernel)(int16_t *, const int16_t *, size_t))
+{
+    uint64_t frames = 0;
+    int64_t start = test_now_us(), now;
+    do {
+        kernel(dst, src, MAX_FRAMES);
+        frames += MAX_FRAMES;
+    } while ((now = test_now_us()) - start < BENCH_MS * 1000);
+    return (double)frames / (now - start);
+}
+
+int main(void)
+{
+    size_t frames;
+    unsigned int i;
+
+    srand(1);
+    for (i = 0; i < MAX_FRAMES * 2 + 1; i++)
+        src[i] = (int16_t)rand();
+    // The extremes, where a rounding or saturating difference would show
+    src[0] = src[1] = INT16_MAX;
+    src[2] = src[3] = INT16_MIN;
+    src[4] = INT16_MAX;
+    src[5] = INT16_MIN;
+
+    for (frames = 0; frames <= TAIL_FRAMES; frames++) {
+        check(frames, 0);
+        check(frames, 1);
+    }
+    check(MAX_FRAMES, 0);
+
+#ifdef __ARM_NEON__
+    printf("kernels: NEON\n");
+#else
+    printf("kernels: scalar\n");
+#endif
+    printf("stereo_to_mono: %.1f frames/us, reference %.1f\n",
+            bench(remix_stereo_to_mono_i16), bench(remix_stereo_to_mono_i16_c));
+    printf("mono_to_stereo: %.1f frames/us, reference %.1f\n",
+            bench(remix_mono_to_stereo_i16), bench(remix_mono_to_stereo_i16_c));
+    return test_result("remix_test");
+}
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Route switches while an output plays a constant level. The routing call
+ * must return in microseconds, with the control writes left to the route
+ * worker. Those writes must all come while the outputs are faded out and
+ * turn the old path off before the new one comes on. The recording must
+ * dip to silence once per switch through the volume ramp, never in a step
+ * a listener would hear as a click. Underruns on a slow host are counted
+ * by the HAL and allowed their own dip and clicks.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "hal_test.h"
+
+#include <cutils/atomic.h>
+#include <tinyalsa/asoundlib.h>
+
+#define SWITCHES 10
+#define SWITCH_TIMEOUT_US 1000000
+#define CALL_MAX_US 1000
+#define MAX_WRITES 256
+#define LEVEL 16384
+
+// Control writes as the route worker makes them, with the fade gain at the time
+static struct {
+    bool disables;
+    int32_t gain;
+} test_writes[MAX_WRITES];
+static unsigned int test_write_count;
+static volatile int32_t *test_fade_gain;
+// Guards the three above: the route worker logs while the test reads
+static pthread_mutex_t test_writes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void test_log_write(bool disables)
+{
+    pthread_mutex_lock(&test_writes_lock);
+    if (test_write_count < MAX_WRITES) {
+        test_writes[test_write_count].disables = disables;
+        test_writes[test_write_count].gain =
+                test_fade_gain ? android_atomic_acquire_load(test_fade_gain) : -1;
+        test_write_count++;
+    }
+    pthread_mutex_unlock(&test_writes_lock);
+}
+
+static unsigned int test_get_write_count(void)
+{
+    pthread_mutex_lock(&test_writes_lock);
+    unsigned int count = test_write_count;
+    pthread_mutex_unlock(&test_writes_lock);
+    return count;
+}
+
+static void test_set_fade_gain(volatile int32_t *gain)
+{
+    pthread_mutex_lock(&test_writes_lock);
+    test_fade_gain = gain;
+    pthread_mutex_unlock(&test_writes_lock);
+}
+
+static int test_mixer_ctl_set_value(struct mixer_ctl *ctl, unsigned int id, int value)
+{
+    // Once per control, not per channel
+    if (!id)
+        test_log_write(!value);
+    return mixer_ctl_set_value(ctl, id, value);
+}
+
+static int test_mixer_ctl_set_enum_by_string(struct mixer_ctl *ctl, const char *string)
+{
+    test_log_write(!strcmp(string, "Off"));
+    return mixer_ctl_set_enum_by_string(ctl, string);
+}
+
+#define mixer_ctl_set_value test_mixer_ctl_set_value
+#define mixer_ctl_set_enum_by_string test_mixer_ctl_set_enum_by_string
+
+#include "audio_hw.c"
+
+#include "audio_hw_test.h"
+
+struct player {
+    struct audio_stream_out *out;
+    volatile int32_t stop;
+};
+
+static void *play(void *context)
+{
+    struct player *player = (struct player *)context;
+    size_t bytes = player->out->common.get_buffer_size(&player->out->common);
+    size_t samples = bytes / sizeof(int16_t), i;
+    int16_t *buffer = malloc(bytes);
+
+    for (i = 0; i < samples; i++)
+        buffer[i] = LEVEL;
+    while (!android_atomic_acquire_load(&player->stop))
+        EXPECT(player->out->write(player->out, buffer, bytes) == (ssize_t)bytes);
+    free(buffer);
+    return NULL;
+}
+
+static void wait_switches(struct audio_device *adev, int32_t count)
+{
+    int64_t deadline = test_now_us() + SWITCH_TIMEOUT_US;
+    while (android_atomic_acquire_load(&adev->router.switches) < count &&
+            test_now_us() < deadline)
+        usleep(1000);
+    EXPECT(android_atomic_acquire_load(&adev->router.switches) >= count);
+}
+
+static void test_switches(const char *dir)
+{
+    struct audio_hw_device *dev = test_open_device();
+    struct audio_device *adev = (struct audio_device *)dev;
+    struct player player = { 0 };
+    double durations[SWITCHES];
+    unsigned int i, j, unsafe_order = 0, unfaded = 0, logged;
+    pthread_t thread;
+
+    player.out = test_open_output(dev, AUDIO_DEVICE_OUT_SPEAKER, OUT_SAMPLE_RATE,
+            AUDIO_CHANNEL_OUT_STEREO);
+    if (!player.out)
+        return;
+    pthread_create(&thread, NULL, play, &player);
+    // Running steadily, with the fade delay published
+    usleep(200000);
+    int32_t switches = android_atomic_acquire_load(&adev->router.switches);
+    test_set_fade_gain(&adev->router.gain);
+
+    for (i = 0; i < SWITCHES; i++) {
+        char kvpairs[32];
+        snprintf(kvpairs, sizeof(kvpairs), "%s=%d", AUDIO_PARAMETER_STREAM_ROUTING,
+                (i & 1) ? AUDIO_DEVICE_OUT_SPEAKER : AUDIO_DEVICE_OUT_WIRED_HEADPHONE);
+        unsigned int first = test_get_write_count();
+        int64_t start = test_now_us();
+        EXPECT(!player.out->common.set_parameters(&player.out->common, kvpairs));
+        durations[i] = test_now_us() - start;
+        wait_switches(adev, switches + i + 1);
+
+        // Under the lock, the worker may still be logging
+        bool enabling = false;
+        pthread_mutex_lock(&test_writes_lock);
+        for (j = first; j < test_write_count; j++) {
+            unsafe_order += enabling && test_writes[j].disables;
+            enabling |= !test_writes[j].disables;
+            unfaded += test_writes[j].gain != 0;
+        }
+        logged = test_write_count;
+        pthread_mutex_unlock(&test_writes_lock);
+        EXPECT(logged > first);
+        // Faded back in and heard before the next one
+        usleep(100000);
+    }
+    android_atomic_release_store(1, &player.stop);
+    pthread_join(thread, NULL);
+    test_set_fade_gain(NULL);
+    // A slow host underruns: silence the fade had no part in
+    int32_t underruns = android_atomic_acquire_load(
+            &((struct stream_out *)player.out)->stats.underruns);
+    dev->close_output_stream(dev, player.out);
+    test_close_device(dev);
+
+    /*
+     * Left channel: dips to silence, the largest step between frames and the
+     * steps larger than a ramp step, with some rounding, where a hard mute
+     * would step by LEVEL. Each underrun adds a dip with a click either side.
+     */
+    size_t size = 0, frames, dips = 0, clicks = 0;
+    int16_t *data = test_read_recording(dir, CARD, DEVICE, &size);
+    int max_step = 0;
+    frames = size / (2 * sizeof(int16_t));
+    for (i = 1; data && i < frames; i++) {
+        int step = abs(data[i * 2] - data[(i - 1) * 2]);
+        if (step > max_step)
+            max_step = step;
+        clicks += step > 2 * LEVEL / VOLUME_RAMP_FRAMES;
+        dips += !data[i * 2] && data[(i - 1) * 2];
+    }
+    free(data);
+
+    double p50 = test_percentile(durations, SWITCHES, 50);
+    double max = test_percentile(durations, SWITCHES, 100);
+    printf("routing call p50 %.0f us, max %.0f us; %u writes out of order, %u not faded out;"
+            " %zu dips, largest step %d, %zu clicks, %d underruns\n", p50, max, unsafe_order,
+            unfaded, dips, max_step, clicks, underruns);
+    EXPECT(max < CALL_MAX_US);
+    EXPECT(!unsafe_order);
+    EXPECT(!unfaded);
+    EXPECT(dips >= SWITCHES && dips <= SWITCHES + (size_t)underruns);
+    EXPECT(clicks <= 2 * (size_t)underruns);
+}
+
+int main(void)
+{
+    test_run_case(test_switches);
+    return test_result("route_switch_test");
+}
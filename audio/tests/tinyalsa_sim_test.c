@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The simulated sound card the other tests stand on: playback is paced by
+ * the clock and recorded, injected underruns leave gaps in the recording,
+ * injected delays hit every Nth call and mixer controls belong to the card.
+ */
+
+#include <sound/asound.h>
+#include <tinyalsa/asoundlib.h>
+
+#include "hal_test.h"
+
+#define RATE 48000
+#define PERIOD 1024
+#define PERIODS 2
+
+static struct pcm_config config = {
+    .channels = 2,
+    .rate = RATE,
+    .period_size = PERIOD,
+    .period_count = PERIODS,
+    .format = PCM_FORMAT_S16_LE,
+};
+
+// Writes frames of a ramp, one period per call, and checks the recording against it
+static void write_ramp(const char *dir, unsigned int frames, size_t *recorded)
+{
+    struct pcm *pcm = pcm_open(0, 0, PCM_OUT, &config);
+    int16_t buffer[PERIOD * 2];
+    unsigned int i, n;
+    size_t bytes = 0;
+    int16_t *data;
+
+    EXPECT(pcm_is_ready(pcm));
+    for (n = 0; n < frames; n += PERIOD) {
+        for (i = 0; i < PERIOD * 2; i++)
+            buffer[i] = (int16_t)(n * 2 + i);
+        EXPECT(!pcm_write(pcm, buffer, sizeof(buffer)));
+    }
+    pcm_close(pcm);
+    data = test_read_recording(dir, 0, 0, &bytes);
+    EXPECT(data != NULL);
+    *recorded = bytes / 4;
+    free(data);
+}
+
+static void test_pacing(const char *dir)
+{
+    unsigned int frames = 24 * PERIOD;
+    size_t recorded = 0;
+    int64_t start = test_now_us();
+
+    write_ramp(dir, frames, &recorded);
+    // The last buffer is still queued when the writes return
+    double elapsed_ms = (test_now_us() - start) / 1000.0;
+    double expected_ms = (frames - PERIOD * PERIODS) * 1000.0 / RATE;
+    EXPECT(elapsed_ms >= expected_ms - 2);
+    EXPECT(elapsed_ms < expected_ms + 100);
+    EXPECT(recorded == frames);
+
+    size_t bytes;
+    int16_t *data = test_read_recording(dir, 0, 0, &bytes);
+    unsigned int i, mismatches = 0;
+    for (i = 0; data && i < bytes / 2; i++)
+        mismatches += data[i] != (int16_t)i;
+    EXPECT(mismatches == 0);
+    free(data);
+}
+
+static void test_xruns(const char *dir)
+{
+    unsigned int frames = 16 * PERIOD;
+    size_t recorded = 0;
+
+    write_ramp(dir, frames, &recorded);
+    // Each stall of a buffer and a period leaves the DAC a period without data,
+    // recorded as silence
+    EXPECT(recorded >= frames + 3 * PERIOD);
+}
+
+static void test_delays(const char *dir)
+{
+    struct pcm *pcm = pcm_open(0, 0, PCM_OUT, &config);
+    int16_t buffer[64 * 2] = { 0 };
+    unsigned int i, slow = 0;
+
+    // 20 short writes fit the buffer: only the injected delays block
+    for (i = 0; i < 20; i++) {
+        int64_t start = test_now_us();
+        pcm_write(pcm, buffer, sizeof(buffer));
+        slow += test_now_us() - start >= 5000;
+    }
+    EXPECT(slow == 2);
+    pcm_close(pcm);
+}
+
+static void test_mixer(const char *dir)
+{
+    struct mixer *hal = mixer_open(0);
+    struct mixer *reader = mixer_open(0);
+    struct mixer *other = mixer_open(1);
+    struct snd_aes_iec958 status, readback;
+
+    EXPECT(!mixer_ctl_set_value(mixer_get_ctl_by_name(hal, "Speaker Switch"), 0, 1));
+    EXPECT(mixer_ctl_get_value(mixer_get_ctl_by_name(reader, "Speaker Switch"), 0) == 1);
+    EXPECT(mixer_ctl_get_value(mixer_get_ctl_by_name(other, "Speaker Switch"), 0) == 0);
+
+    memset(&status, 0, sizeof(status));
+    status.status[0] = 0x06;
+    status.status[3] = 0x02;
+    EXPECT(!mixer_ctl_set_array(mixer_get_ctl_by_name(hal, "IEC958 Playback Default"), &status, 1));
+    mixer_close(hal);
+    EXPECT(!mixer_ctl_get_array(mixer_get_ctl_by_name(reader, "IEC958 Playback Default"), &readback, 1));
+    EXPECT(!memcmp(&status, &readback, sizeof(status)));
+    mixer_close(reader);
+    mixer_close(other);
+}
+
+int main(void)
+{
+    test_run_case(test_pacing);
+    setenv("TINYALSA_SIM_XRUN_EVERY", "4", 1);
+    test_run_case(test_xruns);
+    unsetenv("TINYALSA_SIM_XRUN_EVERY");
+    setenv("TINYALSA_SIM_DELAY_US", "5000", 1);
+    setenv("TINYALSA_SIM_DELAY_EVERY", "10", 1);
+    test_run_case(test_delays);
+    unsetenv("TINYALSA_SIM_DELAY_US");
+    unsetenv("TINYALSA_SIM_DELAY_EVERY");
+    test_run_case(test_mixer);
+    return test_result("tinyalsa_sim_test");
+}
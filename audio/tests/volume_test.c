@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Software volume: the ramp after a gain change, the steady state kernel
+ * against the Q15 reference and the throughput of volume_apply() in frames
+ * per microsecond, on the NEON kernel where the build has it and on the
+ * scalar one elsewhere.
+ */
+
+#include "hal_test.h"
+
+#include "audio_hw.c"
+
+#define FRAMES 1024
+#define BENCH_MS 200
+
+static int16_t src[FRAMES * 2];
+static int16_t dst[FRAMES * 2];
+
+// Prints the frames per microsecond of volume_apply() at the given gains
+static void bench(const char *name, int32_t gain, int32_t master_gain, unsigned int channels)
+{
+    struct out_volume vol;
+    uint64_t frames = 0;
+
+    volume_init(&vol);
+    vol.gain[0] = vol.gain[1] = gain;
+    // Past the ramp
+    volume_apply(&vol, master_gain, dst, src, FRAMES, channels);
+    int64_t start = test_now_us(), now;
+    do {
+        volume_apply(&vol, master_gain, dst, src, FRAMES, channels);
+        frames += FRAMES;
+    } while ((now = test_now_us()) - start < BENCH_MS * 1000);
+    printf("%s: %.1f frames/us\n", name, (double)frames / (now - start));
+}
+
+int main(void)
+{
+    struct out_volume vol;
+    unsigned int i;
+    int32_t gain = volume_to_gain(0.5f);
+
+    // The ramp from unity to half never overshoots and lands on the target
+    volume_init(&vol);
+    vol.gain[0] = vol.gain[1] = gain;
+    for (i = 0; i < FRAMES * 2; i++)
+        src[i] = 16384;
+    volume_apply(&vol, VOLUME_UNITY, dst, src, FRAMES, 2);
+    for (i = 1; i < VOLUME_RAMP_FRAMES; i++)
+        EXPECT(dst[i * 2] <= dst[(i - 1) * 2] && dst[i * 2] >= 8192);
+    EXPECT(dst[VOLUME_RAMP_FRAMES * 2] == 8192);
+    EXPECT(dst[FRAMES * 2 - 1] == 8192);
+
+    // The steady state is the Q15 product of the stream and master gains
+    for (i = 0; i < FRAMES * 2; i++)
+        src[i] = (int16_t)((i * 7919) & 0xffff);
+    int32_t master_gain = volume_to_gain(0.8f);
+    int32_t target = (gain * master_gain + 0x4000) >> 15;
+    volume_init(&vol);
+    vol.gain[0] = vol.gain[1] = gain;
+    volume_apply(&vol, master_gain, dst, src, FRAMES, 2);
+    volume_apply(&vol, master_gain, dst, src, FRAMES, 2);
+    for (i = 0; i < FRAMES * 2; i++) {
+        if (dst[i] != (int16_t)((src[i] * target + 0x4000) >> 15)) {
+            EXPECT(!"steady state differs from the reference");
+            break;
+        }
+    }
+
+#ifdef __ARM_NEON__
+    printf("kernel: NEON\n");
+#else
+    printf("kernel: scalar\n");
+#endif
+    bench("unity, stereo", VOLUME_UNITY, VOLUME_UNITY, 2);
+    bench("stream gain, stereo", gain, VOLUME_UNITY, 2);
+    bench("stream and master gain, stereo", gain, master_gain, 2);
+    bench("stream gain, mono", gain, VOLUME_UNITY, 1);
+    return test_result("volume_test");
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Wakeups of the writing thread per second of audio for each output
+ * profile. The stream is switched with the output_profile parameter and
+ * written a buffer at a time, as fast as the PCM takes it; every time the
+ * thread blocks in the PCM and wakes up again counts as a voluntary context
+ * switch. The buffer is filled first so that only steady state is counted.
+ */
+
+// For RUSAGE_THREAD
+#define _GNU_SOURCE
+#include <sys/resource.h>
+
+#include "hal_test.h"
+
+#include "audio_hw.c"
+
+#include "audio_hw_test.h"
+
+#define PLAY_MS 2000
+
+static long thread_wakeups(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_nvcsw;
+}
+
+// Returns the wakeups per second of audio
+static double measure(struct audio_hw_device *dev, const char *profile)
+{
+    struct audio_stream_out *out = test_open_output(dev, AUDIO_DEVICE_OUT_SPEAKER,
+            OUT_SAMPLE_RATE, AUDIO_CHANNEL_OUT_STEREO);
+    char parameter[64];
+    unsigned int i;
+
+    if (!out)
+        return 0;
+    snprintf(parameter, sizeof(parameter), "%s=%s", OUT_PARAMETER_PROFILE, profile);
+    EXPECT(!out->common.set_parameters(&out->common, parameter));
+    struct stream_out *lostream = (struct stream_out *)out;
+    size_t bytes = out->common.get_buffer_size(&out->common);
+    size_t frames = test_buffer_frames(out);
+    uint32_t rate = out->common.get_sample_rate(&out->common);
+    void *buffer = calloc(1, bytes);
+    unsigned int writes = PLAY_MS * (uint64_t)rate / 1000 / frames;
+
+    for (i = 0; i < lostream->config.period_count; i++)
+        EXPECT(out->write(out, buffer, bytes) == (ssize_t)bytes);
+    long before = thread_wakeups();
+    for (i = 0; i < writes; i++)
+        EXPECT(out->write(out, buffer, bytes) == (ssize_t)bytes);
+    long wakeups = thread_wakeups() - before;
+    double seconds = (double)writes * frames / rate;
+    dev->close_output_stream(dev, out);
+    free(buffer);
+
+    printf("%s: %zu frame writes, %ld wakeups in %.2f s of audio, %.1f per second\n",
+            profile, frames, wakeups, seconds, wakeups / seconds);
+    return wakeups / seconds;
+}
+
+int main(void)
+{
+    test_record_dir();
+    struct audio_hw_device *dev = test_open_device();
+
+    double low_latency = measure(dev, out_profiles[OUT_PROFILE_LOW_LATENCY].name);
+    double primary = measure(dev, out_profiles[OUT_PROFILE_PRIMARY].name);
+    double deep_buffer = measure(dev, out_profiles[OUT_PROFILE_DEEP_BUFFER].name);
+    test_close_device(dev);
+
+    // About one wakeup per period, and the deep buffer has eight times longer ones
+    EXPECT_NEAR(primary, (double)OUT_SAMPLE_RATE / OUT_PERIOD_SIZE, 10);
+    EXPECT(low_latency > primary);
+    EXPECT(deep_buffer > 0 && deep_buffer < primary / 4);
+    return test_result("wakeup_test");
+}
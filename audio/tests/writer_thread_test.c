@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2014 Ivan Krakhmaliuk (LifeDJIK)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Write-call latency with and without the writer thread on a slow PCM,
+ * whose every 5th pcm_write() stalls for most of a period. The writes come
+ * a period apart, as from a mixer on its own clock. Direct writes pass the
+ * stall on to the caller; the ring of the writer thread absorbs it. Prints
+ * p50/p99 for both and checks every frame still reaches the PCM, the tail
+ * the writer thread drains at close included.
+ */
+
+#include "hal_test.h"
+
+#include "audio_hw.c"
+
+#include "audio_hw_test.h"
+
+#define WRITES 100
+#define PREROLL 2
+#define STALL_US 15000
+
+// Returns the p99 of the write calls
+static double measure(const char *dir, const char *name)
+{
+    struct audio_hw_device *dev = test_open_device();
+    struct audio_stream_out *out = test_open_output(dev, AUDIO_DEVICE_OUT_SPEAKER,
+            OUT_SAMPLE_RATE, AUDIO_CHANNEL_OUT_STEREO);
+    double durations[WRITES];
+    size_t before = 0, after = 0;
+    unsigned int i;
+
+    if (!out)
+        return 0;
+    size_t bytes = out->common.get_buffer_size(&out->common);
+    int16_t *buffer = calloc(1, bytes);
+    free(test_read_recording(dir, CARD, DEVICE, &before));
+    // A period apart, after two at once to fill the PCM
+    int64_t period_us = test_buffer_frames(out) * 1000000LL / out->common.get_sample_rate(&out->common);
+    int64_t next = test_now_us();
+    for (i = 0; i < WRITES; i++) {
+        if (i >= PREROLL) {
+            next += period_us;
+            int64_t now = test_now_us();
+            if (next > now)
+                usleep(next - now);
+        }
+        int64_t start = test_now_us();
+        EXPECT(out->write(out, buffer, bytes) == (ssize_t)bytes);
+        durations[i] = test_now_us() - start;
+    }
+    dev->close_output_stream(dev, out);
+    test_close_device(dev);
+    free(buffer);
+
+    free(test_read_recording(dir, CARD, DEVICE, &after));
+    // A lost tail would take frames away; scheduling hiccups of the host may add silence
+    EXPECT(after - before >= WRITES * bytes);
+
+    double p50 = test_percentile(durations, WRITES, 50);
+    double p99 = test_percentile(durations, WRITES, 99);
+    printf("%s: write p50 %.0f us, p99 %.0f us\n", name, p50, p99);
+    return p99;
+}
+
+int main(void)
+{
+    const char *dir = test_record_dir();
+    char stall[16];
+
+    snprintf(stall, sizeof(stall), "%d", STALL_US);
+    setenv("TINYALSA_SIM_DELAY_US", stall, 1);
+    setenv("TINYALSA_SIM_DELAY_EVERY", "5", 1);
+
+    double direct_p99 = measure(dir, "direct");
+    test_set_property(OUT_PROPERTY_WRITER_THREAD, "on");
+    double writer_p99 = measure(dir, "writer thread");
+    // The stall shows in the direct p99 and is gone from the writer's
+    EXPECT(direct_p99 >= STALL_US);
+    EXPECT(writer_p99 < STALL_US / 10);
+    return test_result("writer_thread_test");
+}